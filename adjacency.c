@@ -0,0 +1,107 @@
+#include "adjacency.h"
+
+static inline uint32_t hop_slot(struct adjacency_table *t, uint32_t next_hop)
+{
+	return (next_hop * 2654435761u >> 7) & t->hop_mask;
+}
+
+/* Slot of a next hop in the hop table, or the empty slot it would take */
+static uint32_t hop_find(struct adjacency_table *t, uint32_t next_hop)
+{
+	uint32_t i = hop_slot(t, next_hop);
+
+	while (t->hop_first[i] != -1 && t->hop_keys[i] != next_hop)
+		i = (i + 1) & t->hop_mask;
+	return i;
+}
+
+struct adjacency_table *adjacency_create(struct route_table_entry *rtable, int rtable_len)
+{
+	struct adjacency_table *t = malloc(sizeof(struct adjacency_table));
+	DIE(t == NULL, "malloc adjacency table");
+
+	uint32_t n = 2;
+	while (n < 2 * (uint32_t)rtable_len)
+		n <<= 1;
+	t->hop_mask = n - 1;
+	t->hop_keys = malloc(sizeof(uint32_t) * n);
+	t->hop_first = malloc(sizeof(int) * n);
+	t->route_adj = malloc(sizeof(int) * (rtable_len > 0 ? rtable_len : 1));
+	/* At most one adjacency per route */
+	size_t size = (sizeof(struct adjacency) * (rtable_len > 0 ? rtable_len : 1) + 63) & ~(size_t)63;
+	t->slots = aligned_alloc(64, size);
+	DIE(t->hop_keys == NULL || t->hop_first == NULL || t->route_adj == NULL ||
+	    t->slots == NULL, "malloc adjacency table");
+	memset(t->hop_first, -1, sizeof(int) * n);
+	t->count = 0;
+
+	for (int r = 0; r < rtable_len; r++) {
+		uint32_t h = hop_find(t, rtable[r].next_hop);
+		int a = t->hop_first[h];
+		while (a != -1 && t->slots[a].interface != rtable[r].interface)
+			a = t->slots[a].next;
+		if (a == -1) {
+			a = t->count++;
+			struct adjacency *adj = &t->slots[a];
+			memset(adj, 0, sizeof(struct adjacency));
+			adj->next_hop = rtable[r].next_hop;
+			adj->interface = rtable[r].interface;
+			adj->next = t->hop_first[h];
+			t->hop_keys[h] = rtable[r].next_hop;
+			t->hop_first[h] = a;
+		}
+		t->route_adj[r] = a;
+	}
+	pthread_mutex_init(&t->lock, NULL);
+	return t;
+}
+
+bool adjacency_write_header(struct adjacency *adj, char *frame)
+{
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&adj->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;	/* being rewritten */
+		if (!adj->resolved)
+			return false;
+		memcpy(frame, adj->header, ETH_HLEN);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || __atomic_load_n(&adj->seq, __ATOMIC_RELAXED) != seq);
+	return true;
+}
+
+/* Rewrites the header of an adjacency, with the table locked */
+static void adjacency_rewrite(struct adjacency *adj, const uint8_t *mac)
+{
+	struct ether_header *eth = (struct ether_header *)adj->header;
+
+	__atomic_store_n(&adj->seq, adj->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memmove(eth->ether_dhost, mac, ETH_ALEN);
+	memcpy(eth->ether_shost, interface_table[adj->interface].mac, ETH_ALEN);
+	eth->ether_type = htons(ETHERTYPE_IP);
+	adj->resolved = 1;
+	__atomic_store_n(&adj->seq, adj->seq + 1, __ATOMIC_RELEASE);
+}
+
+void adjacency_resolve(struct adjacency_table *t, uint32_t next_hop, const uint8_t *mac)
+{
+	pthread_mutex_lock(&t->lock);
+	uint32_t h = hop_find(t, next_hop);
+	for (int a = t->hop_first[h]; a != -1; a = t->slots[a].next)
+		adjacency_rewrite(&t->slots[a], mac);
+	pthread_mutex_unlock(&t->lock);
+}
+
+void adjacency_refresh(struct adjacency_table *t)
+{
+	pthread_mutex_lock(&t->lock);
+	for (int a = 0; a < t->count; a++) {
+		struct adjacency *adj = &t->slots[a];
+		if (adj->resolved)
+			adjacency_rewrite(adj, adj->header);	/* same next hop MAC */
+	}
+	pthread_mutex_unlock(&t->lock);
+}
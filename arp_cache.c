@@ -0,0 +1,51 @@
+#include "arp_cache.h"
+
+static inline uint32_t arp_cache_slot(struct arp_cache *ac, uint32_t ip)
+{
+	return (ip * 2654435761u >> 7) & ac->slot_mask;
+}
+
+struct arp_cache *arp_cache_create(uint32_t capacity)
+{
+	struct arp_cache *ac = malloc(sizeof(struct arp_cache));
+	DIE(ac == NULL, "malloc arp cache");
+
+	if (capacity > ARP_CACHE_MAX_CAPACITY)
+		capacity = ARP_CACHE_MAX_CAPACITY;
+	uint32_t n = 2;
+	while (n < 2 * capacity)
+		n <<= 1;
+	ac->slots = calloc(n, sizeof(struct arp_entry));
+	DIE(ac->slots == NULL, "calloc arp cache");
+	ac->slot_mask = n - 1;
+	ac->capacity = capacity;
+	ac->count = 0;
+	pthread_mutex_init(&ac->lock, NULL);
+	return ac;
+}
+
+int arp_cache_update(struct arp_cache *ac, uint32_t ip, uint8_t *mac)
+{
+	int ret = 1;
+
+	pthread_mutex_lock(&ac->lock);
+	uint32_t i = arp_cache_slot(ac, ip);
+	while (ac->slots[i].ip != 0 && ac->slots[i].ip != ip)
+		i = (i + 1) & ac->slot_mask;
+
+	if (ac->slots[i].ip == ip) {
+		if (memcmp(ac->slots[i].mac, mac, ETH_ALEN) == 0) {
+			ret = 0;
+		} else {
+			memcpy(ac->slots[i].mac, mac, ETH_ALEN);
+		}
+	} else if (ac->count == ac->capacity) {
+		ret = -1;
+	} else {
+		ac->slots[i].ip = ip;
+		memcpy(ac->slots[i].mac, mac, ETH_ALEN);
+		ac->count++;
+	}
+	pthread_mutex_unlock(&ac->lock);
+	return ret;
+}
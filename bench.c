@@ -0,0 +1,413 @@
+#include <stdbool.h>
+#include <time.h>
+#include <math.h>
+#include <sys/wait.h>
+#include "skel.h"
+#include "fib.h"
+#include "route_cache.h"
+#include "adjacency.h"
+#include "arp_cache.h"
+#include "packet_pool.h"
+#include "checksum.h"
+#include "rng.h"
+
+/*
+ * In-process forwarding benchmark, built with `make bench`. Every
+ * scenario runs the code of router.c on generated frames without any
+ * I/O: sent frames are only counted. Prints one JSON object per
+ * scenario and route table.
+ *
+ *	./router-bench [rtable...]	default rtable0.txt rtable1.txt
+ *	./router-bench checksum		checksum kernels only
+ *
+ * BENCH_PACKETS sets the packets per scenario (default 1M); the router
+ * variables (ROUTER_FIB, ROUTER_ROUTE_CACHE_SETS, ...) apply as usual.
+ * The checksum kernels are timed after the tables, against the
+ * icmp_checksum and ip_checksum of skel.c, on ICMP messages of 64 to
+ * 1500 bytes.
+ */
+
+/* ICMP message sizes the checksum kernels are timed on */
+static const int checksum_sizes[] = { 64, 128, 256, 512, 1024, 1500 };
+
+/* Distinct destinations a stream is drawn from */
+#define BENCH_FLOWS 65536
+/* Exponent of the Zipf distribution of the skewed streams */
+#define BENCH_ZIPF_S 1.1
+/* Every n-th next hop stays unresolved in the ARP mix */
+#define BENCH_ARP_MISS_EVERY 10
+
+/* Defined in router.c */
+extern struct packet_pool* packetPool;
+extern struct fib* routeFib;
+extern struct route_table_entry* routeTable;
+extern struct adjacency_table* adjacencies;
+extern struct arp_cache* arp_table;
+extern __thread struct route_cache* routeCache;
+extern __thread int packetRoute;
+int setupRouter(const char* rtablePath, int numInterfaces);
+void workerInit(int id);
+void processBurst(packet** burst, int count, struct route_table_entry* routeTable);
+void resolveRoutes(packet** burst, int count, int* routes);
+void processPacket(packet* m, struct route_table_entry* routeTable);
+
+enum bench_frame {
+	FRAME_VALID,
+	FRAME_TTL_EXPIRED,
+	FRAME_BAD_CHECKSUM,
+};
+
+struct bench_result {
+	uint64_t packets;
+	uint64_t fib_lookups;
+	double seconds;
+	uint64_t p50, p99, p999;	/* ns */
+};
+
+static uint64_t sent;
+static int route_count;
+
+static void bench_send(packet *m)
+{
+	sent++;
+}
+
+static void bench_flush(void)
+{
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void percentiles(uint64_t *samples, uint64_t n, struct bench_result *r)
+{
+	qsort(samples, n, sizeof(uint64_t), cmp_u64);
+	r->p50 = samples[n / 2];
+	r->p99 = samples[n * 99 / 100];
+	r->p999 = samples[n * 999 / 1000];
+}
+
+/* Addresses inside random routes of the table, network order */
+static uint32_t *make_flows(void)
+{
+	uint32_t *flows = malloc(sizeof(uint32_t) * BENCH_FLOWS);
+	DIE(flows == NULL, "malloc flows");
+
+	for (int i = 0; i < BENCH_FLOWS; i++) {
+		int route;
+		do {
+			struct route_table_entry *r = &routeTable[rng() % route_count];
+			flows[i] = r->prefix | ((uint32_t)rng() & ~r->mask);
+			route = fib_lookup(routeFib, flows[i]);
+		} while (route == -1);
+	}
+	return flows;
+}
+
+/* Destination stream, uniform over the flows or Zipf distributed */
+static uint32_t *make_stream(uint32_t *flows, uint64_t n, bool skewed)
+{
+	uint32_t *stream = malloc(sizeof(uint32_t) * n);
+	double *cdf = malloc(sizeof(double) * BENCH_FLOWS);
+	DIE(stream == NULL || cdf == NULL, "malloc stream");
+
+	double sum = 0;
+	for (int k = 0; k < BENCH_FLOWS; k++) {
+		sum += 1.0 / pow(k + 1, BENCH_ZIPF_S);
+		cdf[k] = sum;
+	}
+	for (uint64_t i = 0; i < n; i++) {
+		if (!skewed) {
+			stream[i] = flows[rng() % BENCH_FLOWS];
+			continue;
+		}
+		double u = (rng() >> 11) * (1.0 / 9007199254740992.0) * sum;
+		int lo = 0, hi = BENCH_FLOWS - 1;
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		stream[i] = flows[lo];
+	}
+	free(cdf);
+	return stream;
+}
+
+/* UDP frame from host 0 to daddr, as received on interface 0 */
+static int build_frame(char *frame, uint32_t daddr, enum bench_frame kind)
+{
+	struct ether_header *eth = (struct ether_header *)frame;
+	struct iphdr *ip = (struct iphdr *)(frame + sizeof(struct ether_header));
+	int len = sizeof(struct ether_header) + sizeof(struct iphdr) + 8 + 18;
+
+	memset(frame, 0, len);
+	memcpy(eth->ether_dhost, interface_table[0].mac, ETH_ALEN);
+	hwaddr_aton("de:ad:be:ef:00:00", eth->ether_shost);
+	eth->ether_type = htons(ETHERTYPE_IP);
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->tot_len = htons(len - sizeof(struct ether_header));
+	ip->ttl = kind == FRAME_TTL_EXPIRED ? 1 : 64;
+	ip->protocol = IPPROTO_UDP;
+	ip->saddr = inet_addr("192.168.0.2");
+	ip->daddr = daddr;
+	ip->check = ip_checksum((uint8_t *)ip, sizeof(struct iphdr));
+	if (kind == FRAME_BAD_CHECKSUM)
+		ip->check ^= 0x5a5a;
+	return len;
+}
+
+/*
+ * Runs a destination stream through processBurst, like runWorker does.
+ * Building the frames is left out of the time. The first pass measures
+ * throughput, the second times every packet on its own for the
+ * percentiles, each with an even share of the batched route lookup.
+ */
+static void run_forward(uint32_t *stream, uint64_t n, enum bench_frame kind, struct bench_result *r)
+{
+	static char frames[BURST_SIZE][MAX_LEN];
+	static int lens[BURST_SIZE];
+	uint64_t *samples = malloc(sizeof(uint64_t) * n);
+	DIE(samples == NULL, "malloc samples");
+
+	for (int pass = 0; pass < 2; pass++) {
+		uint64_t misses = routeCache->misses;
+		uint64_t elapsed = 0;
+
+		for (uint64_t base = 0; base < n; base += BURST_SIZE) {
+			packet *burst[BURST_SIZE];
+			int count = n - base < BURST_SIZE ? n - base : BURST_SIZE;
+
+			for (int i = 0; i < count; i++) {
+				lens[i] = build_frame(frames[i], stream[base + i], kind);
+				burst[i] = packet_alloc(packetPool);
+				DIE(burst[i] == NULL, "packet pool exhausted");
+				memcpy(burst[i]->payload, frames[i], lens[i]);
+				burst[i]->len = lens[i];
+				burst[i]->interface = 0;
+			}
+			uint64_t start = now_ns();
+			if (pass == 0) {
+				processBurst(burst, count, routeTable);
+			} else {
+				int routes[BURST_SIZE];
+				resolveRoutes(burst, count, routes);
+				uint64_t share = (now_ns() - start) / count;
+				for (int i = 0; i < count; i++) {
+					uint64_t t = now_ns();
+					packetRoute = routes[i];
+					processPacket(burst[i], routeTable);
+					samples[base + i] = now_ns() - t + share;
+				}
+				packetRoute = FIB_UNRESOLVED;
+			}
+			flush_packet_batches();
+			for (int i = 0; i < count; i++)
+				packet_put(burst[i]);
+			elapsed += now_ns() - start;
+		}
+		if (pass == 0) {
+			r->seconds = elapsed / 1e9;
+			/* The router goes to the FIB exactly once per route cache miss */
+			r->fib_lookups = routeCache->misses - misses;
+		}
+	}
+	r->packets = n;
+	percentiles(samples, n, r);
+	free(samples);
+}
+
+/* Bare FIB lookups of a destination stream */
+static void run_lookup(uint32_t *stream, uint64_t n, struct bench_result *r)
+{
+	uint64_t *samples = malloc(sizeof(uint64_t) * n);
+	DIE(samples == NULL, "malloc samples");
+	volatile int sink = 0;
+
+	uint64_t start = now_ns();
+	for (uint64_t i = 0; i < n; i++)
+		sink += fib_lookup(routeFib, stream[i]);
+	r->seconds = (now_ns() - start) / 1e9;
+	for (uint64_t i = 0; i < n; i++) {
+		uint64_t t = now_ns();
+		sink += fib_lookup(routeFib, stream[i]);
+		samples[i] = now_ns() - t;
+	}
+	r->packets = n;
+	r->fib_lookups = n;
+	percentiles(samples, n, r);
+	free(samples);
+}
+
+static void report(const char *rtable, const char *scenario, struct bench_result *r)
+{
+	printf("{\"rtable\": \"%s\", \"scenario\": \"%s\", \"packets\": %lu, "
+	       "\"fib_lookups_per_s\": %.0f, \"pps\": %.0f, \"ns_per_pkt\": %.1f, "
+	       "\"p50_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu}\n",
+	       rtable, scenario, (unsigned long)r->packets,
+	       r->fib_lookups / r->seconds, r->packets / r->seconds,
+	       r->seconds * 1e9 / r->packets,
+	       (unsigned long)r->p50, (unsigned long)r->p99, (unsigned long)r->p999);
+}
+
+/* Answers the ARP request of every next hop, but every n-th if skip is set */
+static void resolve_next_hops(bool skip)
+{
+	uint8_t mac[ETH_ALEN] = { 0xde, 0xad, 0xbe, 0xef, 0x01, 0x00 };
+
+	for (int i = 0; i < adjacencies->count; i++) {
+		uint32_t hop = adjacencies->slots[i].next_hop;
+		if (skip && ntohl(hop) % BENCH_ARP_MISS_EVERY == 0)
+			continue;
+		mac[5] = hop >> 24;
+		arp_cache_update(arp_table, hop, mac);
+		adjacency_resolve(adjacencies, hop, mac);
+	}
+}
+
+static void bench_rtable(const char *path, uint64_t n)
+{
+	struct bench_result r;
+
+	route_count = setupRouter(path, ROUTER_NUM_INTERFACES);
+	workerInit(0);
+	DIE(route_count == 0, "empty route table");
+
+	uint32_t *flows = make_flows();
+	uint32_t *uniform = make_stream(flows, n, false);
+	uint32_t *skewed = make_stream(flows, n, true);
+
+	run_lookup(uniform, n, &r);
+	report(path, "lookup_random", &r);
+	run_lookup(skewed, n, &r);
+	report(path, "lookup_skewed", &r);
+
+	resolve_next_hops(false);
+	run_forward(uniform, n, FRAME_VALID, &r);
+	report(path, "forward_random", &r);
+	run_forward(skewed, n, FRAME_VALID, &r);
+	report(path, "forward_skewed", &r);
+	run_forward(uniform, n, FRAME_TTL_EXPIRED, &r);
+	report(path, "ttl_expire", &r);
+	run_forward(uniform, n, FRAME_BAD_CHECKSUM, &r);
+	report(path, "bad_checksum", &r);
+
+	/* Fresh adjacencies, a tenth of the next hops never answer */
+	adjacencies = adjacency_create(routeTable, route_count);
+	resolve_next_hops(true);
+	run_forward(uniform, n, FRAME_VALID, &r);
+	report(path, "arp_mix", &r);
+
+	free(flows);
+	free(uniform);
+	free(skewed);
+	fib_free(routeFib);
+}
+
+/* bench_rtable in a child, so every table starts from a fresh router */
+static void bench_rtable_process(const char *path, uint64_t n)
+{
+	int status;
+
+	fflush(stdout);
+	pid_t pid = fork();
+	DIE(pid == -1, "fork");
+	if (pid == 0) {
+		bench_rtable(path, n);
+		fflush(stdout);
+		_exit(0);
+	}
+	DIE(waitpid(pid, &status, 0) == -1, "waitpid");
+	DIE(!WIFEXITED(status) || WEXITSTATUS(status) != 0, "benchmark of a route table failed");
+}
+
+/* Checksum of one kernel, or of the skel.c functions for impl < 0 */
+static uint16_t bench_checksum(int impl, char *data, int len)
+{
+	if (impl == -2)
+		return icmp_checksum((uint16_t *)data, len);
+	if (impl == -1)
+		return ip_checksum((uint8_t *)data, len);
+	return ~checksum_fold(checksum_sum_impl(impl, data, len));
+}
+
+/*
+ * Times every kernel on a message where it sits in a frame, 2 bytes past
+ * a 4-byte boundary. All of them must agree, the skel.c ones included.
+ */
+static void bench_checksums(uint64_t n)
+{
+	char *frame = aligned_alloc(64, MAX_LEN + 64);
+	DIE(frame == NULL, "aligned_alloc frame");
+	for (int i = 0; i < MAX_LEN + 64; i++)
+		frame[i] = rng();
+	char *icmp = frame + sizeof(struct ether_header) + sizeof(struct iphdr);
+	volatile uint16_t sink;
+
+	for (size_t s = 0; s < sizeof(checksum_sizes) / sizeof(checksum_sizes[0]); s++) {
+		int len = checksum_sizes[s];
+		for (int impl = -2; impl < CHECKSUM_IMPLS; impl++) {
+			if (impl >= 0 && !checksum_supported(impl))
+				continue;
+			DIE(bench_checksum(impl, icmp, len) != icmp_checksum((uint16_t *)icmp, len),
+			    "checksum kernels disagree");
+			uint64_t start = now_ns();
+			for (uint64_t i = 0; i < n; i++) {
+				/* Vary a word so every call is computed */
+				icmp[2] = i;
+				sink = bench_checksum(impl, icmp, len);
+			}
+			double seconds = (now_ns() - start) / 1e9;
+			const char *name = impl == -2 ? "icmp_checksum" : impl == -1 ? "ip_checksum" :
+					   checksum_impl_name(impl);
+			printf("{\"scenario\": \"checksum\", \"impl\": \"%s\", \"bytes\": %d, "
+			       "\"calls\": %lu, \"ns_per_call\": %.1f, \"gbit_per_s\": %.2f}\n",
+			       name, len, (unsigned long)n, seconds * 1e9 / n, n * len * 8 / seconds / 1e9);
+		}
+	}
+	(void)sink;
+	free(frame);
+}
+
+int main(int argc, char *argv[])
+{
+	char *packets = getenv("BENCH_PACKETS");
+	uint64_t n = packets != NULL && atol(packets) > 0 ? atol(packets) : 1 << 20;
+
+	for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
+		snprintf(interface_table[i].name, IFNAMSIZ, "r-%d", i);
+		interface_table[i].ip = htonl(0xc0a80001 | i << 8);	/* 192.168.i.1 */
+		uint8_t mac[ETH_ALEN] = { 0xde, 0xfe, 0xc8, 0xed, 0x00, i };
+		memcpy(interface_table[i].mac, mac, ETH_ALEN);
+		interface_table[i].mtu = 1500;
+	}
+	redirect_packet_output(bench_send, bench_flush);
+
+	if (argc == 2 && strcmp(argv[1], "checksum") == 0) {
+		bench_checksums(n);
+		return 0;
+	}
+	if (argc < 2) {
+		bench_rtable_process("rtable0.txt", n);
+		bench_rtable_process("rtable1.txt", n);
+	}
+	for (int i = 1; i < argc; i++)
+		bench_rtable_process(argv[i], n);
+	bench_checksums(n);
+	return 0;
+}
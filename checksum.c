@@ -0,0 +1,171 @@
+#include "checksum.h"
+#include "skel.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static uint64_t resolve(const void *data, size_t len);
+
+static uint64_t (*kernel)(const void *, size_t) = resolve;
+
+static const char *impl_names[CHECKSUM_IMPLS] = { "scalar", "sse2", "avx2" };
+
+/* 32-bit words into a 64-bit accumulator, which cannot overflow */
+static uint64_t sum_scalar(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint64_t a = 0, b = 0;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		uint32_t w[2];
+		memcpy(w, p, 8);
+		a += w[0];
+		b += w[1];
+	}
+	if (len >= 4) {
+		uint32_t w;
+		memcpy(&w, p, 4);
+		a += w;
+		p += 4;
+		len -= 4;
+	}
+	if (len >= 2) {
+		uint16_t w;
+		memcpy(&w, p, 2);
+		b += w;
+		p += 2;
+		len -= 2;
+	}
+	if (len) {
+		/* The odd byte is the first of a word padded with zero */
+		uint16_t w = 0;
+		memcpy(&w, p, 1);
+		a += w;
+	}
+	return a + b;
+}
+
+#if defined(__x86_64__)
+/*
+ * The vector kernels widen 32-bit words to 64-bit lanes and add them,
+ * so carries are kept in the upper halves and folded once at the end.
+ */
+static uint64_t sum_sse2(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a = zero, b = zero;
+
+	for (; len >= 32; len -= 32, p += 32) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		__m128i w = _mm_loadu_si128((const __m128i *)(p + 16));
+		a = _mm_add_epi64(a, _mm_unpacklo_epi32(v, zero));
+		b = _mm_add_epi64(b, _mm_unpackhi_epi32(v, zero));
+		a = _mm_add_epi64(a, _mm_unpacklo_epi32(w, zero));
+		b = _mm_add_epi64(b, _mm_unpackhi_epi32(w, zero));
+	}
+	a = _mm_add_epi64(a, b);
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i *)lanes, a);
+	return lanes[0] + lanes[1] + sum_scalar(p, len);
+}
+
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i a = zero, b = zero;
+
+	for (; len >= 64; len -= 64, p += 64) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)p);
+		__m256i w = _mm256_loadu_si256((const __m256i *)(p + 32));
+		a = _mm256_add_epi64(a, _mm256_unpacklo_epi32(v, zero));
+		b = _mm256_add_epi64(b, _mm256_unpackhi_epi32(v, zero));
+		a = _mm256_add_epi64(a, _mm256_unpacklo_epi32(w, zero));
+		b = _mm256_add_epi64(b, _mm256_unpackhi_epi32(w, zero));
+	}
+	if (len >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)p);
+		a = _mm256_add_epi64(a, _mm256_unpacklo_epi32(v, zero));
+		b = _mm256_add_epi64(b, _mm256_unpackhi_epi32(v, zero));
+		p += 32;
+		len -= 32;
+	}
+	a = _mm256_add_epi64(a, b);
+	__m128i s = _mm_add_epi64(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1));
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i *)lanes, s);
+	return lanes[0] + lanes[1] + sum_scalar(p, len);
+}
+#endif
+
+bool checksum_supported(enum checksum_impl impl)
+{
+	switch (impl) {
+	case CHECKSUM_SCALAR:
+		return true;
+#if defined(__x86_64__)
+	case CHECKSUM_SSE2:
+		return true;
+	case CHECKSUM_AVX2:
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		return false;
+	}
+}
+
+const char *checksum_impl_name(enum checksum_impl impl)
+{
+	return impl < CHECKSUM_IMPLS ? impl_names[impl] : "?";
+}
+
+uint64_t checksum_sum_impl(enum checksum_impl impl, const void *data, size_t len)
+{
+	switch (impl) {
+#if defined(__x86_64__)
+	case CHECKSUM_SSE2:
+		return sum_sse2(data, len);
+	case CHECKSUM_AVX2:
+		return sum_avx2(data, len);
+#endif
+	default:
+		return sum_scalar(data, len);
+	}
+}
+
+/* Picks the kernel on the first call; racing threads pick the same */
+static uint64_t resolve(const void *data, size_t len)
+{
+	enum checksum_impl impl = CHECKSUM_SCALAR;
+	char *name = getenv("ROUTER_CHECKSUM");
+
+	if (name != NULL) {
+		for (impl = 0; impl < CHECKSUM_IMPLS; impl++) {
+			if (strcmp(name, impl_names[impl]) == 0)
+				break;
+		}
+		DIE(impl == CHECKSUM_IMPLS, "unknown ROUTER_CHECKSUM, use scalar, sse2 or avx2");
+		DIE(!checksum_supported(impl), "ROUTER_CHECKSUM kernel not supported by this CPU");
+	} else if (checksum_supported(CHECKSUM_AVX2)) {
+		impl = CHECKSUM_AVX2;
+	} else if (checksum_supported(CHECKSUM_SSE2)) {
+		impl = CHECKSUM_SSE2;
+	}
+
+	uint64_t (*k)(const void *, size_t) = sum_scalar;
+#if defined(__x86_64__)
+	if (impl == CHECKSUM_SSE2)
+		k = sum_sse2;
+	else if (impl == CHECKSUM_AVX2)
+		k = sum_avx2;
+#endif
+	__atomic_store_n(&kernel, k, __ATOMIC_RELAXED);
+	return k(data, len);
+}
+
+uint64_t checksum_sum(const void *data, size_t len)
+{
+	return __atomic_load_n(&kernel, __ATOMIC_RELAXED)(data, len);
+}
@@ -0,0 +1,215 @@
+#include "skel.h"
+#include "checksum.h"
+#include "rng.h"
+
+/*
+ * Property test of checksum.c, built and run by `make check`: every
+ * kernel and every incremental update must give what a full recompute
+ * gives. Word updates are checked for all 2^32 pairs of old and new
+ * value, byte fields for all their values in real headers. Prints the
+ * first difference and exits with 1, or the number of cases.
+ */
+
+static uint64_t cases;
+
+static void fail(const char *what, uint64_t a, uint64_t b, uint16_t got, uint16_t want)
+{
+	printf("FAIL %s: %#lx %#lx: got %#06x, full recompute %#06x\n", what,
+	       (unsigned long)a, (unsigned long)b, got, want);
+	exit(1);
+}
+
+/* Byte by byte, the definition */
+static uint16_t reference(const uint8_t *p, size_t len)
+{
+	uint64_t sum = 0;
+
+	for (size_t i = 0; i < len; i += 2) {
+		uint8_t w[2] = { p[i], i + 1 < len ? p[i + 1] : 0 };
+		uint16_t v;
+		memcpy(&v, w, 2);
+		sum += v;
+	}
+	return ~checksum_fold(sum);
+}
+
+/* Every kernel, every length up to MAX_LEN and every alignment */
+static void test_kernels(void)
+{
+	uint8_t *buf = aligned_alloc(64, MAX_LEN + 128);
+	DIE(buf == NULL, "aligned_alloc");
+
+	for (int round = 0; round < 3; round++) {
+		/* Random data, then all ones to push every carry */
+		for (int i = 0; i < MAX_LEN + 128; i++)
+			buf[i] = round == 2 ? 0xff : rng();
+		for (int off = 0; off < 64; off += round == 0 ? 1 : 7) {
+			for (int len = 0; len <= MAX_LEN; len++) {
+				uint16_t want = reference(buf + off, len);
+				for (int impl = 0; impl < CHECKSUM_IMPLS; impl++) {
+					if (!checksum_supported(impl))
+						continue;
+					uint16_t got = ~checksum_fold(checksum_sum_impl(impl, buf + off, len));
+					if (got != want)
+						fail(checksum_impl_name(impl), off, len, got, want);
+					cases++;
+				}
+			}
+		}
+	}
+	free(buf);
+}
+
+/*
+ * All old and new values of a word, with the rest of the data summing
+ * to a value that changes with the old one. -0 and +0 are the same
+ * checksum; only data that is all zero sums to +0, so the update and
+ * the recompute may only differ there.
+ */
+static void test_update16(void)
+{
+	for (uint32_t from = 0; from <= 0xffff; from++) {
+		uint32_t rest = (from * 40503u) & 0xffff;
+		uint16_t check = ~checksum_fold(rest + from);
+		for (uint32_t to = 0; to <= 0xffff; to++) {
+			uint16_t got = checksum_update16(check, from, to);
+			uint16_t want = ~checksum_fold(rest + to);
+			if (got != want && !(rest == 0 && to == 0 && got == 0))
+				fail("checksum_update16", from, to, got, want);
+		}
+	}
+	cases += 1ull << 32;
+}
+
+/* Addresses: random pairs and every pair of extreme halves */
+static void test_update32(void)
+{
+	static const uint32_t edges[] = { 0, 1, 0xffff, 0x10000, 0xfffe, 0xffff0000, 0x7fffffff, 0xffffffff };
+	uint8_t hdr[20];
+
+	for (uint64_t k = 0; k < (1 << 24) + 64; k++) {
+		for (int i = 0; i < 20; i++)
+			hdr[i] = rng();
+		uint32_t from, to;
+		if (k < 64) {
+			from = edges[k / 8];
+			to = edges[k % 8];
+		} else {
+			from = rng();
+			to = rng();
+		}
+		/* Any even offset clear of the checksum at 10 */
+		static const int offsets[] = { 0, 2, 4, 6, 12, 14, 16 };
+		int at = offsets[rng() % 7];
+		memcpy(hdr + at, &from, 4);
+		memset(hdr + 10, 0, 2);
+		uint16_t check = checksum(hdr, 20);
+		memcpy(hdr + 10, &check, 2);
+		checksum_replace32((uint16_t *)(hdr + 10), hdr + at, to);
+		memcpy(&check, hdr + 10, 2);
+		memset(hdr + 10, 0, 2);
+		uint16_t want = checksum(hdr, 20);
+		if (check != want)
+			fail("checksum_replace32", from, to, check, want);
+		cases++;
+	}
+}
+
+/* An IPv4 header with a valid checksum and random addresses */
+static void make_ip(struct iphdr *ip, uint8_t tos, uint8_t ttl, uint8_t protocol)
+{
+	memset(ip, 0, sizeof(*ip));
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->tos = tos;
+	ip->tot_len = htons(20 + rng() % 1480);
+	ip->id = rng();
+	ip->ttl = ttl;
+	ip->protocol = protocol;
+	ip->saddr = rng();
+	ip->daddr = rng();
+	ip->check = checksum(ip, sizeof(*ip));
+}
+
+/* The check of the header against a recompute, and that it verifies */
+static void check_ip(const char *what, struct iphdr *ip, uint64_t a, uint64_t b)
+{
+	uint16_t got = ip->check;
+
+	ip->check = 0;
+	uint16_t want = checksum(ip, sizeof(*ip));
+	ip->check = got;
+	if (got != want || checksum(ip, sizeof(*ip)) != 0)
+		fail(what, a, b, got, want);
+	cases++;
+}
+
+/* The forwarding path: every TTL with every protocol and TOS */
+static void test_ttl(void)
+{
+	struct iphdr ip;
+
+	for (int ttl = 1; ttl < 256; ttl++) {
+		for (int protocol = 0; protocol < 256; protocol++) {
+			for (int tos = 0; tos < 256; tos++) {
+				make_ip(&ip, tos, ttl, protocol);
+				checksum_replace8(&ip.check, &ip, &ip.ttl, ip.ttl - 1);
+				check_ip("ttl decrement", &ip, ttl, protocol << 8 | tos);
+			}
+		}
+	}
+}
+
+/* Every old and new TOS (DSCP and ECN) */
+static void test_tos(void)
+{
+	struct iphdr ip;
+
+	for (int from = 0; from < 256; from++) {
+		for (int to = 0; to < 256; to++) {
+			make_ip(&ip, from, rng(), rng());
+			checksum_replace8(&ip.check, &ip, &ip.tos, to);
+			check_ip("tos", &ip, from, to);
+		}
+	}
+}
+
+/* Every old and new ICMP type and code, on messages of odd and even length */
+static void test_icmp_type(void)
+{
+	uint8_t msg[64];
+	struct icmphdr *icmp = (struct icmphdr *)msg;
+
+	for (int from = 0; from < 65536; from++) {
+		for (int k = 0; k < 4; k++) {
+			int len = 8 + rng() % 57;
+			for (int i = 0; i < len; i++)
+				msg[i] = rng();
+			icmp->type = from >> 8;
+			icmp->code = from;
+			icmp->checksum = 0;
+			icmp->checksum = checksum(msg, len);
+			int to = rng();
+			checksum_replace8(&icmp->checksum, icmp, &icmp->type, to >> 8);
+			checksum_replace8(&icmp->checksum, icmp, &icmp->code, to);
+			uint16_t got = icmp->checksum;
+			icmp->checksum = 0;
+			uint16_t want = checksum(msg, len);
+			if (got != want)
+				fail("icmp type", from, to & 0xffff, got, want);
+			cases++;
+		}
+	}
+}
+
+int main(void)
+{
+	test_kernels();
+	test_update16();
+	test_update32();
+	test_ttl();
+	test_tos();
+	test_icmp_type();
+	printf("checksum: %lu cases ok\n", (unsigned long)cases);
+	return 0;
+}
@@ -0,0 +1,450 @@
+#include "fib.h"
+#include <immintrin.h>
+
+/*
+ * Path-compressed binary trie. Every node stores the full prefix it
+ * stands for, so chains of single-child nodes are skipped and a lookup
+ * visits at most 33 nodes regardless of the table size.
+ */
+struct fib_node {
+	uint32_t key;	/* prefix, host order, bits past len are zero */
+	uint8_t len;	/* prefix length */
+	int route;	/* index in the route table or -1 for inner nodes */
+	int child[2];
+};
+
+/*
+ * DIR-24-8: the first 24 bits of the address index tbl24 directly.
+ * An entry is 0 for no route, a route index + 1, or, when DIR_TBL8 is
+ * set, the number of a 256 entry tbl8 group indexed by the last 8 bits.
+ * The route tables have more distinct next hops than fit in 16 bits,
+ * so entries are 32 bits wide and tbl24 takes 64 MB.
+ */
+#define DIR_TBL8 0x80000000u
+#define DIR_MAX_ID 0x7fffffffu
+
+/*
+ * SIMD: structure-of-arrays copy of the table in network order, grouped
+ * by prefix length, longest first. Every group is padded to SOA_WIDTH
+ * entries with a prefix that no masked address can equal, so kernels
+ * always load whole vectors. The first match in the first group that
+ * matches is the longest prefix.
+ */
+#define SOA_WIDTH 8
+#define SOA_PAD_PREFIX 0xffffffffu
+#define SOA_PAD_MASK 0
+
+typedef void (*soa_kernel_t)(struct fib *fib, const uint32_t *daddrs,
+			     int *routes, int n);
+
+struct fib {
+	enum fib_mode mode;
+
+	/* FIB_TRIE */
+	struct fib_node *nodes;
+	int count;
+	int root;
+
+	/* FIB_DIR24_8 */
+	uint32_t *tbl24;
+	uint32_t *tbl8;
+	uint32_t tbl8_groups;
+
+	/* FIB_SIMD */
+	uint32_t *soa_prefix;
+	uint32_t *soa_mask;
+	int *soa_route;
+	int soa_group[34];	/* group g spans [soa_group[g], soa_group[g + 1]) */
+	soa_kernel_t soa_kernel;
+};
+
+static inline uint32_t prefix_mask(int len)
+{
+	return len ? ~0u << (32 - len) : 0;
+}
+
+static inline int bit_at(uint32_t key, int pos)
+{
+	return (key >> (31 - pos)) & 1;
+}
+
+static int mask_len(uint32_t mask)
+{
+	uint32_t m = ntohl(mask);
+	return ~m ? __builtin_clz(~m) : 32;
+}
+
+enum fib_mode fib_mode_parse(const char *name)
+{
+	if (name == NULL || *name == '\0' || strcmp(name, "trie") == 0)
+		return FIB_TRIE;
+	if (strcmp(name, "dir24-8") == 0)
+		return FIB_DIR24_8;
+	if (strcmp(name, "simd") == 0)
+		return FIB_SIMD;
+	DIE(1, "unknown FIB mode");
+	return FIB_TRIE;
+}
+
+static int new_node(struct fib *fib, uint32_t key, int len, int route)
+{
+	struct fib_node *n = &fib->nodes[fib->count];
+	n->key = key;
+	n->len = len;
+	n->route = route;
+	n->child[0] = n->child[1] = -1;
+	return fib->count++;
+}
+
+static void trie_insert(struct fib *fib, uint32_t key, int len, int route)
+{
+	int *slot = &fib->root;
+
+	while (*slot != -1) {
+		struct fib_node *n = &fib->nodes[*slot];
+		uint32_t diff = key ^ n->key;
+		int common = diff ? __builtin_clz(diff) : 32;
+
+		if (common > len)
+			common = len;
+		if (common > n->len)
+			common = n->len;
+
+		if (common == n->len) {
+			if (len == n->len) {
+				/* Duplicate prefixes keep the first entry */
+				if (n->route == -1)
+					n->route = route;
+				return;
+			}
+			slot = &n->child[bit_at(key, n->len)];
+			continue;
+		}
+
+		/* The new prefix diverges inside this node, split it */
+		int old = *slot;
+		int split;
+		if (common == len) {
+			split = new_node(fib, key, len, route);
+		} else {
+			split = new_node(fib, key & prefix_mask(common), common, -1);
+			fib->nodes[split].child[bit_at(key, common)] =
+				new_node(fib, key, len, route);
+		}
+		fib->nodes[split].child[bit_at(fib->nodes[old].key, common)] = old;
+		*slot = split;
+		return;
+	}
+	*slot = new_node(fib, key, len, route);
+}
+
+static void trie_build(struct fib *fib, struct route_table_entry *rtable,
+		       int rtable_len)
+{
+	/* Every insert adds at most one leaf and one inner node */
+	fib->nodes = malloc(sizeof(struct fib_node) * (2 * rtable_len + 1));
+	DIE(fib->nodes == NULL, "malloc fib nodes");
+	fib->count = 0;
+	fib->root = -1;
+
+	for (int i = 0; i < rtable_len; i++) {
+		int len = mask_len(rtable[i].mask);
+		trie_insert(fib, ntohl(rtable[i].prefix) & prefix_mask(len), len, i);
+	}
+}
+
+static inline int trie_lookup(struct fib *fib, uint32_t addr)
+{
+	int best = -1;
+	int i = fib->root;
+
+	while (i != -1) {
+		struct fib_node *n = &fib->nodes[i];
+		if ((addr ^ n->key) & prefix_mask(n->len))
+			break;
+		if (n->route != -1)
+			best = n->route;
+		if (n->len == 32)
+			break;
+		i = n->child[bit_at(addr, n->len)];
+	}
+	return best;
+}
+
+struct dir_route {
+	uint32_t key;
+	int len;
+	int route;
+};
+
+static int dir_route_cmp(const void *a, const void *b)
+{
+	const struct dir_route *x = a, *y = b;
+
+	if (x->len != y->len)
+		return x->len - y->len;
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	return x->route - y->route;
+}
+
+static uint32_t dir_new_group(struct fib *fib, uint32_t fill)
+{
+	fib->tbl8 = realloc(fib->tbl8, sizeof(uint32_t) * 256 * (fib->tbl8_groups + 1));
+	DIE(fib->tbl8 == NULL, "realloc tbl8");
+	for (int i = 0; i < 256; i++)
+		fib->tbl8[fib->tbl8_groups * 256 + i] = fill;
+	return DIR_TBL8 | fib->tbl8_groups++;
+}
+
+static void dir_build(struct fib *fib, struct route_table_entry *rtable,
+		      int rtable_len)
+{
+	struct dir_route *sorted = malloc(sizeof(struct dir_route) * rtable_len);
+	DIE(sorted == NULL, "malloc dir routes");
+	for (int i = 0; i < rtable_len; i++) {
+		sorted[i].len = mask_len(rtable[i].mask);
+		sorted[i].key = ntohl(rtable[i].prefix) & prefix_mask(sorted[i].len);
+		sorted[i].route = i;
+	}
+	/* Shorter prefixes first, so longer ones overwrite them */
+	qsort(sorted, rtable_len, sizeof(struct dir_route), dir_route_cmp);
+
+	fib->tbl24 = calloc(1 << 24, sizeof(uint32_t));
+	DIE(fib->tbl24 == NULL, "calloc tbl24");
+	fib->tbl8 = NULL;
+	fib->tbl8_groups = 0;
+
+	for (int i = 0; i < rtable_len; i++) {
+		struct dir_route *r = &sorted[i];
+		/* Duplicate prefixes keep the first entry */
+		if (i > 0 && r->len == sorted[i - 1].len && r->key == sorted[i - 1].key)
+			continue;
+
+		uint32_t id = r->route + 1;
+		if (r->len <= 24) {
+			uint32_t start = r->key >> 8;
+			uint32_t count = 1u << (24 - r->len);
+			for (uint32_t j = start; j < start + count; j++)
+				fib->tbl24[j] = id;
+		} else {
+			uint32_t idx = r->key >> 8;
+			if (!(fib->tbl24[idx] & DIR_TBL8))
+				fib->tbl24[idx] = dir_new_group(fib, fib->tbl24[idx]);
+			uint32_t *group = &fib->tbl8[(fib->tbl24[idx] & DIR_MAX_ID) << 8];
+			uint32_t start = r->key & 0xff;
+			uint32_t count = 1u << (32 - r->len);
+			for (uint32_t j = start; j < start + count; j++)
+				group[j] = id;
+		}
+	}
+	free(sorted);
+}
+
+static inline int dir_lookup(struct fib *fib, uint32_t addr)
+{
+	uint32_t e = fib->tbl24[addr >> 8];
+
+	if (e & DIR_TBL8)
+		e = fib->tbl8[((e & DIR_MAX_ID) << 8) | (addr & 0xff)];
+	return (int)e - 1;
+}
+
+static void soa_build(struct fib *fib, struct route_table_entry *rtable,
+		      int rtable_len)
+{
+	int count[33] = {0};
+	int size = 0;
+
+	for (int i = 0; i < rtable_len; i++)
+		count[mask_len(rtable[i].mask)]++;
+	/* Group g holds prefixes of length 32 - g */
+	for (int g = 0; g < 33; g++) {
+		fib->soa_group[g] = size;
+		size += (count[32 - g] + SOA_WIDTH - 1) / SOA_WIDTH * SOA_WIDTH;
+	}
+	fib->soa_group[33] = size;
+
+	fib->soa_prefix = aligned_alloc(32, sizeof(uint32_t) * (size + SOA_WIDTH));
+	fib->soa_mask = aligned_alloc(32, sizeof(uint32_t) * (size + SOA_WIDTH));
+	fib->soa_route = malloc(sizeof(int) * (size + SOA_WIDTH));
+	DIE(fib->soa_prefix == NULL || fib->soa_mask == NULL ||
+	    fib->soa_route == NULL, "alloc soa fib");
+	for (int i = 0; i < size; i++) {
+		fib->soa_prefix[i] = SOA_PAD_PREFIX;
+		fib->soa_mask[i] = SOA_PAD_MASK;
+		fib->soa_route[i] = -1;
+	}
+
+	/* Table order inside a group, so duplicate prefixes keep the first entry */
+	int fill[33];
+	for (int g = 0; g < 33; g++)
+		fill[g] = fib->soa_group[g];
+	for (int i = 0; i < rtable_len; i++) {
+		int g = 32 - mask_len(rtable[i].mask);
+		int j = fill[g]++;
+		fib->soa_prefix[j] = rtable[i].prefix & rtable[i].mask;
+		fib->soa_mask[j] = rtable[i].mask;
+		fib->soa_route[j] = i;
+	}
+}
+
+static void soa_lookup_scalar(struct fib *fib, const uint32_t *daddrs,
+			      int *routes, int n)
+{
+	int pending = n;
+
+	for (int j = 0; j < n; j++)
+		routes[j] = -1;
+	for (int g = 0; g < 33 && pending; g++) {
+		for (int j = 0; j < n; j++) {
+			if (routes[j] != -1)
+				continue;
+			for (int i = fib->soa_group[g]; i < fib->soa_group[g + 1]; i++) {
+				if ((daddrs[j] & fib->soa_mask[i]) == fib->soa_prefix[i]) {
+					routes[j] = fib->soa_route[i];
+					pending--;
+					break;
+				}
+			}
+		}
+	}
+}
+
+__attribute__((target("sse4.1")))
+static void soa_lookup_sse4(struct fib *fib, const uint32_t *daddrs,
+			    int *routes, int n)
+{
+	int pending = n;
+
+	for (int j = 0; j < n; j++)
+		routes[j] = -1;
+	for (int g = 0; g < 33 && pending; g++) {
+		for (int i = fib->soa_group[g]; i < fib->soa_group[g + 1] && pending; i += 4) {
+			__m128i p = _mm_load_si128((__m128i *)&fib->soa_prefix[i]);
+			__m128i m = _mm_load_si128((__m128i *)&fib->soa_mask[i]);
+			for (int j = 0; j < n; j++) {
+				if (routes[j] != -1)
+					continue;
+				__m128i a = _mm_set1_epi32(daddrs[j]);
+				__m128i eq = _mm_cmpeq_epi32(_mm_and_si128(a, m), p);
+				int bits = _mm_movemask_ps(_mm_castsi128_ps(eq));
+				if (bits) {
+					routes[j] = fib->soa_route[i + __builtin_ctz(bits)];
+					pending--;
+				}
+			}
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+static void soa_lookup_avx2(struct fib *fib, const uint32_t *daddrs,
+			    int *routes, int n)
+{
+	int pending = n;
+
+	for (int j = 0; j < n; j++)
+		routes[j] = -1;
+	for (int g = 0; g < 33 && pending; g++) {
+		for (int i = fib->soa_group[g]; i < fib->soa_group[g + 1] && pending; i += 8) {
+			__m256i p = _mm256_load_si256((__m256i *)&fib->soa_prefix[i]);
+			__m256i m = _mm256_load_si256((__m256i *)&fib->soa_mask[i]);
+			for (int j = 0; j < n; j++) {
+				if (routes[j] != -1)
+					continue;
+				__m256i a = _mm256_set1_epi32(daddrs[j]);
+				__m256i eq = _mm256_cmpeq_epi32(_mm256_and_si256(a, m), p);
+				int bits = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+				if (bits) {
+					routes[j] = fib->soa_route[i + __builtin_ctz(bits)];
+					pending--;
+				}
+			}
+		}
+	}
+}
+
+static soa_kernel_t soa_select_kernel(void)
+{
+	char *name = getenv("ROUTER_FIB_KERNEL");
+
+	__builtin_cpu_init();
+	if (name != NULL) {
+		if (strcmp(name, "scalar") == 0)
+			return soa_lookup_scalar;
+		if (strcmp(name, "sse4.1") == 0 && __builtin_cpu_supports("sse4.1"))
+			return soa_lookup_sse4;
+		if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+			return soa_lookup_avx2;
+		DIE(1, "ROUTER_FIB_KERNEL unknown or not supported by this CPU, use scalar, sse4.1 or avx2");
+	}
+	if (__builtin_cpu_supports("avx2"))
+		return soa_lookup_avx2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return soa_lookup_sse4;
+	return soa_lookup_scalar;
+}
+
+struct fib *fib_create(struct route_table_entry *rtable, int rtable_len,
+		       enum fib_mode mode)
+{
+	struct fib *fib = calloc(1, sizeof(struct fib));
+	DIE(fib == NULL, "calloc fib");
+
+	fib->mode = mode;
+	switch (mode) {
+	case FIB_TRIE:
+		trie_build(fib, rtable, rtable_len);
+		break;
+	case FIB_DIR24_8:
+		dir_build(fib, rtable, rtable_len);
+		break;
+	case FIB_SIMD:
+		soa_build(fib, rtable, rtable_len);
+		fib->soa_kernel = soa_select_kernel();
+		break;
+	}
+	return fib;
+}
+
+int fib_lookup(struct fib *fib, uint32_t daddr)
+{
+	uint32_t addr = ntohl(daddr);
+	int route;
+
+	switch (fib->mode) {
+	case FIB_SIMD:
+		fib->soa_kernel(fib, &daddr, &route, 1);
+		return route;
+	case FIB_DIR24_8:
+		return dir_lookup(fib, addr);
+	case FIB_TRIE:
+	default:
+		return trie_lookup(fib, addr);
+	}
+}
+
+void fib_lookup_batch(struct fib *fib, const uint32_t *daddrs, int *routes, int n)
+{
+	if (fib->mode != FIB_SIMD) {
+		for (int j = 0; j < n; j++)
+			routes[j] = fib_lookup(fib, daddrs[j]);
+		return;
+	}
+	for (int j = 0; j < n; j += FIB_BATCH) {
+		int count = n - j < FIB_BATCH ? n - j : FIB_BATCH;
+		fib->soa_kernel(fib, daddrs + j, routes + j, count);
+	}
+}
+
+void fib_free(struct fib *fib)
+{
+	free(fib->nodes);
+	free(fib->tbl24);
+	free(fib->tbl8);
+	free(fib->soa_prefix);
+	free(fib->soa_mask);
+	free(fib->soa_route);
+	free(fib);
+}
@@ -0,0 +1,79 @@
+#include "skel.h"
+#include "fib.h"
+#include "rng.h"
+
+/*
+ * Test of fib.c, built and run by `make check`: DIR-24-8 and every SIMD
+ * kernel, one address at a time and through fib_lookup_batch, must give
+ * the route the trie gives. Addresses are drawn inside random routes of
+ * rtable0.txt, plus fully random ones that mostly match nothing or the
+ * shortest prefixes. Prints the first difference and exits with 1, or
+ * the number of lookups.
+ */
+
+#define ADDRESSES 10000
+/* Not a multiple of FIB_BATCH, so every batch ends in a partial pass */
+#define CHUNK 37
+
+static uint64_t cases;
+
+static void compare(const char *what, struct fib *fib, const uint32_t *daddrs, const int *want)
+{
+	int got[CHUNK];
+
+	for (int base = 0; base < ADDRESSES; base += CHUNK) {
+		int n = ADDRESSES - base < CHUNK ? ADDRESSES - base : CHUNK;
+		fib_lookup_batch(fib, daddrs + base, got, n);
+		for (int j = 0; j < n; j++) {
+			int one = fib_lookup(fib, daddrs[base + j]);
+			if (got[j] != want[base + j] || one != want[base + j]) {
+				struct in_addr a = { daddrs[base + j] };
+				printf("FAIL %s: %s: batch %d, single %d, trie %d\n", what,
+				       inet_ntoa(a), got[j], one, want[base + j]);
+				exit(1);
+			}
+			cases++;
+		}
+	}
+}
+
+int main(void)
+{
+	struct route_table_entry *rtable = malloc(sizeof(struct route_table_entry) * 80000);
+	DIE(rtable == NULL, "malloc rtable");
+	int len = read_rtable("rtable0.txt", rtable);
+	DIE(len <= 0, "read rtable0.txt");
+
+	uint32_t *daddrs = malloc(sizeof(uint32_t) * ADDRESSES);
+	int *want = malloc(sizeof(int) * ADDRESSES);
+	DIE(daddrs == NULL || want == NULL, "malloc addresses");
+	for (int i = 0; i < ADDRESSES; i++) {
+		struct route_table_entry *r = &rtable[rng() % len];
+		daddrs[i] = i % 4 == 0 ? (uint32_t)rng() : (r->prefix & r->mask) | ((uint32_t)rng() & ~r->mask);
+	}
+
+	struct fib *trie = fib_create(rtable, len, FIB_TRIE);
+	for (int i = 0; i < ADDRESSES; i++)
+		want[i] = fib_lookup(trie, daddrs[i]);
+	compare("trie", trie, daddrs, want);
+	fib_free(trie);
+
+	struct fib *dir = fib_create(rtable, len, FIB_DIR24_8);
+	compare("dir24-8", dir, daddrs, want);
+	fib_free(dir);
+
+	static const char *kernels[] = { "scalar", "sse4.1", "avx2" };
+	__builtin_cpu_init();
+	int supported[] = { 1, __builtin_cpu_supports("sse4.1"), __builtin_cpu_supports("avx2") };
+	for (int k = 0; k < 3; k++) {
+		if (!supported[k])
+			continue;
+		setenv("ROUTER_FIB_KERNEL", kernels[k], 1);
+		struct fib *simd = fib_create(rtable, len, FIB_SIMD);
+		compare(kernels[k], simd, daddrs, want);
+		fib_free(simd);
+	}
+
+	printf("fib: %lu lookups ok\n", (unsigned long)cases);
+	return 0;
+}
@@ -0,0 +1,370 @@
+#include "flight.h"
+#include "stats.h"
+#include "thread_registry.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 1
+#define PCAPNG_EPB 6
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4D
+#define PCAPNG_OPT_COMMENT 1
+#define PCAPNG_OPT_IF_NAME 2
+#define PCAPNG_OPT_IF_TSRESOL 9
+#define PCAPNG_LINKTYPE_ETHERNET 1
+/* Ethernet, IP and the ports or ICMP type of a rebuilt packet */
+#define FLIGHT_FRAME_MAX (ETH_HLEN + sizeof(struct arp_header))
+
+static struct thread_registry rings;
+static uint32_t ring_records = FLIGHT_RECORDS;
+/* Where drops outside a packet go, and packets of threads past the limit */
+struct flight_record flight_scratch;
+__thread struct flight_ring *flight_self;
+__thread struct flight_record *flight_current = &flight_scratch;
+
+static const char *flight_path;
+static int flight_interfaces;
+/* latency_now() and CLOCK_REALTIME in ns at the same moment */
+static uint64_t epoch_ticks, epoch_ns;
+
+static const char *verdict_names[] = {
+	"local", "forwarded", "queued",
+	"drop_bad_checksum", "drop_ttl_expired", "drop_no_route",
+	"drop_arp_pending", "drop_queue_full", "drop_not_for_us",
+	"drop_no_buffer",
+};
+
+struct flight_ring *flight_attach(void)
+{
+	struct flight_ring *r = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct flight_ring) +
+					      sizeof(struct flight_record) * ring_records);
+	DIE(r == NULL, "aligned_alloc flight");
+	memset(r, 0, sizeof(struct flight_ring) + sizeof(struct flight_record) * ring_records);
+	r->mask = ring_records - 1;
+	if (thread_registry_add(&rings, r) == -1) {
+		/* Keep recording into one record nobody dumps */
+		free(r);
+		r = calloc(1, sizeof(struct flight_ring) + sizeof(struct flight_record));
+		DIE(r == NULL, "calloc flight");
+	}
+	flight_self = r;
+	return r;
+}
+
+void flight_begin(packet *m)
+{
+	struct flight_ring *r = flight_self;
+
+	if (__builtin_expect(r == NULL, 0))
+		r = flight_attach();
+	struct flight_record *fr = &r->records[r->head & r->mask];
+	struct ether_header *eth = (struct ether_header *)m->payload;
+
+	flight_current = fr;
+	memset(fr, 0, sizeof(*fr));
+	fr->ts = latency_now();
+	fr->route = -1;
+	fr->len = m->len;
+	fr->in_if = m->interface;
+	fr->out_if = 0xff;
+	if (m->len < ETH_HLEN)
+		return;
+	fr->ethertype = ntohs(eth->ether_type);
+
+	char *l3 = m->payload + ETH_HLEN;
+	int l3_len = m->len - ETH_HLEN;
+	if (fr->ethertype == ETHERTYPE_ARP && l3_len >= (int)sizeof(struct arp_header)) {
+		struct arp_header *arp = (struct arp_header *)l3;
+		fr->saddr = arp->spa;
+		fr->daddr = arp->tpa;
+		fr->sport = ntohs(arp->op);
+	} else if (fr->ethertype == ETHERTYPE_IP && l3_len >= (int)sizeof(struct iphdr)) {
+		struct iphdr *ip = (struct iphdr *)l3;
+		fr->saddr = ip->saddr;
+		fr->daddr = ip->daddr;
+		fr->proto = ip->protocol;
+		int ihl = ip->ihl * 4;
+		/* Ports are only in the first fragment */
+		if ((ntohs(ip->frag_off) & IP_OFFMASK) != 0 || l3_len < ihl + 4)
+			return;
+		uint8_t *l4 = (uint8_t *)l3 + ihl;
+		if (ip->protocol == IPPROTO_TCP || ip->protocol == IPPROTO_UDP) {
+			fr->sport = l4[0] << 8 | l4[1];
+			fr->dport = l4[2] << 8 | l4[3];
+		} else if (ip->protocol == IPPROTO_ICMP) {
+			fr->sport = l4[0] << 8 | l4[1];
+		}
+	}
+}
+
+/* A record and the ring it came from, for sorting */
+struct flight_entry {
+	struct flight_record rec;
+	int thread;
+};
+
+static int by_time(const void *a, const void *b)
+{
+	const struct flight_entry *x = a, *y = b;
+
+	return x->rec.ts < y->rec.ts ? -1 : x->rec.ts > y->rec.ts;
+}
+
+/*
+ * Copies the published records of every ring. A record may be rewritten
+ * while it is copied, so only the ones the writer cannot have reached
+ * before the copy ended are kept.
+ */
+static int collect(struct flight_entry *out, int count)
+{
+	int n = 0;
+
+	for (int t = 0; t < count; t++) {
+		struct flight_ring *r = thread_registry_get(&rings, t);
+		if (r == NULL)
+			continue;
+		uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		uint64_t first = head > ring_records ? head - ring_records : 0;
+		int start = n;
+		for (uint64_t k = first; k < head; k++) {
+			out[n].rec = r->records[k & r->mask];
+			out[n++].thread = t;
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		uint64_t after = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+		/* Records before after - ring_records + 1 may be overwritten */
+		uint64_t safe = after >= ring_records ? after - ring_records + 1 : 0;
+		if (safe > first) {
+			int lost = safe - first < head - first ? safe - first : head - first;
+			memmove(&out[start], &out[start + lost], sizeof(struct flight_entry) * (n - start - lost));
+			n -= lost;
+		}
+	}
+	qsort(out, n, sizeof(struct flight_entry), by_time);
+	return n;
+}
+
+static uint64_t wall_ns(uint64_t ticks, double ratio)
+{
+	return epoch_ns + (int64_t)((double)((int64_t)(ticks - epoch_ticks)) / ratio);
+}
+
+static const char *verdict_name(uint8_t v)
+{
+	return v < sizeof(verdict_names) / sizeof(verdict_names[0]) ? verdict_names[v] : "?";
+}
+
+static const char *out_name(uint8_t interface)
+{
+	return interface < flight_interfaces ? interface_table[interface].name : "-";
+}
+
+static void write_text(FILE *f, struct flight_entry *e, int n, double ratio)
+{
+	char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
+
+	fprintf(f, "# time thread in proto source destination route out verdict\n");
+	for (int i = 0; i < n; i++) {
+		struct flight_record *fr = &e[i].rec;
+		uint64_t ns = wall_ns(fr->ts, ratio);
+		inet_ntop(AF_INET, &fr->saddr, src, sizeof(src));
+		inet_ntop(AF_INET, &fr->daddr, dst, sizeof(dst));
+		fprintf(f, "%lu.%09lu %d %s ", (unsigned long)(ns / 1000000000),
+			(unsigned long)(ns % 1000000000), e[i].thread, out_name(fr->in_if));
+		if (fr->ethertype == ETHERTYPE_ARP)
+			fprintf(f, "arp-%s %s %s", fr->sport == ARPOP_REQUEST ? "request" : "reply", src, dst);
+		else if (fr->ethertype != ETHERTYPE_IP)
+			fprintf(f, "ether-0x%04x - -", fr->ethertype);
+		else if (fr->proto == IPPROTO_TCP || fr->proto == IPPROTO_UDP)
+			fprintf(f, "%s %s:%u %s:%u", fr->proto == IPPROTO_TCP ? "tcp" : "udp",
+				src, fr->sport, dst, fr->dport);
+		else if (fr->proto == IPPROTO_ICMP)
+			fprintf(f, "icmp-%u/%u %s %s", fr->sport >> 8, fr->sport & 0xff, src, dst);
+		else
+			fprintf(f, "ip-%u %s %s", fr->proto, src, dst);
+		fprintf(f, " %d %s %s\n", fr->route, out_name(fr->out_if), verdict_name(fr->verdict));
+	}
+}
+
+/* Writes a pcap-ng block: header, body padded to 32 bits, options, trailer */
+static void write_block(FILE *f, uint32_t type, const void *body, uint32_t body_len,
+			const void *options, uint32_t options_len)
+{
+	static const uint8_t zero[4];
+	uint32_t pad = -body_len & 3;
+	uint32_t len = 12 + body_len + pad + options_len;
+
+	fwrite(&type, 4, 1, f);
+	fwrite(&len, 4, 1, f);
+	fwrite(body, 1, body_len, f);
+	fwrite(zero, 1, pad, f);
+	fwrite(options, 1, options_len, f);
+	fwrite(&len, 4, 1, f);
+}
+
+/* Appends an option to buf, returns its new length */
+static uint32_t add_option(uint8_t *buf, uint32_t len, uint16_t code, const void *value, uint16_t value_len)
+{
+	memcpy(buf + len, &code, 2);
+	memcpy(buf + len + 2, &value_len, 2);
+	memcpy(buf + len + 4, value, value_len);
+	len += 4 + value_len;
+	while (len & 3)
+		buf[len++] = 0;
+	return len;
+}
+
+/* Headers of the recorded packet, as far as the record knows them */
+static uint32_t rebuild_frame(struct flight_record *fr, uint8_t *frame)
+{
+	struct ether_header *eth = (struct ether_header *)frame;
+
+	memset(frame, 0, FLIGHT_FRAME_MAX);
+	eth->ether_type = htons(fr->ethertype);
+	if (fr->ethertype == ETHERTYPE_ARP) {
+		struct arp_header *arp = (struct arp_header *)(frame + ETH_HLEN);
+		arp->htype = htons(ARPHRD_ETHER);
+		arp->ptype = htons(ETHERTYPE_IP);
+		arp->hlen = ETH_ALEN;
+		arp->plen = 4;
+		arp->op = htons(fr->sport);
+		arp->spa = fr->saddr;
+		arp->tpa = fr->daddr;
+		return ETH_HLEN + sizeof(struct arp_header);
+	}
+	if (fr->ethertype != ETHERTYPE_IP)
+		return ETH_HLEN;
+
+	struct iphdr *ip = (struct iphdr *)(frame + ETH_HLEN);
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->tot_len = htons(fr->len > ETH_HLEN ? fr->len - ETH_HLEN : 0);
+	ip->ttl = 64;
+	ip->protocol = fr->proto;
+	ip->saddr = fr->saddr;
+	ip->daddr = fr->daddr;
+	uint8_t *l4 = (uint8_t *)(ip + 1);
+	l4[0] = fr->sport >> 8;
+	l4[1] = fr->sport;
+	l4[2] = fr->dport >> 8;
+	l4[3] = fr->dport;
+	return ETH_HLEN + sizeof(struct iphdr) + 4;
+}
+
+static void write_pcapng(FILE *f, struct flight_entry *e, int n, double ratio)
+{
+	uint8_t options[256];
+	uint32_t len;
+
+	struct {
+		uint32_t byte_order;
+		uint16_t major, minor;
+		int64_t section_len;
+	} __attribute__((packed)) shb = { PCAPNG_BYTE_ORDER, 1, 0, -1 };
+	write_block(f, PCAPNG_SHB, &shb, sizeof(shb), NULL, 0);
+
+	/* One interface per router interface, timestamps in ns */
+	for (int i = 0; i < flight_interfaces; i++) {
+		struct {
+			uint16_t linktype, reserved;
+			uint32_t snaplen;
+		} idb = { PCAPNG_LINKTYPE_ETHERNET, 0, MAX_LEN };
+		uint8_t resol = 9;
+		len = add_option(options, 0, PCAPNG_OPT_IF_NAME, interface_table[i].name,
+				 strlen(interface_table[i].name));
+		len = add_option(options, len, PCAPNG_OPT_IF_TSRESOL, &resol, 1);
+		memset(options + len, 0, 4);
+		write_block(f, PCAPNG_IDB, &idb, sizeof(idb), options, len + 4);
+	}
+
+	for (int i = 0; i < n; i++) {
+		struct flight_record *fr = &e[i].rec;
+		struct {
+			uint32_t interface;
+			uint32_t ts_high, ts_low;
+			uint32_t cap_len, orig_len;
+			uint8_t data[FLIGHT_FRAME_MAX];
+		} epb;
+		uint64_t ns = wall_ns(fr->ts, ratio);
+		char comment[128];
+
+		/* The drop of a packet outside the interfaces has nowhere to go */
+		if (fr->in_if >= flight_interfaces)
+			continue;
+		epb.interface = fr->in_if;
+		epb.ts_high = ns >> 32;
+		epb.ts_low = ns;
+		epb.cap_len = rebuild_frame(fr, epb.data);
+		epb.orig_len = fr->len > epb.cap_len ? fr->len : epb.cap_len;
+		int c = snprintf(comment, sizeof(comment), "thread %d route %d out %s %s", e[i].thread,
+				 fr->route, out_name(fr->out_if), verdict_name(fr->verdict));
+		len = add_option(options, 0, PCAPNG_OPT_COMMENT, comment, c);
+		memset(options + len, 0, 4);
+		write_block(f, PCAPNG_EPB, &epb, offsetof(typeof(epb), data) + epb.cap_len, options, len + 4);
+	}
+}
+
+static void dump(void)
+{
+	int threads = thread_registry_count(&rings);
+	struct flight_entry *e = malloc(sizeof(struct flight_entry) * ring_records * (threads + 1));
+	DIE(e == NULL, "malloc flight dump");
+	int n = collect(e, threads);
+	double ratio = latency_ticks_per_ns();
+
+	size_t len = strlen(flight_path);
+	int pcapng = len > 7 && strcmp(flight_path + len - 7, ".pcapng") == 0;
+	FILE *f = fopen(flight_path, "w");
+	if (f == NULL) {
+		perror(flight_path);
+		free(e);
+		return;
+	}
+	if (pcapng)
+		write_pcapng(f, e, n, ratio);
+	else
+		write_text(f, e, n, ratio);
+	if (fclose(f) != 0)
+		perror(flight_path);
+	else
+		fprintf(stderr, "flight: %d records to %s\n", n, flight_path);
+	free(e);
+}
+
+static void *dump_main(void *arg)
+{
+	sigset_t *set = arg;
+	int sig;
+
+	while (1) {
+		if (sigwait(set, &sig) == 0)
+			dump();
+	}
+	return NULL;
+}
+
+void flight_start(const char *path, int num_interfaces)
+{
+	static sigset_t set;
+	struct timespec ts;
+	pthread_t thread;
+
+	char *records = getenv("ROUTER_FLIGHT_RECORDS");
+	if (records != NULL) {
+		long want = atol(records);
+		DIE(want <= 0 || (want & (want - 1)) != 0, "ROUTER_FLIGHT_RECORDS must be a power of two");
+		ring_records = want;
+	}
+	flight_path = path;
+	flight_interfaces = num_interfaces;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	epoch_ticks = latency_now();
+	epoch_ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR2);
+	DIE(pthread_sigmask(SIG_BLOCK, &set, NULL) != 0, "pthread_sigmask");
+	DIE(pthread_create(&thread, NULL, dump_main, &set) != 0, "pthread_create");
+	pthread_detach(thread);
+}
@@ -0,0 +1,148 @@
+#include "frame_templates.h"
+#include "checksum.h"
+
+#define ETH_LEN sizeof(struct ether_header)
+#define IP_LEN sizeof(struct iphdr)
+#define ICMP_LEN sizeof(struct icmphdr)
+
+/* Frames of one interface with everything but the per-packet fields */
+struct frame_template {
+	int built;
+	uint32_t ip;	/* addresses the frames were built with */
+	uint8_t mac[ETH_ALEN];
+	char arp[ARP_FRAME_LEN];	/* broadcast request */
+	char icmp[ICMP_FRAME_LEN];	/* IPv4 + ICMP, no destination */
+};
+
+static __thread struct frame_template templates[ROUTER_NUM_INTERFACES];
+
+static void template_build(struct frame_template *t, const struct interface_info *info)
+{
+	struct ether_header *eth;
+
+	memset(t, 0, sizeof(struct frame_template));
+	t->ip = info->ip;
+	memcpy(t->mac, info->mac, ETH_ALEN);
+
+	eth = (struct ether_header *)t->arp;
+	memset(eth->ether_dhost, 0xff, ETH_ALEN);
+	memcpy(eth->ether_shost, info->mac, ETH_ALEN);
+	eth->ether_type = htons(ETHERTYPE_ARP);
+	struct arp_header *arp = (struct arp_header *)(t->arp + ETH_LEN);
+	arp->htype = htons(ARPHRD_ETHER);
+	arp->ptype = htons(ETHERTYPE_IP);
+	arp->hlen = ETH_ALEN;
+	arp->plen = 4;
+	arp->op = htons(ARPOP_REQUEST);
+	memcpy(arp->sha, info->mac, ETH_ALEN);
+	arp->spa = info->ip;
+
+	eth = (struct ether_header *)t->icmp;
+	memcpy(eth->ether_shost, info->mac, ETH_ALEN);
+	eth->ether_type = htons(ETHERTYPE_IP);
+	struct iphdr *ip = (struct iphdr *)(t->icmp + ETH_LEN);
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->ttl = 64;
+	ip->protocol = IPPROTO_ICMP;
+	ip->saddr = info->ip;
+	/* Patched for the destination and length of every frame */
+	ip->check = checksum(ip, IP_LEN);
+
+	t->built = 1;
+}
+
+static inline struct frame_template *template_get(int interface)
+{
+	struct frame_template *t = &templates[interface];
+	const struct interface_info *info = &interface_table[interface];
+
+	if (!t->built || t->ip != info->ip || memcmp(t->mac, info->mac, ETH_ALEN) != 0)
+		template_build(t, info);
+	return t;
+}
+
+int frame_arp_request(char *frame, int interface, uint32_t target_ip)
+{
+	memcpy(frame, template_get(interface)->arp, ARP_FRAME_LEN);
+	((struct arp_header *)(frame + ETH_LEN))->tpa = target_ip;
+	return ARP_FRAME_LEN;
+}
+
+int frame_arp_reply(char *frame, int interface, const uint8_t *target_mac, uint32_t target_ip)
+{
+	struct arp_header *arp = (struct arp_header *)(frame + ETH_LEN);
+
+	memcpy(frame, template_get(interface)->arp, ARP_FRAME_LEN);
+	memcpy(((struct ether_header *)frame)->ether_dhost, target_mac, ETH_ALEN);
+	arp->op = htons(ARPOP_REPLY);
+	memcpy(arp->tha, target_mac, ETH_ALEN);
+	arp->tpa = target_ip;
+	return ARP_FRAME_LEN;
+}
+
+/*
+ * Copies the IPv4/ICMP template, addresses it back to the sender of
+ * orig and sets the lengths. Returns the ICMP header.
+ */
+static struct icmphdr *icmp_frame(char *frame, int interface, const char *orig, int icmp_len)
+{
+	const struct ether_header *orig_eth = (const struct ether_header *)orig;
+	const struct iphdr *orig_ip = (const struct iphdr *)(orig + ETH_LEN);
+	struct iphdr *ip = (struct iphdr *)(frame + ETH_LEN);
+
+	memcpy(frame, template_get(interface)->icmp, ETH_LEN + IP_LEN);
+	memcpy(((struct ether_header *)frame)->ether_dhost, orig_eth->ether_shost, ETH_ALEN);
+	checksum_replace32(&ip->check, &ip->daddr, orig_ip->saddr);
+	checksum_replace16(&ip->check, &ip->tot_len, htons(IP_LEN + icmp_len));
+	return (struct icmphdr *)(frame + ETH_LEN + IP_LEN);
+}
+
+int frame_icmp_echo_reply(char *frame, int interface, const char *request, int request_len)
+{
+	const struct iphdr *req_ip = (const struct iphdr *)(request + ETH_LEN);
+	int icmp_len = ntohs(req_ip->tot_len) - req_ip->ihl * 4;
+	int whole = icmp_len;
+
+	/* Never trust tot_len past what was received */
+	if (icmp_len > request_len - (int)ETH_LEN - req_ip->ihl * 4)
+		icmp_len = request_len - ETH_LEN - req_ip->ihl * 4;
+	if (icmp_len > MAX_LEN - (int)(ETH_LEN + IP_LEN))
+		icmp_len = MAX_LEN - (ETH_LEN + IP_LEN);
+	if (icmp_len < (int)ICMP_LEN)
+		icmp_len = ICMP_LEN;
+
+	struct icmphdr *icmp = icmp_frame(frame, interface, request, icmp_len);
+	/* Identifier, sequence number and data come back unchanged */
+	memcpy(icmp, request + ETH_LEN + req_ip->ihl * 4, icmp_len);
+	if (icmp_len == whole) {
+		/* The request was verified, patch its checksum for the new type */
+		checksum_replace8(&icmp->checksum, icmp, &icmp->type, ICMP_ECHOREPLY);
+		checksum_replace8(&icmp->checksum, icmp, &icmp->code, 0);
+	} else {
+		icmp->type = ICMP_ECHOREPLY;
+		icmp->code = 0;
+		icmp->checksum = 0;
+		icmp->checksum = checksum(icmp, icmp_len);
+	}
+	return ETH_LEN + IP_LEN + icmp_len;
+}
+
+int frame_icmp_error(char *frame, int interface, uint8_t type, uint8_t code,
+		     const char *offending, int offending_len)
+{
+	const struct iphdr *orig_ip = (const struct iphdr *)(offending + ETH_LEN);
+	int quote = orig_ip->ihl * 4 + ICMP_ERROR_QUOTE;
+
+	if (quote > offending_len - (int)ETH_LEN)
+		quote = offending_len - ETH_LEN;
+
+	struct icmphdr *icmp = icmp_frame(frame, interface, offending, ICMP_LEN + quote);
+	icmp->type = type;
+	icmp->code = code;
+	icmp->checksum = 0;
+	icmp->un.gateway = 0;	/* unused for these types */
+	memcpy((char *)icmp + ICMP_LEN, orig_ip, quote);
+	icmp->checksum = checksum(icmp, ICMP_LEN + quote);
+	return ETH_LEN + IP_LEN + ICMP_LEN + quote;
+}
@@ -0,0 +1,86 @@
+#ifndef _ADJACENCY_H_
+#define _ADJACENCY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "skel.h"
+
+/*
+ * Where a route sends its packets: the egress interface and the
+ * Ethernet header every packet gets, ready to be stored in one go.
+ * Exactly 32 bytes, so two share a cache line and none straddles one.
+ */
+struct adjacency {
+	uint8_t header[ETH_HLEN];	/* next hop MAC, our MAC, IPv4 */
+	uint8_t resolved;	/* header holds the MAC of the next hop */
+	uint8_t pad;
+	uint32_t seq;	/* odd while the header is rewritten */
+	uint32_t next_hop;	/* network order */
+	int interface;
+	int next;	/* next adjacency with the same next hop, -1 ends */
+} __attribute__((aligned(32)));
+
+/* Adjacencies of a route table, one per distinct next hop and interface */
+struct adjacency_table {
+	struct adjacency *slots;
+	int count;
+	int *route_adj;	/* adjacency of every route */
+	uint32_t *hop_keys;	/* next hop -> first adjacency, open addressing */
+	int *hop_first;
+	uint32_t hop_mask;
+	pthread_mutex_t lock;	/* serializes writers */
+};
+
+/**
+ * @brief Builds the adjacencies of a route table, all unresolved.
+ *
+ * @param rtable route table, indexed like the FIB results
+ * @param rtable_len
+ * @return struct adjacency_table*
+ */
+struct adjacency_table *adjacency_create(struct route_table_entry *rtable, int rtable_len);
+
+/**
+ * @brief Adjacency of a route.
+ *
+ * @param t
+ * @param route index in the route table
+ * @return struct adjacency*
+ */
+static inline struct adjacency *adjacency_of_route(struct adjacency_table *t, int route)
+{
+	return &t->slots[t->route_adj[route]];
+}
+
+/**
+ * @brief Stores the Ethernet header of an adjacency at the start of a
+ * frame. Safe while another thread resolves the adjacency.
+ *
+ * @param adj
+ * @param frame
+ * @return true: the header was written
+ * @return false: the next hop is not resolved yet, nothing was written
+ */
+bool adjacency_write_header(struct adjacency *adj, char *frame);
+
+/**
+ * @brief Rewrites the header of every adjacency of a next hop in place,
+ * with the MAC of the next hop and the current MAC of the interface,
+ * and marks them resolved. Thread safe.
+ *
+ * @param t
+ * @param next_hop network order
+ * @param mac MAC of the next hop
+ */
+void adjacency_resolve(struct adjacency_table *t, uint32_t next_hop, const uint8_t *mac);
+
+/**
+ * @brief Rewrites the header of every resolved adjacency with the current
+ * MAC of its interface, after interface_table changed. Thread safe.
+ *
+ * @param t
+ */
+void adjacency_refresh(struct adjacency_table *t);
+
+#endif /* _ADJACENCY_H_ */
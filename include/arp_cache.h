@@ -0,0 +1,45 @@
+#ifndef _ARP_CACHE_H_
+#define _ARP_CACHE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "skel.h"
+
+/*
+ * Open-addressing hash table of ARP entries keyed by IPv4 address. It
+ * only tells if a reply brings a new MAC; packets take theirs from the
+ * adjacencies, so the table is only touched under its mutex.
+ */
+struct arp_cache {
+	struct arp_entry *slots;	/* ip 0 marks an empty slot */
+	uint32_t slot_mask;
+	uint32_t capacity;	/* most entries the table accepts */
+	uint32_t count;
+	pthread_mutex_t lock;
+};
+
+/* Most entries of a cache, larger capacities are cut to it */
+#define ARP_CACHE_MAX_CAPACITY (1u << 24)
+
+/**
+ * @brief Creates an empty ARP cache. The table gets at least twice as
+ * many slots as entries, so probe sequences stay short.
+ *
+ * @param capacity most neighbors the cache will hold, at most
+ * ARP_CACHE_MAX_CAPACITY
+ * @return struct arp_cache*
+ */
+struct arp_cache *arp_cache_create(uint32_t capacity);
+
+/**
+ * @brief Inserts an address or updates its MAC in place. Thread safe.
+ *
+ * @param ac
+ * @param ip address, network order
+ * @param mac MAC of the address
+ * @return int 1 if the entry was added or its MAC changed, 0 if nothing
+ * changed, -1 if the cache is full
+ */
+int arp_cache_update(struct arp_cache *ac, uint32_t ip, uint8_t *mac);
+
+#endif /* _ARP_CACHE_H_ */
@@ -0,0 +1,174 @@
+#ifndef _CHECKSUM_H_
+#define _CHECKSUM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * Internet checksum (RFC 1071). Sums are taken over 16-bit words in
+ * memory order, so the result is stored as is, without htons, and a
+ * message that carries a valid checksum sums to checksum() == 0.
+ *
+ * The kernel is picked on first use: AVX2 or SSE2 where the CPU has
+ * them, else scalar; ROUTER_CHECKSUM=scalar|sse2|avx2 forces one.
+ *
+ * A header rewritten in place keeps a valid checksum by patching it
+ * with the old and new value of every changed field (RFC 1624), in
+ * constant time; fields are given as they are stored, network order.
+ */
+
+enum checksum_impl {
+	CHECKSUM_SCALAR,
+	CHECKSUM_SSE2,
+	CHECKSUM_AVX2,
+	CHECKSUM_IMPLS,
+};
+
+/**
+ * @brief One's complement sum of a buffer, not folded yet. Sums of
+ * consecutive pieces add up as long as every piece but the last has an
+ * even length.
+ *
+ * @param data
+ * @param len in bytes, an odd last byte is padded with zero
+ * @return uint64_t
+ */
+uint64_t checksum_sum(const void *data, size_t len);
+
+/**
+ * @brief checksum_sum with a given kernel, for tests and benchmarks.
+ *
+ * @param impl must be supported, see checksum_supported
+ * @param data
+ * @param len
+ * @return uint64_t
+ */
+uint64_t checksum_sum_impl(enum checksum_impl impl, const void *data, size_t len);
+
+/**
+ * @brief Whether the CPU can run a kernel.
+ *
+ * @param impl
+ * @return bool
+ */
+bool checksum_supported(enum checksum_impl impl);
+
+/**
+ * @brief Name of a kernel, as ROUTER_CHECKSUM takes it.
+ *
+ * @param impl
+ * @return const char*
+ */
+const char *checksum_impl_name(enum checksum_impl impl);
+
+/**
+ * @brief Folds a sum to 16 bits with end-around carry.
+ *
+ * @param sum
+ * @return uint16_t
+ */
+static inline uint16_t checksum_fold(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/**
+ * @brief Checksum of a buffer, with its checksum field zeroed to
+ * compute one, or as received to verify it (0 if valid).
+ *
+ * @param data
+ * @param len in bytes
+ * @return uint16_t in memory order
+ */
+static inline uint16_t checksum(const void *data, size_t len)
+{
+	return ~checksum_fold(checksum_sum(data, len));
+}
+
+/**
+ * @brief Checksum after a 16-bit word it covers changed (RFC 1624,
+ * eqn. 3: HC' = ~(~HC + ~m + m')).
+ *
+ * @param check checksum before the change
+ * @param from old word
+ * @param to new word
+ * @return uint16_t
+ */
+static inline uint16_t checksum_update16(uint16_t check, uint16_t from, uint16_t to)
+{
+	return ~checksum_fold((uint32_t)(uint16_t)~check + (uint16_t)~from + to);
+}
+
+/**
+ * @brief Checksum after a 32-bit field it covers changed, e.g. an
+ * address. The field must start at an even offset of the covered data.
+ *
+ * @param check checksum before the change
+ * @param from old field
+ * @param to new field
+ * @return uint16_t
+ */
+static inline uint16_t checksum_update32(uint16_t check, uint32_t from, uint32_t to)
+{
+	return ~checksum_fold((uint64_t)(uint16_t)~check + (uint32_t)~from + to);
+}
+
+/**
+ * @brief Stores a 16-bit field and patches the checksum covering it.
+ *
+ * @param check checksum field
+ * @param field at an even offset of the covered data
+ * @param to new value
+ */
+static inline void checksum_replace16(uint16_t *check, void *field, uint16_t to)
+{
+	uint16_t from;
+
+	memcpy(&from, field, sizeof(from));
+	memcpy(field, &to, sizeof(to));
+	*check = checksum_update16(*check, from, to);
+}
+
+/**
+ * @brief Stores a 32-bit field and patches the checksum covering it.
+ *
+ * @param check checksum field
+ * @param field at an even offset of the covered data
+ * @param to new value
+ */
+static inline void checksum_replace32(uint16_t *check, void *field, uint32_t to)
+{
+	uint32_t from;
+
+	memcpy(&from, field, sizeof(from));
+	memcpy(field, &to, sizeof(to));
+	*check = checksum_update32(*check, from, to);
+}
+
+/**
+ * @brief Stores a byte, e.g. TTL, TOS or ICMP type, and patches the
+ * checksum through the 16-bit word holding it.
+ *
+ * @param check checksum field, not in the same word as field
+ * @param start first byte covered by the checksum
+ * @param field
+ * @param to new value
+ */
+static inline void checksum_replace8(uint16_t *check, const void *start, uint8_t *field, uint8_t to)
+{
+	uint8_t *word = field - ((field - (const uint8_t *)start) & 1);
+	uint16_t from, now;
+
+	memcpy(&from, word, sizeof(from));
+	*field = to;
+	memcpy(&now, word, sizeof(now));
+	*check = checksum_update16(*check, from, now);
+}
+
+#endif /* _CHECKSUM_H_ */
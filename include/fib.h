@@ -0,0 +1,71 @@
+#ifndef _FIB_H_
+#define _FIB_H_
+
+#include <stdint.h>
+#include "skel.h"
+
+/* Forwarding information base built from the route table */
+struct fib;
+
+/* Lookup structure used by a FIB, chosen at startup */
+enum fib_mode {
+	FIB_TRIE,	/* path-compressed binary trie */
+	FIB_DIR24_8,	/* direct-indexed 2^24 table plus 256 entry groups */
+	FIB_SIMD,	/* prefix/mask arrays scanned with SIMD, small tables */
+};
+
+/* Not looked up yet, for callers that keep routes; lookups give -1 or more */
+#define FIB_UNRESOLVED -2
+
+/* Largest batch fib_lookup_batch resolves in one pass */
+#define FIB_BATCH 16
+
+/**
+ * @brief Parses a FIB mode name ("trie", "dir24-8" or "simd").
+ * NULL or an empty string select the trie.
+ *
+ * @param name
+ * @return enum fib_mode
+ */
+enum fib_mode fib_mode_parse(const char *name);
+
+/**
+ * @brief Builds a FIB from a route table read with read_rtable().
+ * The route table must outlive the FIB, lookups return indexes into it.
+ * When the same prefix appears more than once, the first entry wins.
+ *
+ * @param rtable route table
+ * @param rtable_len number of entries in the route table
+ * @param mode lookup structure to build
+ * @return struct fib*
+ */
+struct fib *fib_create(struct route_table_entry *rtable, int rtable_len,
+		       enum fib_mode mode);
+
+/**
+ * @brief Longest prefix match lookup.
+ *
+ * @param fib
+ * @param daddr destination address, network order
+ * @return int index of the route in the route table or -1 if there is none
+ */
+int fib_lookup(struct fib *fib, uint32_t daddr);
+
+/**
+ * @brief Longest prefix match lookup for several addresses at once.
+ *
+ * @param fib
+ * @param daddrs destination addresses, network order
+ * @param routes output, route index for each address or -1
+ * @param n number of addresses
+ */
+void fib_lookup_batch(struct fib *fib, const uint32_t *daddrs, int *routes, int n);
+
+/**
+ * @brief Frees a FIB created with fib_create.
+ *
+ * @param fib
+ */
+void fib_free(struct fib *fib);
+
+#endif /* _FIB_H_ */
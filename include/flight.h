@@ -0,0 +1,127 @@
+#ifndef _FLIGHT_H_
+#define _FLIGHT_H_
+
+#include <stdint.h>
+#include "skel.h"
+#include "latency.h"
+
+/*
+ * Flight recorder: every thread keeps the last packets it handled in a
+ * ring of its own, one compact record each, always on. SIGUSR2 writes
+ * the rings of all threads to ROUTER_FLIGHT_FILE in timestamp order, as
+ * text or, for a name ending in .pcapng, as pcap-ng with one rebuilt
+ * header per record and the verdict in its comment.
+ */
+
+/* Records per thread unless ROUTER_FLIGHT_RECORDS says otherwise */
+#define FLIGHT_RECORDS 4096
+
+/* What became of a packet */
+enum flight_verdict {
+	FLIGHT_LOCAL,	/* ARP or ICMP for the router, answered or learned */
+	FLIGHT_FORWARDED,
+	FLIGHT_QUEUED,	/* waiting for the MAC of the next hop */
+	FLIGHT_DROPPED,	/* FLIGHT_DROPPED + enum stats_drop */
+};
+
+struct flight_record {
+	uint64_t ts;	/* latency_now() */
+	uint32_t saddr;	/* network order, ARP: sender */
+	uint32_t daddr;	/* network order, ARP: target */
+	uint16_t sport;	/* ICMP: type << 8 | code, ARP: op */
+	uint16_t dport;
+	int32_t route;	/* index in the route table, -1 for none */
+	uint16_t ethertype;
+	uint16_t len;
+	uint8_t proto;
+	uint8_t in_if;
+	uint8_t out_if;	/* 0xff for none */
+	uint8_t verdict;
+};
+
+/* Ring of one thread; only that thread writes records and head */
+struct flight_ring {
+	uint64_t head;	/* records written so far */
+	uint32_t mask;
+	struct flight_record records[];
+};
+
+extern __thread struct flight_ring *flight_self;
+/* Record nobody dumps, for notes made outside a packet */
+extern struct flight_record flight_scratch;
+/* Record of the packet being handled, flight_scratch between packets */
+extern __thread struct flight_record *flight_current;
+
+/**
+ * @brief Allocates the ring of the calling thread. Called on its first
+ * packet.
+ *
+ * @return struct flight_ring*
+ */
+struct flight_ring *flight_attach(void);
+
+/**
+ * @brief Starts a record for a received packet: time, ingress and the
+ * addresses, protocol and ports of its headers.
+ *
+ * @param m
+ */
+void flight_begin(packet *m);
+
+/**
+ * @brief Publishes the record of the current packet to the dump.
+ */
+static inline void flight_end(void)
+{
+	struct flight_ring *r = flight_self;
+
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+	/* The next slot may hold the oldest record once the ring wrapped */
+	flight_current = &flight_scratch;
+}
+
+/**
+ * @brief Notes the route and egress interface of the current packet.
+ *
+ * @param route
+ * @param interface
+ */
+static inline void flight_route(int route, int interface)
+{
+	flight_current->route = route;
+	flight_current->out_if = interface;
+}
+
+/**
+ * @brief Notes what became of the current packet.
+ *
+ * @param verdict
+ */
+static inline void flight_verdict(enum flight_verdict verdict)
+{
+	flight_current->verdict = verdict;
+}
+
+/**
+ * @brief Notes a drop, unless the packet was dropped already: the
+ * first reason counted for it is the one recorded.
+ *
+ * @param reason enum stats_drop
+ */
+static inline void flight_drop(int reason)
+{
+	if (flight_current->verdict < FLIGHT_DROPPED)
+		flight_current->verdict = FLIGHT_DROPPED + reason;
+}
+
+/**
+ * @brief Sizes the rings from ROUTER_FLIGHT_RECORDS, blocks SIGUSR2 and
+ * starts the thread that dumps on it. Call before starting any other
+ * thread, they must inherit the blocked signal.
+ *
+ * @param path file written on every SIGUSR2
+ * @param num_interfaces interfaces in interface_table
+ */
+void flight_start(const char *path, int num_interfaces);
+
+#endif /* _FLIGHT_H_ */
@@ -0,0 +1,67 @@
+#ifndef _FRAME_TEMPLATES_H_
+#define _FRAME_TEMPLATES_H_
+
+#include "skel.h"
+
+#define ARP_FRAME_LEN (sizeof(struct ether_header) + sizeof(struct arp_header))
+#define ICMP_FRAME_LEN (sizeof(struct ether_header) + sizeof(struct iphdr) + sizeof(struct icmphdr))
+/* Bytes of the offending datagram past its IP header quoted by an ICMP error */
+#define ICMP_ERROR_QUOTE 8
+
+/*
+ * Every function below starts from a frame prebuilt for the interface
+ * (our MAC and IP already in place) and writes only the fields that
+ * depend on the packet. The templates are per thread and rebuilt when
+ * the interface table changes.
+ */
+
+/**
+ * @brief Builds a broadcast ARP request for an address.
+ *
+ * @param frame buffer of at least ARP_FRAME_LEN bytes
+ * @param interface interface the request goes out on
+ * @param target_ip address to resolve, network order
+ * @return int frame length
+ */
+int frame_arp_request(char *frame, int interface, uint32_t target_ip);
+
+/**
+ * @brief Builds an ARP reply giving our MAC to a neighbor.
+ *
+ * @param frame buffer of at least ARP_FRAME_LEN bytes
+ * @param interface interface the reply goes out on
+ * @param target_mac MAC of the neighbor
+ * @param target_ip IP of the neighbor, network order
+ * @return int frame length
+ */
+int frame_arp_reply(char *frame, int interface, const uint8_t *target_mac, uint32_t target_ip);
+
+/**
+ * @brief Builds the echo reply to an echo request, with the same
+ * identifier, sequence number and data. The checksum of the request is
+ * patched, not recomputed, so it must have been verified.
+ *
+ * @param frame buffer of MAX_LEN bytes
+ * @param interface interface the request came in on
+ * @param request frame of the request
+ * @param request_len
+ * @return int frame length
+ */
+int frame_icmp_echo_reply(char *frame, int interface, const char *request, int request_len);
+
+/**
+ * @brief Builds an ICMP error about a datagram, quoting its IP header and
+ * the first 8 bytes of its data (RFC 792).
+ *
+ * @param frame buffer of MAX_LEN bytes
+ * @param interface interface the datagram came in on
+ * @param type ICMP type, e.g. ICMP_TIME_EXCEEDED or ICMP_DEST_UNREACH
+ * @param code ICMP code
+ * @param offending frame of the datagram
+ * @param offending_len
+ * @return int frame length
+ */
+int frame_icmp_error(char *frame, int interface, uint8_t type, uint8_t code,
+		     const char *offending, int offending_len);
+
+#endif /* _FRAME_TEMPLATES_H_ */
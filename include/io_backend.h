@@ -0,0 +1,28 @@
+#ifndef _IO_BACKEND_H_
+#define _IO_BACKEND_H_
+
+#include "skel.h"
+
+/*
+ * Where the packets of the router come from and go to. init() picks one
+ * with ROUTER_IO and the packet functions of skel.h call into it.
+ */
+struct io_backend {
+	/* Opens the interfaces named in interface_table, fills in their addresses */
+	void (*setup)(int num_interfaces);
+	/* Readies the calling thread, the one that ran setup already is */
+	void (*thread_init)(void);
+	/* Blocks for at least one packet, as get_packets */
+	int (*receive)(packet **m, int max);
+	/* Queues a packet on m->interface, as send_packet_batch */
+	void (*send)(packet *m);
+	/* Sends everything queued by the calling thread */
+	void (*flush)(void);
+};
+
+/* Packet sockets, TPACKET rings or AF_XDP, see ROUTER_RX and ROUTER_TX */
+extern const struct io_backend socket_backend;
+/* Replays pcap files and captures the output to pcap files, see pcap_io.c */
+extern const struct io_backend pcap_backend;
+
+#endif /* _IO_BACKEND_H_ */
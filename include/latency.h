@@ -0,0 +1,140 @@
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "skel.h"
+#include "thread_registry.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Per-stage latency histograms, only built with `make ROUTER_LATENCY=1`.
+ * Without it every LATENCY_ macro expands to nothing.
+ *
+ *	LATENCY_DECLARE(t);
+ *	LATENCY_STAMP(t);			t = now
+ *	LATENCY_RECORD(LATENCY_ROUTE, t);	record now - t, t = now
+ *
+ * Times are TSC cycles, converted to ns when dumped.
+ */
+
+/* Stages of a packet; receive, transmit and worker lookups are per burst */
+enum latency_stage {
+	LATENCY_RECEIVE,	/* get_packets, without waiting for traffic */
+	LATENCY_PARSE,	/* getARPHeader, getICMPHeader */
+	LATENCY_VALIDATE,	/* TTL and checksum checks */
+	LATENCY_ROUTE,	/* route cache and FIB, per burst in processBurst */
+	LATENCY_ARP,	/* adjacency, or queuing for the next hop */
+	LATENCY_TRANSMIT,	/* flush_packet_batches */
+	LATENCY_STAGES,
+};
+
+/*
+ * Log-bucketed like HDR histograms: values below LATENCY_SUB_BUCKETS
+ * get a bucket each, every power of two above is split into
+ * LATENCY_SUB_BUCKETS linear buckets, so the error stays under 1/16.
+ */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+/* Histograms of one thread, written by it alone */
+struct latency_thread {
+	uint64_t counts[LATENCY_STAGES][LATENCY_BUCKETS];
+};
+
+extern __thread struct latency_thread *latency_self;
+
+/**
+ * @brief Allocates the histograms of the calling thread and adds them
+ * to the ones the dump reads. Called on the first record of a thread.
+ *
+ * @return struct latency_thread*
+ */
+struct latency_thread *latency_attach(void);
+
+/**
+ * @brief Reads the timestamp counter, or the monotonic clock in ns
+ * where there is none.
+ *
+ * @return uint64_t
+ */
+static inline uint64_t latency_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+/**
+ * @brief Ticks of latency_now per ns, measured over 10 ms on the first
+ * call.
+ *
+ * @return double
+ */
+double latency_ticks_per_ns(void);
+
+/**
+ * @brief Bucket of a value.
+ *
+ * @param v
+ * @return int
+ */
+static inline int latency_bucket(uint64_t v)
+{
+	if (v < LATENCY_SUB_BUCKETS)
+		return v;
+	int e = 63 - __builtin_clzll(v);
+	return (e - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS +
+	       ((v >> (e - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/**
+ * @brief Counts a value in a histogram of the calling thread.
+ *
+ * @param stage
+ * @param v cycles
+ */
+static inline void latency_record(enum latency_stage stage, uint64_t v)
+{
+	struct latency_thread *lt = latency_self;
+
+	if (__builtin_expect(lt == NULL, 0))
+		lt = latency_attach();
+	thread_counter_add(&lt->counts[stage][latency_bucket(v)], 1);
+}
+
+/**
+ * @brief Prints count, p50, p90, p99, p999 and max in ns of every
+ * stage, summed over the threads. Safe while they keep recording.
+ *
+ * @param f
+ */
+void latency_dump(FILE *f);
+
+#ifdef ROUTER_LATENCY
+#define LATENCY_DECLARE(t) uint64_t t
+#define LATENCY_STAMP(t) ((t) = latency_now())
+#define LATENCY_RECORD(stage, t) \
+	do { \
+		uint64_t latency_now_ = latency_now(); \
+		latency_record((stage), latency_now_ - (t)); \
+		(t) = latency_now_; \
+	} while (0)
+#define LATENCY_DUMP(f) latency_dump(f)
+#else
+#define LATENCY_DECLARE(t)
+#define LATENCY_STAMP(t) ((void)0)
+#define LATENCY_RECORD(stage, t) ((void)0)
+#define LATENCY_DUMP(f) ((void)0)
+#endif
+
+#endif /* _LATENCY_H_ */
@@ -0,0 +1,65 @@
+#ifndef _PACKET_POOL_H_
+#define _PACKET_POOL_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "skel.h"
+
+/* Buffers every thread keeps for itself before going to the shared stack */
+#define PACKET_POOL_CACHE 64
+/* Most packets a pool may have, about 26 GiB of buffers */
+#define PACKET_POOL_MAX_SIZE (1u << 24)
+
+/*
+ * Fixed set of cache-aligned packets allocated at startup. Free packets
+ * sit on a shared stack; every thread keeps a small cache of its own in
+ * front of it and moves buffers in and out of the stack in halves of it.
+ */
+struct packet_pool {
+	packet *bufs;
+	size_t map_len;	/* 0 unless the buffers are on hugepages */
+	uint32_t size;
+	packet **free;	/* shared stack of free packets */
+	uint32_t free_count;
+	pthread_mutex_t lock;	/* protects the shared stack */
+};
+
+/**
+ * @brief Allocates every packet of a pool up front. With hugepages set,
+ * the buffers are mapped on 2 MB pages if the system has them reserved,
+ * and on normal pages otherwise.
+ *
+ * @param size number of packets
+ * @param hugepages try to use hugepages
+ * @return struct packet_pool*
+ */
+struct packet_pool *packet_pool_create(uint32_t size, int hugepages);
+
+/**
+ * @brief Takes a free packet. It has one reference and uses its own buffer.
+ *
+ * @param pp
+ * @return packet* the packet or NULL if every packet is in use
+ */
+packet *packet_alloc(struct packet_pool *pp);
+
+/**
+ * @brief Takes one more reference to a pool packet, e.g. to keep it in a
+ * queue after the current holder is done with it.
+ *
+ * @param m
+ */
+static inline void packet_get(packet *m)
+{
+	__atomic_add_fetch(&m->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Drops a reference. The last one gives the packet back to its
+ * pool. Packets that do not come from a pool are left alone.
+ *
+ * @param m
+ */
+void packet_put(packet *m);
+
+#endif /* _PACKET_POOL_H_ */
@@ -0,0 +1,129 @@
+#ifndef _PENDING_H_
+#define _PENDING_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "skel.h"
+#include "packet_pool.h"
+
+/* Milliseconds before an unanswered ARP request for a next hop is sent again */
+#define PENDING_ARP_RETRY_MS 1000
+/* Milliseconds a packet may wait for its next hop before it is dropped */
+#define PENDING_MAX_AGE_MS 3000
+/* Most packets one next hop may queue */
+#define PENDING_MAX_DEPTH 4096
+/* Most queues a table may have, larger capacities are cut to it */
+#define PENDING_MAX_QUEUES (1u << 24)
+
+/* A held pool packet, routed and ready to send */
+struct pending_entry {
+	packet *m;
+	uint64_t queued_at;	/* CLOCK_MONOTONIC, ns */
+	int in_interface;	/* for the drop counter if it expires */
+};
+
+/* Packets waiting for the MAC of one next hop */
+struct pending_queue {
+	uint32_t next_hop;	/* 0 while the queue is free */
+	struct pending_entry *entries;	/* ring of max_depth entries, NULL while free */
+	int head;	/* oldest entry */
+	int depth;
+	bool requested;	/* an ARP request is outstanding */
+	uint64_t requested_at;	/* CLOCK_MONOTONIC, ns */
+	pthread_mutex_t lock;	/* the queue is shared by every worker */
+};
+
+/*
+ * Pending queues keyed by next hop IP. The index maps a next hop to its
+ * queue, open addressing; it and the free list are only touched with the
+ * table locked, and a queue is locked before the table is unlocked, so
+ * a queue is never given to another next hop while it is in use. A queue
+ * is freed once it is empty and its ARP request was answered or is older
+ * than the retry. Every function is thread safe.
+ */
+struct pending_table {
+	struct pending_queue *queues;	/* capacity queues */
+	int *free;	/* stack of free queues */
+	int free_count;
+	int *index;	/* queue of a next hop, -1 marks an unused slot */
+	uint32_t index_mask;
+	uint32_t capacity;
+	int max_depth;
+	int max_held;	/* most packets queued over all queues */
+	int held;
+	uint64_t arp_retry;	/* ns, PENDING_ARP_RETRY_MS unless changed */
+	uint64_t max_age;	/* ns, PENDING_MAX_AGE_MS unless changed */
+	struct packet_pool *pool;	/* for copies of frames outside the pool */
+	pthread_mutex_t lock;	/* guards index and free, taken before a queue lock */
+};
+
+/**
+ * @brief Creates an empty table of pending queues.
+ *
+ * @param capacity most next hops that can have a queue at once, at most
+ * PENDING_MAX_QUEUES
+ * @param max_depth most packets queued for one next hop
+ * @param max_held most packets queued over all next hops, what the pool
+ * can spare for them
+ * @param pool where copies of packets outside the pool come from
+ * @return struct pending_table*
+ */
+struct pending_table *pending_create(uint32_t capacity, int max_depth, int max_held,
+				     struct packet_pool *pool);
+
+/**
+ * @brief Queues a packet until the MAC of its next hop is known, in the
+ * queue of the next hop, which is taken from the free ones if it has
+ * none. Packets that waited longer than the table's max_age are dropped
+ * first and counted as ARP_PENDING drops. A pool packet using its own
+ * buffer is kept with a new reference, anything else is copied into a
+ * pool packet. m->interface must already be the egress interface.
+ *
+ * @param pt
+ * @param next_hop next hop IP, network order
+ * @param m packet
+ * @param in_interface interface the packet came in on
+ * @return true: the packet is queued
+ * @return false: it was not, the queue, the table or the pool is full
+ * or every queue is taken
+ */
+bool pending_enqueue(struct pending_table *pt, uint32_t next_hop, packet *m, int in_interface);
+
+/**
+ * @brief Checks if an ARP request must be sent for a next hop and marks
+ * it as sent. True when no request is outstanding, when the last one
+ * went unanswered for the table's arp_retry, or when every queue is
+ * taken so nothing can remember the request. Call it on every miss,
+ * whether the packet was queued or not: a full queue only drains when
+ * a reply comes.
+ *
+ * @param pt
+ * @param next_hop next hop IP, network order
+ * @return true: send an ARP request
+ * @return false: a request is already outstanding
+ */
+bool pending_arp_due(struct pending_table *pt, uint32_t next_hop);
+
+/**
+ * @brief Drops the packets that waited too long from every queue, also
+ * those of next hops nobody sends to any more, and frees the queues
+ * that are left empty. Walks the whole table, meant for when the pool
+ * runs dry or every queue is taken.
+ *
+ * @param pt
+ */
+void pending_expire_all(struct pending_table *pt);
+
+/**
+ * @brief Takes the oldest packet that is not too old out of the queue of
+ * a next hop. The queue is freed once it is empty. The caller drops the
+ * reference with packet_put.
+ *
+ * @param pt
+ * @param next_hop next hop IP, network order
+ * @return packet* the packet or NULL when the queue is empty or missing
+ */
+packet *pending_dequeue(struct pending_table *pt, uint32_t next_hop);
+
+#endif /* _PENDING_H_ */
@@ -0,0 +1,36 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include "skel.h"
+#include "packet_pool.h"
+
+/* Slots of the ring carrying packets from one stage to the next */
+#define PIPELINE_RING_SIZE 512
+/* Empty polls before an idle stage starts yielding the CPU */
+#define PIPELINE_SPIN 1024
+
+/* What the forwarding workers run */
+struct pipeline_ops {
+	void (*worker_init)(int id);	/* once, on the worker thread */
+	void (*burst_begin)(int id);	/* before every burst */
+	void (*process)(packet *m);	/* handles one packet */
+};
+
+/**
+ * @brief Runs the router as a pipeline of threads: one RX thread per
+ * interface spreads the packets over the forwarding workers by flow hash,
+ * and one TX thread per interface batches the output of every worker.
+ * Stages talk through single-producer/single-consumer rings carrying
+ * pointers to pool packets; the last stage holding a packet gives it
+ * back to the pool. With ROUTER_PIN set, every thread is pinned to its
+ * own CPU. Never returns.
+ *
+ * @param interfaces number of interfaces
+ * @param workers number of forwarding workers
+ * @param pool where the RX threads take their packets from
+ * @param ops
+ */
+void pipeline_run(int interfaces, int workers, struct packet_pool *pool,
+		  const struct pipeline_ops *ops);
+
+#endif /* _PIPELINE_H_ */
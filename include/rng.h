@@ -0,0 +1,21 @@
+#ifndef _RNG_H_
+#define _RNG_H_
+
+#include <stdint.h>
+
+/*
+ * xorshift64* for test and load data: fast, and with a fixed seed, so
+ * runs are comparable and failures reproduce. Every file that includes
+ * it has a state of its own. Not for anything that must be unguessable.
+ */
+static uint64_t rng_state = 88172645463325252ull;
+
+static inline uint64_t rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ull;
+}
+
+#endif /* _RNG_H_ */
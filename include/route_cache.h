@@ -0,0 +1,64 @@
+#ifndef _ROUTE_CACHE_H_
+#define _ROUTE_CACHE_H_
+
+#include <stdint.h>
+#include "skel.h"
+
+/* Ways per set of the destination cache */
+#define ROUTE_CACHE_WAYS 4
+/* Most sets of a cache, larger counts are cut to it */
+#define ROUTE_CACHE_MAX_SETS (1u << 20)
+
+/* Longest prefix match of one destination */
+struct route_cache_entry {
+	uint32_t daddr;
+	uint32_t generation;
+	int route;	/* index in the route table */
+};
+
+/* Set-associative cache of route lookups, keyed by destination */
+struct route_cache {
+	struct route_cache_entry *entries;
+	uint8_t *victim;	/* next way to replace, per set */
+	uint32_t set_mask;
+	uint32_t generation;	/* entries from older generations are stale */
+	uint64_t hits;
+	uint64_t misses;
+};
+
+/**
+ * @brief Creates an empty destination cache.
+ *
+ * @param sets number of sets, at most ROUTE_CACHE_MAX_SETS, rounded up to
+ * a power of two
+ * @return struct route_cache*
+ */
+struct route_cache *route_cache_create(uint32_t sets);
+
+/**
+ * @brief Looks a destination up and counts the hit or miss.
+ *
+ * @param rc
+ * @param daddr destination address, network order
+ * @return struct route_cache_entry* the entry or NULL on a miss
+ */
+struct route_cache_entry *route_cache_lookup(struct route_cache *rc, uint32_t daddr);
+
+/**
+ * @brief Caches the route of a destination.
+ *
+ * @param rc
+ * @param daddr destination address, network order
+ * @param route index in the route table
+ */
+void route_cache_insert(struct route_cache *rc, uint32_t daddr, int route);
+
+/**
+ * @brief Drops every cached entry. Must be called whenever the route
+ * table changes. Takes constant time.
+ *
+ * @param rc
+ */
+void route_cache_invalidate(struct route_cache *rc);
+
+#endif /* _ROUTE_CACHE_H_ */
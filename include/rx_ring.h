@@ -0,0 +1,51 @@
+#ifndef _RX_RING_H_
+#define _RX_RING_H_
+
+#include "skel.h"
+
+/* Geometry of the TPACKET_V3 receive ring of one interface */
+#define RX_RING_BLOCK_SIZE (1 << 18)
+#define RX_RING_BLOCK_NR 16
+#define RX_RING_FRAME_SIZE 2048
+/* Milliseconds before the kernel hands over a partially filled block */
+#define RX_RING_BLOCK_TIMEOUT 1
+
+/* Memory-mapped TPACKET_V3 receive ring of a packet socket */
+struct rx_ring {
+	uint8_t *map;
+	size_t map_len;
+	int cur;	/* block being read */
+	int pkts_left;	/* packets of cur not handed out yet */
+	struct tpacket3_hdr *next_pkt;
+	int done[RX_RING_BLOCK_NR];	/* read blocks to give back */
+	int done_count;
+};
+
+/**
+ * @brief Sets up a TPACKET_V3 receive ring on a bound packet socket.
+ *
+ * @param sockfd packet socket
+ * @return struct rx_ring*
+ */
+struct rx_ring *rx_ring_create(int sockfd);
+
+/**
+ * @brief Hands out up to max frames that are ready in the ring.
+ * The packets point at the frames inside the ring, nothing is copied.
+ *
+ * @param r
+ * @param m array of at least max packet pointers
+ * @param max
+ * @return int number of packets, 0 when no block is ready
+ */
+int rx_ring_receive(struct rx_ring *r, packet **m, int max);
+
+/**
+ * @brief Gives every block that was read completely back to the kernel.
+ * Frames handed out from those blocks must not be used afterwards.
+ *
+ * @param r
+ */
+void rx_ring_release(struct rx_ring *r);
+
+#endif /* _RX_RING_H_ */
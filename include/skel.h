@@ -9,6 +9,7 @@
 #include <linux/if_packet.h>
 #include <net/ethernet.h> /* the L2 protocols */
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -33,6 +34,16 @@
  */
 #define MAX_LEN 1600
 #define ROUTER_NUM_INTERFACES 3
+/* Most forwarding threads ROUTER_WORKERS may ask for */
+#define ROUTER_MAX_WORKERS 256
+/* Packets get_packet takes from one interface before moving to the next */
+#define RX_BUDGET 32
+/* Frames send_packet_batch holds per interface before flushing them */
+#define TX_BATCH 32
+/* Packets the router receives and processes at a time */
+#define BURST_SIZE 32
+/* Alignment that keeps data written by different threads apart */
+#define CACHE_LINE_SIZE 64
 
 #define DIE(condition, message) \
 	do { \
@@ -43,11 +54,44 @@
 		} \
 	} while (0)
 
+struct packet_pool;
+
 typedef struct {
 	int len;
-	char payload[MAX_LEN];
+	char *payload;	/* frame start, buf or a frame inside an RX ring */
 	int interface;
-} packet;
+	int refcnt;	/* holders of a pool packet */
+	struct packet_pool *pool;	/* NULL for packets outside a pool */
+	char buf[MAX_LEN];
+} __attribute__((aligned(CACHE_LINE_SIZE))) packet;
+
+/**
+ * @brief Makes a packet use its own buffer. The packet does not belong
+ * to a pool.
+ *
+ * @param m
+ */
+static inline void packet_init(packet *m)
+{
+	m->payload = m->buf;
+	m->pool = NULL;
+}
+
+/**
+ * @brief Copies a packet into the own buffer of dst, so it stays valid
+ * after the frame src points to is given back to an RX ring. The pool
+ * and references of dst are kept.
+ *
+ * @param dst
+ * @param src
+ */
+static inline void packet_copy(packet *dst, const packet *src)
+{
+	dst->len = src->len;
+	dst->interface = src->interface;
+	dst->payload = dst->buf;
+	memcpy(dst->buf, src->payload, src->len);
+}
 
 /* Ethernet ARP packet from RFC 826 */
 struct arp_header {
@@ -76,7 +120,19 @@ struct arp_entry {
     uint8_t mac[6];
 };
 
+/* Addresses of a router interface, cached at startup */
+struct interface_info {
+	char name[IFNAMSIZ];
+	uint32_t ip;	/* network order */
+	uint8_t mac[ETH_ALEN];
+	int ifindex;
+	int mtu;
+};
+
 extern int interfaces[ROUTER_NUM_INTERFACES];
+extern struct interface_info interface_table[ROUTER_NUM_INTERFACES];
+/* Forwarding threads, ROUTER_WORKERS, 1 unless set */
+extern int num_workers;
 
 /**
  * @brief Sends a packet on an interface.
@@ -94,6 +150,57 @@ int send_packet(packet *m);
  */
 int get_packet(packet *m);
 
+/**
+ * @brief Blocking function for receiving a burst of packets,
+ * taken round-robin from the ready interfaces with recvmmsg.
+ * With ROUTER_RX=ring the packets point into the TPACKET_V3 ring of
+ * their interface instead and stay valid until the next call.
+ * The caller hands in the packets to fill, usually from a packet pool.
+ * Returns -1 in exceptional conditions.
+ *
+ * @param m array of at least max packet pointers
+ * @param max most packets to receive
+ * @return int number of packets received
+ */
+int get_packets(packet **m, int max);
+
+/**
+ * @brief Adds a packet to the transmit batch of its interface.
+ * The batch is sent with sendmmsg when it fills up or when
+ * flush_packet_batches is called. A pool packet is sent from its own
+ * buffer and held with a reference until then, anything else is copied.
+ *
+ * @param m packet
+ */
+void send_packet_batch(packet *m);
+
+/**
+ * @brief Sends every batched packet.
+ */
+void flush_packet_batches(void);
+
+/**
+ * @brief Makes send_packet_batch and flush_packet_batches of the calling
+ * thread call send and flush instead, e.g. to hand the frames to another
+ * thread. NULL restores the sockets.
+ *
+ * @param send called for every packet, must copy what it keeps
+ * @param flush called at the end of every burst
+ */
+void redirect_packet_output(void (*send)(packet *m), void (*flush)(void));
+
+/**
+ * @brief Blocking function for receiving a burst of packets from one
+ * interface with recvmmsg, into the own buffers of the packets.
+ * Only for the packet sockets, not for ROUTER_RX=ring or xdp.
+ *
+ * @param interface
+ * @param m array of at least max packet pointers
+ * @param max most packets to receive, at most RX_BUDGET
+ * @return int number of packets received
+ */
+int receive_packets(int interface, packet **m, int max);
+
 /**
  * @brief Get the interface ip object.
  *
@@ -111,6 +218,48 @@ char *get_interface_ip(int interface);
  */
 void get_interface_mac(int interface, uint8_t *mac);
 
+/**
+ * @brief Re-reads the IP, MAC, ifindex and MTU of every interface into
+ * interface_table. Called by init() and whenever the netlink socket
+ * reports an address or link change.
+ *
+ * @return int 1 if the IP or MAC of an interface changed, 0 otherwise
+ */
+int refresh_interface_table(void);
+
+/**
+ * @brief Sets a function called after a netlink refresh changed the IP
+ * or MAC of an interface, on the thread that follows netlink.
+ *
+ * @param handler NULL for none
+ */
+void on_interface_change(void (*handler)(void));
+
+/**
+ * @brief Opens the packet sockets, rings and epoll set of the calling
+ * thread, so it can run get_packets and the send functions on its own.
+ * With more than one worker every socket joins the PACKET_FANOUT group
+ * of its interface, which spreads the flows by hash. The thread that
+ * called init() is already set up.
+ */
+void init_worker(void);
+
+/**
+ * @brief Lets the calling thread send on one interface with
+ * send_packet_batch, through the socket opened by init() or a transmit
+ * ring of its own. The thread does not receive.
+ *
+ * @param interface
+ */
+void init_sender(int interface);
+
+/**
+ * @brief Follows netlink and refreshes interface_table on every address
+ * or link change. Never returns; for a thread that does not call
+ * get_packets.
+ */
+void watch_interfaces(void);
+
 /**
  * @brief Homework infrastructure function.
  *
@@ -145,6 +294,18 @@ uint16_t ip_checksum(uint8_t *data, size_t size);
  */
 int hwaddr_aton(const char *txt, uint8_t *addr);
 
+/**
+ * @brief Reads a whole number from an environment variable. Dies when
+ * it is set to anything but a number from min to max.
+ *
+ * @param name variable
+ * @param fallback value when the variable is not set
+ * @param min
+ * @param max
+ * @return unsigned long
+ */
+unsigned long env_number(const char *name, unsigned long fallback, unsigned long min, unsigned long max);
+
 /* Populates a route table from file, rtable should be allocated
  * e.g. rtable = malloc(sizeof(struct route_table_entry) * 80000);
  * This function returns the size of the route table.
@@ -0,0 +1,53 @@
+#ifndef _SPSC_RING_H_
+#define _SPSC_RING_H_
+
+#include <stdint.h>
+#include "skel.h"
+
+/*
+ * Lock-free single-producer/single-consumer ring of pointers. The
+ * producer and consumer indexes live on separate cache lines, and each
+ * side keeps a private copy of the other's index so it only reads the
+ * shared one when its copy says the ring is full or empty.
+ */
+struct spsc_ring {
+	/* Written by the producer */
+	uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint32_t tail_cache;	/* last tail the producer saw */
+	/* Written by the consumer */
+	uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint32_t head_cache;	/* last head the consumer saw */
+	/* Read-only after creation */
+	uint32_t mask __attribute__((aligned(CACHE_LINE_SIZE)));
+	void **objs;
+};
+
+/**
+ * @brief Creates an empty ring.
+ *
+ * @param size slots, rounded up to a power of two
+ * @return struct spsc_ring*
+ */
+struct spsc_ring *spsc_ring_create(uint32_t size);
+
+/**
+ * @brief Adds up to n pointers at the head. Producer side only.
+ *
+ * @param r
+ * @param objs pointers to add, in order
+ * @param n
+ * @return int number added, less than n when the ring fills up
+ */
+int spsc_ring_enqueue_burst(struct spsc_ring *r, void * const *objs, int n);
+
+/**
+ * @brief Takes up to n pointers from the tail. Consumer side only.
+ *
+ * @param r
+ * @param objs where the pointers are written
+ * @param n
+ * @return int number taken, 0 when the ring is empty
+ */
+int spsc_ring_dequeue_burst(struct spsc_ring *r, void **objs, int n);
+
+#endif /* _SPSC_RING_H_ */
@@ -0,0 +1,125 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include "skel.h"
+#include "flight.h"
+#include "thread_registry.h"
+
+/* Why a packet was dropped */
+enum stats_drop {
+	STATS_DROP_BAD_CHECKSUM,
+	STATS_DROP_TTL_EXPIRED,
+	STATS_DROP_NO_ROUTE,
+	STATS_DROP_ARP_PENDING,	/* no room in the pending queues, or expired there */
+	STATS_DROP_QUEUE_FULL,	/* the next pipeline stage is full */
+	STATS_DROP_NOT_FOR_US,	/* ARP or ICMP for another host, or unhandled */
+	STATS_DROP_NO_BUFFER,	/* an ARP or ICMP reply found no free buffer */
+	STATS_DROP_REASONS,
+};
+
+/* Counters of one interface, kept by one thread */
+struct stats_interface {
+	uint64_t rx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_packets;
+	uint64_t tx_bytes;
+	uint64_t tx_dropped;	/* routed out of here, but the TX stage or ring was full */
+	uint64_t drops[STATS_DROP_REASONS];	/* by ingress, see stats_drop */
+	uint64_t arp_requests_sent;
+	uint64_t arp_replies_sent;
+	uint64_t arp_replies_received;
+	uint64_t icmp_echo_replies;
+	uint64_t icmp_time_exceeded;
+	uint64_t icmp_unreachable;
+};
+
+/*
+ * Counters of one thread. Only that thread writes them, so they are
+ * plain increments; blocks are cache aligned so threads never share a
+ * line. Readers sum them up on demand. The block of the threads that
+ * did not register is shared and marked so, it takes atomic adds.
+ */
+struct stats_thread {
+	char name[16];
+	int shared;
+	struct stats_interface ifs[ROUTER_NUM_INTERFACES];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* Counters of the calling thread, shared ones until it registers */
+extern __thread struct stats_thread *stats_self;
+
+/**
+ * @brief Gives the calling thread counters of its own. Does nothing if
+ * it has them already or the registry is full.
+ *
+ * @param name shown by the exporter, e.g. "worker-0"
+ */
+void stats_register(const char *name);
+
+/**
+ * @brief Adds to a counter of the calling thread.
+ *
+ * @param counter
+ * @param n
+ */
+static inline void stats_add(uint64_t *counter, uint64_t n)
+{
+	if (__builtin_expect(stats_self->shared, 0))
+		__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+	else
+		thread_counter_add(counter, n);
+}
+
+/* Counter of an interface of the calling thread */
+#define STATS(interface, field) (&stats_self->ifs[(interface)].field)
+
+/**
+ * @brief Counts a received packet.
+ *
+ * @param m packet
+ */
+static inline void stats_rx(packet *m)
+{
+	stats_add(STATS(m->interface, rx_packets), 1);
+	stats_add(STATS(m->interface, rx_bytes), m->len);
+}
+
+/**
+ * @brief Counts a sent packet.
+ *
+ * @param m packet
+ */
+static inline void stats_tx(packet *m)
+{
+	stats_add(STATS(m->interface, tx_packets), 1);
+	stats_add(STATS(m->interface, tx_bytes), m->len);
+}
+
+/**
+ * @brief Counts a dropped packet and notes it in the flight record.
+ * Replies the router generates are not the packet being handled: count
+ * those with stats_add on drops[STATS_DROP_NO_BUFFER] of the interface
+ * they were to leave on, which is the one the request came in on.
+ *
+ * @param interface interface the packet came in on
+ * @param reason
+ */
+static inline void stats_drop(int interface, enum stats_drop reason)
+{
+	stats_add(STATS(interface, drops[reason]), 1);
+	flight_drop(reason);
+}
+
+/**
+ * @brief Starts a thread that answers every connection to a Unix stream
+ * socket with a text dump of the counters, "thread interface counter
+ * value" per line, per thread and as totals, then closes it. The
+ * counters are read without locks, the fast path never waits.
+ *
+ * @param path socket path, replaced if it exists
+ * @param num_interfaces interfaces in interface_table
+ */
+void stats_serve(const char *path, int num_interfaces);
+
+#endif /* _STATS_H_ */
@@ -0,0 +1,76 @@
+#ifndef _THREAD_REGISTRY_H_
+#define _THREAD_REGISTRY_H_
+
+#include <stdint.h>
+
+/*
+ * Per-thread blocks of one kind (counters, histograms, flight rings)
+ * published for a reader that sums or dumps them while the threads keep
+ * writing. Every thread writes only its own block and never takes a
+ * lock; threads past THREAD_REGISTRY_MAX get no slot, and the module
+ * gives them a shared block of its own.
+ */
+
+/* Threads that can have a block in one registry */
+#define THREAD_REGISTRY_MAX 64
+
+struct thread_registry {
+	void *blocks[THREAD_REGISTRY_MAX];
+	int count;	/* slots taken, may run past THREAD_REGISTRY_MAX */
+};
+
+/**
+ * @brief Publishes the block of the calling thread.
+ *
+ * @param r
+ * @param block fully initialized, it is visible to readers at once
+ * @return int slot of the block, -1 if the registry is full
+ */
+static inline int thread_registry_add(struct thread_registry *r, void *block)
+{
+	int id = __atomic_fetch_add(&r->count, 1, __ATOMIC_RELAXED);
+
+	if (id >= THREAD_REGISTRY_MAX)
+		return -1;
+	__atomic_store_n(&r->blocks[id], block, __ATOMIC_RELEASE);
+	return id;
+}
+
+/**
+ * @brief Slots a reader has to walk.
+ *
+ * @param r
+ * @return int
+ */
+static inline int thread_registry_count(struct thread_registry *r)
+{
+	int count = __atomic_load_n(&r->count, __ATOMIC_RELAXED);
+
+	return count < THREAD_REGISTRY_MAX ? count : THREAD_REGISTRY_MAX;
+}
+
+/**
+ * @brief Block in a slot.
+ *
+ * @param r
+ * @param id slot, below thread_registry_count
+ * @return void* the block, NULL while its thread is still publishing it
+ */
+static inline void *thread_registry_get(struct thread_registry *r, int id)
+{
+	return __atomic_load_n(&r->blocks[id], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Adds to a counter in the block of the calling thread.
+ *
+ * @param counter
+ * @param n
+ */
+static inline void thread_counter_add(uint64_t *counter, uint64_t n)
+{
+	/* Single writer: a relaxed store keeps the reader from tearing it */
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+#endif /* _THREAD_REGISTRY_H_ */
@@ -0,0 +1,55 @@
+#ifndef _TX_RING_H_
+#define _TX_RING_H_
+
+#include <stdbool.h>
+#include "skel.h"
+
+/* Geometry of the PACKET_TX_RING of one interface */
+#define TX_RING_FRAME_SIZE 2048
+#define TX_RING_FRAME_NR 512
+#define TX_RING_BLOCK_SIZE (1 << 16)
+/* Milliseconds a full ring or device queue may hold up the caller */
+#define TX_RING_WAIT_MS 10
+
+/* Memory-mapped TPACKET_V2 transmit ring on its own packet socket */
+struct tx_ring {
+	int sockfd;
+	uint8_t *map;
+	size_t map_len;
+	int cur;	/* next slot to fill */
+	int queued;	/* slots filled since the last kick */
+};
+
+/**
+ * @brief Opens a packet socket on an interface and sets up a transmit
+ * ring on it. The socket bypasses the qdisc layer.
+ *
+ * @param ifindex interface index
+ * @return struct tx_ring*
+ */
+struct tx_ring *tx_ring_create(int ifindex);
+
+/**
+ * @brief Copies a frame into the next free slot. Nothing is sent until
+ * tx_ring_kick, unless the ring is full: then it kicks and waits up to
+ * TX_RING_WAIT_MS for the slot.
+ *
+ * @param r
+ * @param frame
+ * @param len
+ * @return true: the frame is queued
+ * @return false: the slot never freed up, the frame was dropped
+ */
+bool tx_ring_queue(struct tx_ring *r, const char *frame, int len);
+
+/**
+ * @brief Sends every queued slot with a single send(). While the device
+ * queue is full it waits for POLLOUT, up to TX_RING_WAIT_MS.
+ *
+ * @param r
+ * @return true: the kernel took every queued slot
+ * @return false: it gave up, the slots stay queued for the next kick
+ */
+bool tx_ring_kick(struct tx_ring *r);
+
+#endif /* _TX_RING_H_ */
@@ -0,0 +1,62 @@
+#ifndef _XSK_H_
+#define _XSK_H_
+
+#include "skel.h"
+
+/* Frames in the UMEM shared by every interface */
+#define XSK_NUM_FRAMES 4096
+#define XSK_FRAME_SIZE 2048
+/* Descriptors in each fill, completion, RX and TX ring */
+#define XSK_RING_SIZE 1024
+
+/**
+ * @brief Sets up the AF_XDP backend: one UMEM shared by an AF_XDP socket
+ * on queue 0 of every interface, and an XDP program in generic (SKB) mode
+ * redirecting every frame to those sockets. The program is detached at exit.
+ *
+ * @param ifindex interface indexes
+ * @param n number of interfaces
+ */
+void xsk_setup(const int *ifindex, int n);
+
+/**
+ * @brief Socket of an interface, readable when its RX ring has frames.
+ *
+ * @param interface
+ * @return int
+ */
+int xsk_fd(int interface);
+
+/**
+ * @brief Hands out up to max received frames of an interface. The packets
+ * point into the UMEM and stay valid until xsk_release.
+ *
+ * @param interface
+ * @param m array of at least max packet pointers
+ * @param max
+ * @return int number of packets
+ */
+int xsk_receive(int interface, packet **m, int max);
+
+/**
+ * @brief Recycles the frames handed out since the last call that were
+ * not transmitted, and refills the fill rings.
+ */
+void xsk_release(void);
+
+/**
+ * @brief Queues a packet on the TX ring of m->interface. A packet that
+ * lives in the UMEM is sent by passing its frame descriptor on, anything
+ * else is copied into a free frame first.
+ *
+ * @param m
+ */
+void xsk_send(packet *m);
+
+/**
+ * @brief Wakes up the kernel for every TX ring with queued frames and
+ * collects completed frames.
+ */
+void xsk_flush(void);
+
+#endif /* _XSK_H_ */
@@ -0,0 +1,94 @@
+#include "latency.h"
+
+__thread struct latency_thread *latency_self;
+static struct thread_registry threads;
+/* Histograms of the threads the registry had no room for, written racily */
+static struct latency_thread overflow;
+
+static const char *stage_names[LATENCY_STAGES] = {
+	"receive", "parse", "validate", "route", "arp", "transmit",
+};
+
+struct latency_thread *latency_attach(void)
+{
+	struct latency_thread *lt = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct latency_thread));
+	DIE(lt == NULL, "aligned_alloc latency");
+	memset(lt, 0, sizeof(struct latency_thread));
+	if (thread_registry_add(&threads, lt) == -1) {
+		free(lt);
+		lt = &overflow;
+	}
+	latency_self = lt;
+	return lt;
+}
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+double latency_ticks_per_ns(void)
+{
+	static double ratio;
+
+	if (ratio == 0) {
+#if defined(__x86_64__) || defined(__i386__)
+		uint64_t ns = monotonic_ns(), tsc = latency_now();
+		struct timespec pause = { 0, 10000000 };
+		nanosleep(&pause, NULL);
+		ratio = (double)(latency_now() - tsc) / (monotonic_ns() - ns);
+#else
+		ratio = 1;
+#endif
+	}
+	return ratio;
+}
+
+/* Lowest value that falls into a bucket */
+static uint64_t bucket_low(int b)
+{
+	if (b < LATENCY_SUB_BUCKETS)
+		return b;
+	int e = b / LATENCY_SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+	return (uint64_t)(LATENCY_SUB_BUCKETS + b % LATENCY_SUB_BUCKETS) << (e - LATENCY_SUB_BITS);
+}
+
+void latency_dump(FILE *f)
+{
+	static uint64_t sum[LATENCY_BUCKETS];
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	double ratio = latency_ticks_per_ns();
+	int count = thread_registry_count(&threads);
+
+	fprintf(f, "# stage count p50_ns p90_ns p99_ns p999_ns max_ns\n");
+	for (int s = 0; s < LATENCY_STAGES; s++) {
+		uint64_t total = 0;
+		for (int b = 0; b < LATENCY_BUCKETS; b++) {
+			sum[b] = __atomic_load_n(&overflow.counts[s][b], __ATOMIC_RELAXED);
+			for (int t = 0; t < count; t++) {
+				struct latency_thread *lt = thread_registry_get(&threads, t);
+				if (lt != NULL)
+					sum[b] += __atomic_load_n(&lt->counts[s][b], __ATOMIC_RELAXED);
+			}
+			total += sum[b];
+		}
+
+		fprintf(f, "%s %lu", stage_names[s], (unsigned long)total);
+		uint64_t seen = 0;
+		int b = 0, max = 0;
+		for (int q = 0; q < 4; q++) {
+			uint64_t rank = total * quantiles[q];
+			while (b < LATENCY_BUCKETS - 1 && seen + sum[b] <= rank)
+				seen += sum[b++];
+			fprintf(f, " %.0f", total ? bucket_low(b) / ratio : 0);
+		}
+		for (int k = 0; k < LATENCY_BUCKETS; k++) {
+			if (sum[k])
+				max = k;
+		}
+		fprintf(f, " %.0f\n", total ? bucket_low(max + 1) / ratio : 0);
+	}
+}
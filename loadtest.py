@@ -0,0 +1,218 @@
+#!/usr/bin/python3
+"""Load test: the FullTopo topology on network namespaces and veth pairs,
+driven by trafgen. Needs root, but not mininet.
+
+    sudo ./loadtest.py --size 64 --rate 100000 --seconds 10 --dests 1,2,3
+
+Every host sends with `trafgen send` to the routers' MACs and the
+destination hosts count what arrives with `trafgen recv`. The result is
+one JSON line with the offered and delivered pps, the loss and the
+one-way latency percentiles at the receivers.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import time
+
+import info
+
+N_ROUTERS = info.N_ROUTERS
+N_HOSTSEACH = info.N_HOSTSEACH
+N_HOSTS = N_ROUTERS * N_HOSTSEACH
+
+
+def sh(cmd, check=True):
+    return subprocess.run(cmd, shell=True, check=check,
+                          stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                          universal_newlines=True).stdout
+
+
+def ns(name, cmd, check=True):
+    return sh("ip netns exec {} {}".format(name, cmd), check)
+
+
+def router_ns(i):
+    return info.get("router_name", i)
+
+
+def host_ns(h):
+    return info.get("host_name", h)
+
+
+def router_of(h):
+    return h // N_HOSTSEACH
+
+
+def teardown():
+    for i in range(N_ROUTERS):
+        sh("ip netns del {}".format(router_ns(i)), check=False)
+    for h in range(N_HOSTS):
+        sh("ip netns del {}".format(host_ns(h)), check=False)
+
+
+def quiet(name):
+    ns(name, "sysctl -qw net.ipv6.conf.all.disable_ipv6=1")
+    ns(name, "sysctl -qw net.ipv6.conf.default.disable_ipv6=1")
+    ns(name, "ip link set lo up")
+
+
+def offload_off(name, ifname):
+    ns(name, "ethtool -K {} rx off tx off".format(ifname), check=False)
+
+
+def setup():
+    """Same names, addresses and MACs as FullTopo in topo.py"""
+    teardown()
+    for i in range(N_ROUTERS):
+        sh("ip netns add {}".format(router_ns(i)))
+        quiet(router_ns(i))
+        ns(router_ns(i), "sysctl -qw net.ipv4.ip_forward=0")
+        ns(router_ns(i), "sysctl -qw net.ipv4.icmp_echo_ignore_all=1")
+    for h in range(N_HOSTS):
+        sh("ip netns add {}".format(host_ns(h)))
+        quiet(host_ns(h))
+
+    for i in range(N_ROUTERS):
+        for j in range(i + 1, N_ROUTERS):
+            ifn = info.get("r2r_if_name", i, j)
+            sh("ip link add {} netns {} type veth peer name {} netns {}".format(
+                ifn, router_ns(i), ifn, router_ns(j)))
+            for r, ip, mac in ((i, info.get("r2r_ip1", i, j), info.get("r2r_mac", i, j)),
+                               (j, info.get("r2r_ip2", i, j), info.get("r2r_mac", j, i))):
+                ns(router_ns(r), "ip link set {} address {}".format(ifn, mac))
+                ns(router_ns(r), "ip addr add {}/24 dev {}".format(ip, ifn))
+                ns(router_ns(r), "ip link set {} up".format(ifn))
+                offload_off(router_ns(r), ifn)
+
+    for h in range(N_HOSTS):
+        i, j = router_of(h), h % N_HOSTSEACH
+        h_if = info.get("host_if_name", h)
+        r_if = info.get("router_if_name", j)
+        sh("ip link add {} netns {} type veth peer name {} netns {}".format(
+            h_if, host_ns(h), r_if, router_ns(i)))
+        ns(host_ns(h), "ip link set {} address {}".format(h_if, info.get("host_mac", h)))
+        ns(host_ns(h), "ip addr add {}/24 dev {}".format(info.get("host_ip", h), h_if))
+        ns(host_ns(h), "ip link set {} up".format(h_if))
+        offload_off(host_ns(h), h_if)
+        ns(router_ns(i), "ip link set {} address {}".format(r_if, info.get("router_mac", h, i)))
+        ns(router_ns(i), "ip addr add {}/24 dev {}".format(info.get("router_ip", h), r_if))
+        ns(router_ns(i), "ip link set {} up".format(r_if))
+        offload_off(router_ns(i), r_if)
+        ns(host_ns(h), "ip route add default via {}".format(info.get("router_ip", h)))
+
+
+def start_routers(env):
+    ifaces = ""
+    for i in range(N_ROUTERS):
+        for j in range(i + 1, N_ROUTERS):
+            ifaces += "{} ".format(info.get("r2r_if_name", i, j))
+    for j in range(N_HOSTSEACH):
+        ifaces += "{} ".format(info.get("router_if_name", j))
+
+    routers = []
+    for i in range(N_ROUTERS):
+        cmd = "ip netns exec {} env {} ./router {} {}".format(
+            router_ns(i), " ".join(env), info.get("rtable", i), ifaces)
+        out = open(info.get("out_file", i), "w")
+        err = open(info.get("err_file", i), "w")
+        routers.append(subprocess.Popen(cmd, shell=True, stdout=out, stderr=err))
+    time.sleep(1)
+    for i, r in enumerate(routers):
+        if r.poll() is not None:
+            sys.exit("router {} died, see {}".format(i, info.get("err_file", i)))
+    return routers
+
+
+def sender_cmd(h, dests, args, seconds, rate, port=None):
+    return "./trafgen send -i {} -g {} -d {} -s {} -r {} -t {} -f {} -z {} -m {} -n {}{}".format(
+        info.get("host_if_name", h), info.get("router_mac", h, router_of(h)),
+        ",".join(info.get("host_ip", d) for d in dests), args.size, rate, seconds,
+        args.flows, args.zipf, args.mode, h, "" if port is None else " -p {}".format(port))
+
+
+def run(args):
+    senders = [int(h) for h in args.senders.split(",")]
+    dests = [int(h) for h in args.dests.split(",")]
+
+    # Warm-up to a closed port so every next hop is resolved before counting
+    warm = [subprocess.Popen("ip netns exec {} {}".format(
+        host_ns(h), sender_cmd(h, dests, args, 0.5, 1000, port=9001)),
+        shell=True, stdout=subprocess.DEVNULL) for h in senders]
+    for p in warm:
+        p.wait()
+    time.sleep(0.5)
+
+    receivers = [subprocess.Popen("ip netns exec {} ./trafgen recv -t {} -w 1".format(
+        host_ns(d), args.seconds + 5), shell=True, stdout=subprocess.PIPE,
+        universal_newlines=True) for d in dests]
+    time.sleep(0.3)
+    rate = args.rate / len(senders) if args.rate else 0
+    gens = [subprocess.Popen("ip netns exec {} {}".format(
+        host_ns(h), sender_cmd(h, dests, args, args.seconds, rate)),
+        shell=True, stdout=subprocess.PIPE, universal_newlines=True) for h in senders]
+
+    sent = [json.loads(p.communicate()[0]) for p in gens]
+    recv = [json.loads(p.communicate()[0]) for p in receivers]
+
+    offered = sum(s["packets"] for s in sent)
+    delivered = sum(r["packets"] for r in recv)
+    result = {
+        "size": args.size,
+        "flows": args.flows,
+        "zipf": args.zipf,
+        "mode": args.mode,
+        "sent": offered,
+        "received": delivered,
+        "loss": 1 - delivered / offered if offered else 0,
+        "offered_pps": round(sum(s["pps"] for s in sent)),
+        "delivered_pps": round(sum(r["pps"] for r in recv)),
+        "reordered": sum(r["reordered"] for r in recv),
+        # Worst receiver, the hosts are timed apart
+        "lat_p50_ns": max(r["lat_p50_ns"] for r in recv),
+        "lat_p99_ns": max(r["lat_p99_ns"] for r in recv),
+        "lat_p999_ns": max(r["lat_p999_ns"] for r in recv),
+        "per_dest": {info.get("host_ip", d): r for d, r in zip(dests, recv)},
+    }
+    print(json.dumps(result))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--size", type=int, default=64, help="frame size in bytes")
+    parser.add_argument("--rate", type=float, default=0,
+                        help="total offered pps, 0 sends as fast as possible")
+    parser.add_argument("--seconds", type=float, default=10)
+    parser.add_argument("--flows", type=int, default=64,
+                        help="flows per sender, spread over the destinations")
+    parser.add_argument("--zipf", type=float, default=0,
+                        help="Zipf exponent of the flow distribution, 0 is uniform")
+    parser.add_argument("--mode", choices=("mmsg", "ring"), default="mmsg",
+                        help="trafgen sends with sendmmsg or PACKET_TX_RING")
+    parser.add_argument("--senders", default="0", help="sending hosts, e.g. 0,1")
+    parser.add_argument("--dests", default="1,2,3", help="receiving hosts")
+    parser.add_argument("--router-env", action="append", default=[],
+                        help="KEY=VALUE for the routers, e.g. ROUTER_RX=ring")
+    parser.add_argument("--keep", action="store_true",
+                        help="leave the namespaces up afterwards")
+    args = parser.parse_args()
+
+    os.chdir(os.path.dirname(os.path.abspath(__file__)))
+    sh("make router trafgen")
+    setup()
+    routers = start_routers(args.router_env)
+    try:
+        run(args)
+    finally:
+        for r in routers:
+            r.kill()
+        sh("pkill -f '^./router '", check=False)
+        if not args.keep:
+            teardown()
+
+
+if __name__ == "__main__":
+    main()
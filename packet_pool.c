@@ -0,0 +1,113 @@
+#include "packet_pool.h"
+#include <sys/mman.h>
+
+/* Per-thread cache in front of the shared stack of one pool */
+static __thread struct {
+	struct packet_pool *pool;
+	int count;
+	packet *bufs[PACKET_POOL_CACHE];
+} cache;
+
+static packet *pool_map(struct packet_pool *pp, size_t len, int hugepages)
+{
+	if (hugepages) {
+		/* Whole 2 MB pages */
+		size_t huge_len = (len + (1 << 21) - 1) & ~(size_t)((1 << 21) - 1);
+		void *p = mmap(NULL, huge_len, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+		if (p != MAP_FAILED) {
+			pp->map_len = huge_len;
+			return p;
+		}
+		fprintf(stderr, "No hugepages for the packet pool, using normal pages\n");
+	}
+	packet *bufs = aligned_alloc(CACHE_LINE_SIZE, len);
+	DIE(bufs == NULL, "aligned_alloc packet pool");
+	pp->map_len = 0;
+	return bufs;
+}
+
+struct packet_pool *packet_pool_create(uint32_t size, int hugepages)
+{
+	struct packet_pool *pp = malloc(sizeof(struct packet_pool));
+	DIE(pp == NULL, "malloc packet pool");
+
+	/* sizeof(packet) is a multiple of the cache line, so is the array */
+	pp->bufs = pool_map(pp, sizeof(packet) * size, hugepages);
+	pp->free = malloc(sizeof(packet *) * size);
+	DIE(pp->free == NULL, "malloc packet pool stack");
+	pp->size = size;
+	for (uint32_t i = 0; i < size; i++) {
+		packet *m = &pp->bufs[i];
+		m->pool = pp;
+		m->refcnt = 0;
+		/* Touch every buffer now rather than on the fast path */
+		memset(m->buf, 0, MAX_LEN);
+		pp->free[size - 1 - i] = m;
+	}
+	pp->free_count = size;
+	pthread_mutex_init(&pp->lock, NULL);
+	return pp;
+}
+
+/* Moves up to n packets between the calling thread's cache and the stack */
+static void cache_refill(struct packet_pool *pp, int n)
+{
+	pthread_mutex_lock(&pp->lock);
+	if ((uint32_t)n > pp->free_count)
+		n = pp->free_count;
+	pp->free_count -= n;
+	memcpy(cache.bufs + cache.count, pp->free + pp->free_count, sizeof(packet *) * n);
+	cache.count += n;
+	pthread_mutex_unlock(&pp->lock);
+}
+
+static void cache_spill(struct packet_pool *pp, int n)
+{
+	pthread_mutex_lock(&pp->lock);
+	cache.count -= n;
+	memcpy(pp->free + pp->free_count, cache.bufs + cache.count, sizeof(packet *) * n);
+	pp->free_count += n;
+	pthread_mutex_unlock(&pp->lock);
+}
+
+packet *packet_alloc(struct packet_pool *pp)
+{
+	packet *m;
+
+	if (cache.pool != pp) {
+		/* The cache serves one pool, give the old one its packets back */
+		if (cache.pool != NULL && cache.count)
+			cache_spill(cache.pool, cache.count);
+		cache.pool = pp;
+	}
+	if (cache.count == 0)
+		cache_refill(pp, PACKET_POOL_CACHE / 2);
+	if (cache.count == 0)
+		return NULL;
+	m = cache.bufs[--cache.count];
+	m->refcnt = 1;
+	m->payload = m->buf;
+	return m;
+}
+
+void packet_put(packet *m)
+{
+	struct packet_pool *pp = m->pool;
+
+	if (pp == NULL)
+		return;
+	if (__atomic_sub_fetch(&m->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	if (cache.pool == NULL)
+		cache.pool = pp;	/* a thread that only frees, e.g. a TX thread */
+	if (cache.pool != pp) {
+		pthread_mutex_lock(&pp->lock);
+		pp->free[pp->free_count++] = m;
+		pthread_mutex_unlock(&pp->lock);
+		return;
+	}
+	if (cache.count == PACKET_POOL_CACHE)
+		cache_spill(pp, PACKET_POOL_CACHE / 2);
+	cache.bufs[cache.count++] = m;
+}
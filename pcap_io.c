@@ -0,0 +1,278 @@
+#include "io_backend.h"
+#include "latency.h"
+#include <time.h>
+
+/*
+ * Offline I/O: the capture of every interface is loaded up front and
+ * replayed as fast as the router takes it, in timestamp order across
+ * interfaces. Whatever the router sends is written to a capture per
+ * interface. When the input runs out the router prints its rate and
+ * exits.
+ *
+ * ROUTER_PCAP_CONFIG names the interface file, one interface per line:
+ *
+ *	# name  ip           mac                input    output
+ *	r-0     192.168.0.1  de:fe:c8:ed:00:00  in0.pcap out0.pcap
+ *
+ * "-" stands for no input or a discarded output. ROUTER_PCAP_LOOPS
+ * replays the input that many times.
+ */
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+#define PCAP_OUT_BUFFER (1 << 20)
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_record_header {
+	uint32_t ts_sec;
+	uint32_t ts_frac;	/* usec, or nsec with PCAP_MAGIC_NSEC */
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+/* One input frame, in replay order */
+struct pcap_frame {
+	const char *data;
+	uint32_t len;
+	int interface;
+	uint64_t ts;	/* nsec, only used to merge the inputs */
+};
+
+static int pcap_interfaces;
+static struct pcap_frame *frames;
+static uint32_t frame_count;
+static uint32_t replay_next;
+static long loops_left;
+static FILE *outputs[ROUTER_NUM_INTERFACES];
+static struct timespec started, now;
+static uint64_t packets_in, packets_out;
+
+static inline uint32_t swap32(uint32_t x, int swapped)
+{
+	return swapped ? __builtin_bswap32(x) : x;
+}
+
+/* Appends the frames of a capture to frames[], returns how many */
+static uint32_t load_capture(const char *path, int interface, uint32_t *cap)
+{
+	FILE *f = fopen(path, "rb");
+	DIE(f == NULL, path);
+	DIE(fseek(f, 0, SEEK_END) == -1, "fseek");
+	long size = ftell(f);
+	rewind(f);
+	char *data = malloc(size > 0 ? size : 1);
+	DIE(data == NULL, "malloc capture");
+	DIE(fread(data, 1, size, f) != (size_t)size, "fread capture");
+	fclose(f);
+
+	struct pcap_file_header *fh = (struct pcap_file_header *)data;
+	DIE(size < (long)sizeof(*fh), "capture too short");
+	int swapped = fh->magic == __builtin_bswap32(PCAP_MAGIC) ||
+		      fh->magic == __builtin_bswap32(PCAP_MAGIC_NSEC);
+	uint32_t magic = swap32(fh->magic, swapped);
+	DIE(magic != PCAP_MAGIC && magic != PCAP_MAGIC_NSEC, "not a pcap file");
+	DIE(swap32(fh->linktype, swapped) != PCAP_LINKTYPE_ETHERNET, "capture is not Ethernet");
+	uint64_t frac_ns = magic == PCAP_MAGIC_NSEC ? 1 : 1000;
+
+	uint32_t n = 0, skipped = 0;
+	long off = sizeof(*fh);
+	while (off + (long)sizeof(struct pcap_record_header) <= size) {
+		struct pcap_record_header *rh = (struct pcap_record_header *)(data + off);
+		uint32_t len = swap32(rh->incl_len, swapped);
+		off += sizeof(*rh);
+		if (off + len > size)
+			break;	/* truncated capture */
+		if (len > MAX_LEN) {
+			skipped++;
+		} else {
+			if (frame_count == *cap) {
+				*cap = *cap ? *cap * 2 : 4096;
+				frames = realloc(frames, sizeof(struct pcap_frame) * *cap);
+				DIE(frames == NULL, "realloc frames");
+			}
+			struct pcap_frame *fr = &frames[frame_count++];
+			fr->data = data + off;
+			fr->len = len;
+			fr->interface = interface;
+			fr->ts = swap32(rh->ts_sec, swapped) * 1000000000ull +
+				 swap32(rh->ts_frac, swapped) * frac_ns;
+			n++;
+		}
+		off += len;
+	}
+	if (skipped)
+		fprintf(stderr, "pcap: %s: skipped %u frames over %d bytes\n", path, skipped, MAX_LEN);
+	return n;
+}
+
+static FILE *open_capture(const char *path)
+{
+	FILE *f = fopen(path, "wb");
+	DIE(f == NULL, path);
+	DIE(setvbuf(f, NULL, _IOFBF, PCAP_OUT_BUFFER) != 0, "setvbuf");
+
+	struct pcap_file_header fh = {
+		.magic = PCAP_MAGIC_NSEC,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = MAX_LEN,
+		.linktype = PCAP_LINKTYPE_ETHERNET,
+	};
+	DIE(fwrite(&fh, sizeof(fh), 1, f) != 1, "fwrite pcap header");
+	return f;
+}
+
+/* Merges the per interface runs of frames[] by timestamp, keeping ties in order */
+static void merge_inputs(uint32_t *starts, uint32_t *counts, int n)
+{
+	struct pcap_frame *merged = malloc(sizeof(struct pcap_frame) * (frame_count ? frame_count : 1));
+	uint32_t pos[ROUTER_NUM_INTERFACES] = { 0 };
+	DIE(merged == NULL, "malloc frames");
+
+	for (uint32_t k = 0; k < frame_count; k++) {
+		int best = -1;
+		for (int i = 0; i < n; i++) {
+			if (pos[i] < counts[i] && (best == -1 ||
+			    frames[starts[i] + pos[i]].ts < frames[starts[best] + pos[best]].ts))
+				best = i;
+		}
+		merged[k] = frames[starts[best] + pos[best]++];
+	}
+	free(frames);
+	frames = merged;
+}
+
+static void pcap_setup(int count)
+{
+	DIE(num_workers > 1, "ROUTER_IO=pcap runs a single worker");
+	char *config = getenv("ROUTER_PCAP_CONFIG");
+	FILE *f = fopen(config != NULL ? config : "pcap.conf", "r");
+	DIE(f == NULL, "ROUTER_PCAP_CONFIG");
+
+	char inputs[ROUTER_NUM_INTERFACES][256] = { { 0 } };
+	char line[1024];
+	int found[ROUTER_NUM_INTERFACES] = { 0 };
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char name[IFNAMSIZ + 1], ip[64], mac[64], in[256], out[256];
+		if (line[0] == '#' || sscanf(line, "%16s %63s %63s %255s %255s",
+					     name, ip, mac, in, out) != 5)
+			continue;
+		for (int i = 0; i < count; i++) {
+			struct interface_info *info = &interface_table[i];
+			if (strcmp(info->name, name) != 0)
+				continue;
+			DIE(inet_pton(AF_INET, ip, &info->ip) != 1, "bad IP in pcap config");
+			DIE(hwaddr_aton(mac, info->mac) != 0, "bad MAC in pcap config");
+			info->ifindex = i + 1;
+			info->mtu = 1500;
+			if (strcmp(in, "-") != 0)
+				strcpy(inputs[i], in);
+			if (strcmp(out, "-") != 0)
+				outputs[i] = open_capture(out);
+			found[i] = 1;
+		}
+	}
+	fclose(f);
+
+	uint32_t cap = 0, starts[ROUTER_NUM_INTERFACES], counts[ROUTER_NUM_INTERFACES];
+	for (int i = 0; i < count; i++) {
+		DIE(!found[i], "interface missing from the pcap config");
+		starts[i] = frame_count;
+		counts[i] = inputs[i][0] ? load_capture(inputs[i], i, &cap) : 0;
+	}
+	merge_inputs(starts, counts, count);
+	pcap_interfaces = count;
+
+	char *loops = getenv("ROUTER_PCAP_LOOPS");
+	loops_left = loops != NULL && atol(loops) > 1 ? atol(loops) : 1;
+}
+
+static void pcap_thread_init(void)
+{
+	DIE(1, "ROUTER_IO=pcap runs a single worker");
+}
+
+/* The input is used up: write out the captures and report the rate */
+static void pcap_finish(void)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - started.tv_sec) + (end.tv_nsec - started.tv_nsec) / 1e9;
+
+	for (int i = 0; i < pcap_interfaces; i++) {
+		if (outputs[i] != NULL)
+			DIE(fclose(outputs[i]) != 0, "fclose capture");
+	}
+	fprintf(stderr, "pcap: %lu packets in %lu out %.6f s %.0f pps\n",
+		(unsigned long)packets_in, (unsigned long)packets_out, elapsed,
+		elapsed > 0 ? packets_in / elapsed : 0);
+	LATENCY_DUMP(stderr);
+	exit(0);
+}
+
+static int pcap_receive(packet **m, int max)
+{
+	LATENCY_DECLARE(start);
+
+	LATENCY_STAMP(start);
+	if (packets_in == 0)
+		clock_gettime(CLOCK_MONOTONIC, &started);
+	if (replay_next == frame_count) {
+		if (--loops_left <= 0 || frame_count == 0)
+			pcap_finish();
+		replay_next = 0;
+	}
+
+	int n = frame_count - replay_next < (uint32_t)max ? frame_count - replay_next : max;
+	for (int i = 0; i < n; i++) {
+		struct pcap_frame *fr = &frames[replay_next++];
+		m[i]->payload = m[i]->buf;
+		memcpy(m[i]->payload, fr->data, fr->len);
+		m[i]->len = fr->len;
+		m[i]->interface = fr->interface;
+	}
+	packets_in += n;
+	/* Every frame of the burst is stamped with the time it was received */
+	clock_gettime(CLOCK_REALTIME, &now);
+	LATENCY_RECORD(LATENCY_RECEIVE, start);
+	return n;
+}
+
+static void pcap_send(packet *m)
+{
+	packets_out++;
+	if (outputs[m->interface] == NULL)
+		return;
+
+	struct pcap_record_header rh = {
+		.ts_sec = now.tv_sec,
+		.ts_frac = now.tv_nsec,
+		.incl_len = m->len,
+		.orig_len = m->len,
+	};
+	DIE(fwrite(&rh, sizeof(rh), 1, outputs[m->interface]) != 1, "fwrite capture");
+	DIE(fwrite(m->payload, 1, m->len, outputs[m->interface]) != (size_t)m->len, "fwrite capture");
+}
+
+static void pcap_flush(void)
+{
+	/* Frames reach the files through stdio, pcap_finish flushes them */
+}
+
+const struct io_backend pcap_backend = {
+	.setup = pcap_setup,
+	.thread_init = pcap_thread_init,
+	.receive = pcap_receive,
+	.send = pcap_send,
+	.flush = pcap_flush,
+};
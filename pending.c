@@ -0,0 +1,264 @@
+#include "pending.h"
+#include "stats.h"
+#include <time.h>
+
+static inline uint32_t pending_slot(struct pending_table *pt, uint32_t next_hop)
+{
+	return (next_hop * 2654435761u >> 7) & pt->index_mask;
+}
+
+static uint64_t pending_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct pending_table *pending_create(uint32_t capacity, int max_depth, int max_held,
+				     struct packet_pool *pool)
+{
+	struct pending_table *pt = malloc(sizeof(struct pending_table));
+	DIE(pt == NULL, "malloc pending table");
+
+	if (capacity > PENDING_MAX_QUEUES)
+		capacity = PENDING_MAX_QUEUES;
+	uint32_t n = 2;
+	while (n < 2 * capacity)
+		n <<= 1;
+	pt->index = malloc(n * sizeof(int));
+	pt->queues = calloc(capacity, sizeof(struct pending_queue));
+	pt->free = malloc(capacity * sizeof(int));
+	DIE(pt->index == NULL || pt->queues == NULL || pt->free == NULL, "malloc pending table");
+	for (uint32_t i = 0; i < n; i++)
+		pt->index[i] = -1;
+	for (uint32_t i = 0; i < capacity; i++) {
+		pthread_mutex_init(&pt->queues[i].lock, NULL);
+		pt->free[i] = capacity - 1 - i;
+	}
+	pthread_mutex_init(&pt->lock, NULL);
+	pt->index_mask = n - 1;
+	pt->free_count = capacity;
+	pt->capacity = capacity;
+	pt->max_depth = max_depth;
+	pt->max_held = max_held;
+	pt->held = 0;
+	pt->arp_retry = PENDING_ARP_RETRY_MS * 1000000ull;
+	pt->max_age = PENDING_MAX_AGE_MS * 1000000ull;
+	pt->pool = pool;
+	return pt;
+}
+
+/* Index slot of a next hop, or the unused slot it would take; table locked */
+static uint32_t index_slot(struct pending_table *pt, uint32_t next_hop)
+{
+	uint32_t i = pending_slot(pt, next_hop);
+
+	while (pt->index[i] != -1 && pt->queues[pt->index[i]].next_hop != next_hop)
+		i = (i + 1) & pt->index_mask;
+	return i;
+}
+
+/*
+ * Empties an index slot and moves back the entries after it that would no
+ * longer be found, so lookups never need tombstones; table locked.
+ */
+static void index_remove(struct pending_table *pt, uint32_t i)
+{
+	uint32_t j = i;
+
+	while (1) {
+		j = (j + 1) & pt->index_mask;
+		if (pt->index[j] == -1)
+			break;
+		uint32_t home = pending_slot(pt, pt->queues[pt->index[j]].next_hop);
+		/* The entry stays if its home lies cyclically in (i, j] */
+		if (((j - home) & pt->index_mask) >= ((j - i) & pt->index_mask)) {
+			pt->index[i] = pt->index[j];
+			i = j;
+		}
+	}
+	pt->index[i] = -1;
+}
+
+/* Drops the packets that waited too long, with the queue locked */
+static void pending_expire(struct pending_table *pt, struct pending_queue *pq, uint64_t now)
+{
+	while (pq->depth > 0 && now > pq->entries[pq->head].queued_at + pt->max_age) {
+		struct pending_entry *e = &pq->entries[pq->head];
+		/* Not stats_drop, the flight record is of another packet */
+		stats_add(STATS(e->in_interface, drops[STATS_DROP_ARP_PENDING]), 1);
+		packet_put(e->m);
+		__atomic_sub_fetch(&pt->held, 1, __ATOMIC_RELAXED);
+		pq->head = pq->head + 1 == pt->max_depth ? 0 : pq->head + 1;
+		pq->depth--;
+	}
+}
+
+/* An empty queue whose request was answered or is stale, queue locked */
+static bool pending_idle(struct pending_table *pt, struct pending_queue *pq, uint64_t now)
+{
+	return pq->depth == 0 && (!pq->requested || now >= pq->requested_at + pt->arp_retry);
+}
+
+/* Gives a queue back to the free list, table and queue locked */
+static void pending_free(struct pending_table *pt, struct pending_queue *pq)
+{
+	index_remove(pt, index_slot(pt, pq->next_hop));
+	pq->next_hop = 0;
+	free(pq->entries);
+	pq->entries = NULL;
+	pt->free[pt->free_count++] = pq - pt->queues;
+}
+
+/* Expires every queue and frees the idle ones, table locked */
+static void pending_sweep(struct pending_table *pt, uint64_t now)
+{
+	for (uint32_t q = 0; q < pt->capacity; q++) {
+		struct pending_queue *pq = &pt->queues[q];
+		if (pq->next_hop == 0)
+			continue;
+		pthread_mutex_lock(&pq->lock);
+		pending_expire(pt, pq, now);
+		if (pending_idle(pt, pq, now))
+			pending_free(pt, pq);
+		pthread_mutex_unlock(&pq->lock);
+	}
+}
+
+/*
+ * The queue of a next hop, locked. With add, a next hop without one gets
+ * a free queue, after a sweep if none is left. NULL if there is none.
+ */
+static struct pending_queue *pending_acquire(struct pending_table *pt, uint32_t next_hop, bool add,
+					     uint64_t now)
+{
+	struct pending_queue *pq = NULL;
+
+	pthread_mutex_lock(&pt->lock);
+	uint32_t i = index_slot(pt, next_hop);
+	if (pt->index[i] != -1) {
+		pq = &pt->queues[pt->index[i]];
+	} else if (add) {
+		if (pt->free_count == 0) {
+			pending_sweep(pt, now);
+			i = index_slot(pt, next_hop);
+		}
+		if (pt->free_count > 0) {
+			int q = pt->free[--pt->free_count];
+			pq = &pt->queues[q];
+			pq->entries = calloc(pt->max_depth, sizeof(struct pending_entry));
+			DIE(pq->entries == NULL, "calloc pending queue");
+			pq->head = 0;
+			pq->depth = 0;
+			pq->requested = false;
+			pq->next_hop = next_hop;
+			pt->index[i] = q;
+		}
+	}
+	if (pq != NULL)
+		pthread_mutex_lock(&pq->lock);
+	pthread_mutex_unlock(&pt->lock);
+	return pq;
+}
+
+bool pending_enqueue(struct pending_table *pt, uint32_t next_hop, packet *m, int in_interface)
+{
+	uint64_t now = pending_now();
+
+	struct pending_queue *pq = pending_acquire(pt, next_hop, true, now);
+	if (pq == NULL)
+		return false;
+	pending_expire(pt, pq, now);
+	if (pq->depth == pt->max_depth) {
+		pthread_mutex_unlock(&pq->lock);
+		return false;
+	}
+	/* Many unresolved next hops must not take the whole pool */
+	if (__atomic_fetch_add(&pt->held, 1, __ATOMIC_RELAXED) >= pt->max_held) {
+		__atomic_sub_fetch(&pt->held, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&pq->lock);
+		return false;
+	}
+	packet *held;
+	if (m->pool != NULL && m->payload == m->buf) {
+		/* Keep the buffer itself */
+		packet_get(m);
+		held = m;
+	} else {
+		/* The frame lives in an RX ring or on the stack */
+		held = packet_alloc(pt->pool);
+		if (held == NULL) {
+			__atomic_sub_fetch(&pt->held, 1, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&pq->lock);
+			return false;
+		}
+		packet_copy(held, m);
+	}
+	int tail = pq->head + pq->depth;
+	if (tail >= pt->max_depth)
+		tail -= pt->max_depth;
+	pq->entries[tail].m = held;
+	pq->entries[tail].queued_at = now;
+	pq->entries[tail].in_interface = in_interface;
+	pq->depth++;
+	pthread_mutex_unlock(&pq->lock);
+	return true;
+}
+
+bool pending_arp_due(struct pending_table *pt, uint32_t next_hop)
+{
+	uint64_t now = pending_now();
+	bool due = false;
+
+	struct pending_queue *pq = pending_acquire(pt, next_hop, true, now);
+	if (pq == NULL)
+		return true;	/* Nowhere to remember the request, ask anyway */
+	if (!pq->requested || now >= pq->requested_at + pt->arp_retry) {
+		pq->requested = true;
+		pq->requested_at = now;
+		due = true;
+	}
+	pthread_mutex_unlock(&pq->lock);
+	return due;
+}
+
+void pending_expire_all(struct pending_table *pt)
+{
+	pthread_mutex_lock(&pt->lock);
+	pending_sweep(pt, pending_now());
+	pthread_mutex_unlock(&pt->lock);
+}
+
+packet *pending_dequeue(struct pending_table *pt, uint32_t next_hop)
+{
+	uint64_t now = pending_now();
+	packet *m = NULL;
+
+	struct pending_queue *pq = pending_acquire(pt, next_hop, false, now);
+	if (pq == NULL)
+		return NULL;
+	pending_expire(pt, pq, now);
+	if (pq->depth == 0) {
+		pq->requested = false;
+	} else {
+		m = pq->entries[pq->head].m;
+		pq->head = pq->head + 1 == pt->max_depth ? 0 : pq->head + 1;
+		pq->depth--;
+		__atomic_sub_fetch(&pt->held, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&pq->lock);
+	if (m == NULL) {
+		/* Drained, free the queue unless a packet came in meanwhile */
+		pthread_mutex_lock(&pt->lock);
+		uint32_t i = index_slot(pt, next_hop);
+		if (pt->index[i] != -1) {
+			pq = &pt->queues[pt->index[i]];
+			pthread_mutex_lock(&pq->lock);
+			if (pending_idle(pt, pq, now))
+				pending_free(pt, pq);
+			pthread_mutex_unlock(&pq->lock);
+		}
+		pthread_mutex_unlock(&pt->lock);
+	}
+	return m;
+}
@@ -0,0 +1,153 @@
+#include "skel.h"
+#include "pending.h"
+#include "rng.h"
+#include <time.h>
+
+/*
+ * Test of pending.c, built and run by `make check`: a full queue keeps
+ * asking for its next hop, packets that waited too long are dropped,
+ * next hops still get asked for when every queue is taken, and drained
+ * or expired queues are freed for other next hops. Retry and age are cut
+ * to milliseconds so the test does not wait for seconds.
+ */
+
+#define RETRY_MS 20
+#define MAX_AGE_MS 100
+#define DEPTH 4
+
+static int cases;
+
+static void expect(int ok, const char *what)
+{
+	if (!ok) {
+		printf("FAIL %s\n", what);
+		exit(1);
+	}
+	cases++;
+}
+
+/*
+ * Random next hops asking and being answered against a model of which
+ * ones hold a queue: checks that freeing queues keeps the index intact.
+ */
+static void test_churn(struct packet_pool *pool)
+{
+	enum { QUEUES = 64, HOPS = 200 };
+	struct pending_table *pt = pending_create(QUEUES, 1, QUEUES, pool);
+	bool held[HOPS] = { false };
+	int live = 0;
+
+	pt->arp_retry = ~0ull / 2;	/* requests never go stale, only replies free */
+	for (int round = 0; round < 100000; round++) {
+		int h = rng() % HOPS;
+		uint32_t hop = htonl(0x0a000001 + h * 7);
+		if (rng() % 3 != 0) {
+			bool want = !held[h];
+			expect(pending_arp_due(pt, hop) == want, "churn: asks only without a request");
+			if (!held[h] && live < QUEUES) {
+				held[h] = true;
+				live++;
+			}
+		} else {
+			expect(pending_dequeue(pt, hop) == NULL, "churn: reply");
+			if (held[h]) {
+				held[h] = false;
+				live--;
+			}
+		}
+		expect(pt->free_count == QUEUES - live, "churn: free queues");
+	}
+}
+
+static void sleep_ms(int ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+	nanosleep(&ts, NULL);
+}
+
+int main(void)
+{
+	struct packet_pool *pool = packet_pool_create(64, 0);
+	struct pending_table *pt = pending_create(2, DEPTH, DEPTH + 1, pool);
+	pt->arp_retry = RETRY_MS * 1000000ull;
+	pt->max_age = MAX_AGE_MS * 1000000ull;
+
+	packet *held[DEPTH + 1];
+	for (int i = 0; i <= DEPTH; i++) {
+		held[i] = packet_alloc(pool);
+		held[i]->len = 60;
+	}
+
+	uint32_t hop = inet_addr("192.168.1.5");
+	expect(pending_arp_due(pt, hop), "first miss asks");
+
+	for (int i = 0; i < DEPTH; i++) {
+		expect(pending_enqueue(pt, hop, held[i], 0), "queued below the depth");
+		expect(!pending_arp_due(pt, hop), "no second request within the retry");
+	}
+	expect(!pending_enqueue(pt, hop, held[DEPTH], 0), "dropped at the depth");
+	expect(held[DEPTH]->refcnt == 1, "dropped packet not held");
+
+	/* The queue stays full until a reply, the request must still go out */
+	sleep_ms(RETRY_MS + 10);
+	expect(!pending_enqueue(pt, hop, held[DEPTH], 0), "still full");
+	expect(pending_arp_due(pt, hop), "full queue asks again after the retry");
+	expect(!pending_arp_due(pt, hop), "and only once per retry");
+
+	/* Everything queued is stale now and gives way to the new packet */
+	sleep_ms(MAX_AGE_MS + 10);
+	expect(pending_enqueue(pt, hop, held[DEPTH], 0), "queued after the old ones expired");
+	for (int i = 0; i < DEPTH; i++)
+		expect(held[i]->refcnt == 1, "expired packet released");
+	expect(pending_dequeue(pt, hop) == held[DEPTH], "only the new packet is left");
+	packet_put(held[DEPTH]);
+	expect(pending_dequeue(pt, hop) == NULL, "empty after the reply");
+	expect(pending_arp_due(pt, hop), "an emptied queue asks at once");
+
+	/* Packets that expire while nobody sends to the next hop */
+	expect(pending_enqueue(pt, hop, held[0], 0), "queued again");
+	sleep_ms(MAX_AGE_MS + 10);
+	expect(pending_dequeue(pt, hop) == NULL, "stale packet not sent on the reply");
+	expect(held[0]->refcnt == 1, "stale packet released");
+
+	/* Two queues for three next hops */
+	uint32_t second = inet_addr("192.168.1.6"), third = inet_addr("192.168.1.7");
+	expect(pending_enqueue(pt, hop, held[0], 0), "first next hop");
+	expect(pending_enqueue(pt, second, held[1], 0), "second next hop");
+	expect(pending_arp_due(pt, hop) && pending_arp_due(pt, second), "both ask");
+	expect(!pending_enqueue(pt, third, held[2], 0), "every queue taken");
+	expect(held[2]->refcnt == 1, "packet without a queue not held");
+	expect(pending_arp_due(pt, third) && pending_arp_due(pt, third), "asked for without a queue");
+
+	/* A reply drains a queue and frees it */
+	expect(pending_dequeue(pt, hop) == held[0], "reply to the first");
+	packet_put(held[0]);
+	expect(pending_dequeue(pt, hop) == NULL, "first drained");
+	expect(pending_enqueue(pt, third, held[2], 0), "drained queue taken by the third");
+	expect(pending_arp_due(pt, third), "third asks with a queue");
+	expect(!pending_arp_due(pt, third), "and only once");
+
+	/* Expired queues whose request is stale are taken back */
+	sleep_ms(MAX_AGE_MS + 10);
+	expect(pending_enqueue(pt, hop, held[0], 0), "expired queue taken back");
+	expect(held[1]->refcnt == 1 && held[2]->refcnt == 1, "their packets released");
+	pending_expire_all(pt);
+	expect(pt->free_count == 1, "the other expired queue freed as well");
+	expect(pending_dequeue(pt, hop) == held[0], "first queued again");
+	packet_put(held[0]);
+	expect(pending_dequeue(pt, hop) == NULL && pt->free_count == 2, "all queues free");
+
+	/* The table holds no more packets than it was given, whatever the queues */
+	struct pending_table *small = pending_create(2, DEPTH, 1, pool);
+	expect(pending_enqueue(small, hop, held[0], 0), "first packet of a small table");
+	expect(!pending_enqueue(small, second, held[1], 0), "small table full");
+	expect(pending_arp_due(small, second), "asked for anyway");
+	expect(pending_dequeue(small, hop) == held[0], "first packet back");
+	packet_put(held[0]);
+	expect(pending_enqueue(small, second, held[1], 0), "room again");
+
+	test_churn(pool);
+
+	printf("pending: %d cases ok\n", cases);
+	return 0;
+}
@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+#include "pipeline.h"
+#include "spsc_ring.h"
+#include "stats.h"
+#include "latency.h"
+#include <pthread.h>
+#include <sched.h>
+
+/* A thread of the pipeline */
+struct stage {
+	int id;	/* interface of an RX or TX thread, number of a worker */
+	/* Worker output waiting to be handed to the TX threads */
+	packet *out[ROUTER_NUM_INTERFACES][BURST_SIZE];
+	int out_count[ROUTER_NUM_INTERFACES];
+};
+
+static int nr_interfaces;
+static int nr_workers;
+static struct packet_pool *packet_pool;
+static const struct pipeline_ops *pipeline_ops;
+/* rx_rings[i * nr_workers + w]: RX thread of interface i to worker w */
+static struct spsc_ring **rx_rings;
+/* tx_rings[w * nr_interfaces + j]: worker w to TX thread of interface j */
+static struct spsc_ring **tx_rings;
+/* Stage of the calling worker, for the output callbacks */
+static __thread struct stage *self;
+
+static struct stage *stage_create(int id)
+{
+	struct stage *st = aligned_alloc(CACHE_LINE_SIZE,
+		(sizeof(struct stage) + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1));
+	DIE(st == NULL, "aligned_alloc stage");
+	memset(st, 0, sizeof(struct stage));
+	st->id = id;
+	return st;
+}
+
+/* Busy-polls for a while, then lets other threads on the CPU run */
+static void stage_idle(int *idle)
+{
+	if (++*idle >= PIPELINE_SPIN)
+		sched_yield();
+}
+
+/* Keeps the packets of one flow on one worker, so they stay in order */
+static inline uint32_t flow_hash(packet *m)
+{
+	struct ether_header *eth = (struct ether_header *)m->payload;
+
+	if (ntohs(eth->ether_type) != ETHERTYPE_IP)
+		return 0;
+	struct iphdr *ip = (struct iphdr *)(m->payload + sizeof(struct ether_header));
+	return (ip->saddr ^ ip->daddr) * 2654435761u >> 16;
+}
+
+static void *rx_main(void *arg)
+{
+	struct stage *st = arg;
+	packet *m[RX_BUDGET];
+	int ready = 0;	/* m[0..ready) are allocated */
+	packet **batch = malloc(sizeof(packet *) * RX_BUDGET * nr_workers);
+	int *count = malloc(sizeof(int) * nr_workers);
+	int idle = 0;
+	char name[16];
+	DIE(batch == NULL || count == NULL, "malloc rx batch");
+	snprintf(name, sizeof(name), "rx-%d", st->id);
+	stats_register(name);
+
+	while (1) {
+		while (ready < RX_BUDGET && (m[ready] = packet_alloc(packet_pool)) != NULL)
+			ready++;
+		if (ready == 0) {
+			/* Every packet is in flight, wait for the next stages */
+			stage_idle(&idle);
+			continue;
+		}
+		idle = 0;
+
+		int n = receive_packets(st->id, m, ready);
+		memset(count, 0, sizeof(int) * nr_workers);
+		for (int k = 0; k < n; k++) {
+			int w = flow_hash(m[k]) % nr_workers;
+			batch[w * RX_BUDGET + count[w]++] = m[k];
+		}
+		for (int w = 0; w < nr_workers; w++) {
+			struct spsc_ring *r = rx_rings[st->id * nr_workers + w];
+			int sent = spsc_ring_enqueue_burst(r, (void **)&batch[w * RX_BUDGET], count[w]);
+			/* The worker is behind, drop the rest */
+			for (int k = sent; k < count[w]; k++) {
+				stats_drop(st->id, STATS_DROP_QUEUE_FULL);
+				packet_put(batch[w * RX_BUDGET + k]);
+			}
+		}
+		/* Keep the packets that were not filled for the next round */
+		memmove(m, m + n, sizeof(packet *) * (ready - n));
+		ready -= n;
+	}
+	return NULL;
+}
+
+/* Hands the queued output of the calling worker to the TX threads */
+static void worker_flush(void)
+{
+	struct stage *st = self;
+
+	for (int j = 0; j < nr_interfaces; j++) {
+		if (st->out_count[j] == 0)
+			continue;
+		struct spsc_ring *r = tx_rings[st->id * nr_interfaces + j];
+		int sent = spsc_ring_enqueue_burst(r, (void **)st->out[j], st->out_count[j]);
+		/* The TX thread is behind, drop the rest; j is their egress */
+		stats_add(STATS(j, tx_dropped), st->out_count[j] - sent);
+		for (int k = sent; k < st->out_count[j]; k++)
+			packet_put(st->out[j][k]);
+		st->out_count[j] = 0;
+	}
+}
+
+/*
+ * send_packet_batch of a worker: passes a pool packet on with a new
+ * reference, copies anything else (ARP and ICMP built on the stack)
+ * into a pool packet.
+ */
+static void worker_send(packet *m)
+{
+	struct stage *st = self;
+	packet *out = m;
+
+	if (m->pool != NULL) {
+		packet_get(m);
+	} else {
+		out = packet_alloc(packet_pool);
+		if (out == NULL) {
+			/* Every packet is in flight, drop the reply */
+			stats_add(STATS(m->interface, drops[STATS_DROP_NO_BUFFER]), 1);
+			return;
+		}
+		packet_copy(out, m);
+	}
+	st->out[out->interface][st->out_count[out->interface]++] = out;
+	if (st->out_count[out->interface] == BURST_SIZE)
+		worker_flush();
+}
+
+static void *worker_main(void *arg)
+{
+	struct stage *st = arg;
+	packet *m[BURST_SIZE];
+	int idle = 0;
+
+	self = st;
+	pipeline_ops->worker_init(st->id);
+	redirect_packet_output(worker_send, worker_flush);
+
+	while (1) {
+		int busy = 0;
+		pipeline_ops->burst_begin(st->id);
+		for (int i = 0; i < nr_interfaces; i++) {
+			struct spsc_ring *r = rx_rings[i * nr_workers + st->id];
+			int n = spsc_ring_dequeue_burst(r, (void **)m, BURST_SIZE);
+			if (n == 0)
+				continue;
+			for (int k = 0; k < n; k++)
+				pipeline_ops->process(m[k]);
+			flush_packet_batches();
+			for (int k = 0; k < n; k++)
+				packet_put(m[k]);
+			busy = 1;
+		}
+		if (busy)
+			idle = 0;
+		else
+			stage_idle(&idle);
+	}
+	return NULL;
+}
+
+static void *tx_main(void *arg)
+{
+	struct stage *st = arg;
+	packet *m[BURST_SIZE];
+	int idle = 0;
+	char name[16];
+
+	snprintf(name, sizeof(name), "tx-%d", st->id);
+	stats_register(name);
+	init_sender(st->id);
+	while (1) {
+		int busy = 0;
+		for (int w = 0; w < nr_workers; w++) {
+			struct spsc_ring *r = tx_rings[w * nr_interfaces + st->id];
+			int n = spsc_ring_dequeue_burst(r, (void **)m, BURST_SIZE);
+			if (n == 0)
+				continue;
+			/* send_packet_batch holds its own reference until it sends */
+			for (int k = 0; k < n; k++) {
+				send_packet_batch(m[k]);
+				packet_put(m[k]);
+			}
+			busy = 1;
+		}
+		if (busy) {
+			LATENCY_DECLARE(start);
+			LATENCY_STAMP(start);
+			flush_packet_batches();
+			LATENCY_RECORD(LATENCY_TRANSMIT, start);
+			idle = 0;
+		} else {
+			stage_idle(&idle);
+		}
+	}
+	return NULL;
+}
+
+static void stage_start(void *(*fn)(void *), struct stage *st, int *cpu)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	pthread_attr_init(&attr);
+	if (getenv("ROUTER_PIN") != NULL) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(*cpu % sysconf(_SC_NPROCESSORS_ONLN), &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		(*cpu)++;
+	}
+	DIE(pthread_create(&thread, &attr, fn, st) != 0, "pthread_create");
+	pthread_attr_destroy(&attr);
+}
+
+void pipeline_run(int interfaces, int workers, struct packet_pool *pool,
+		  const struct pipeline_ops *ops)
+{
+	char *rx = getenv("ROUTER_RX");
+	DIE(rx != NULL, "the pipeline receives with recvmmsg, unset ROUTER_RX");
+	char *io = getenv("ROUTER_IO");
+	DIE(io != NULL && strcmp(io, "socket") != 0, "the pipeline runs on the packet sockets, unset ROUTER_IO");
+
+	nr_interfaces = interfaces;
+	nr_workers = workers;
+	packet_pool = pool;
+	pipeline_ops = ops;
+	rx_rings = malloc(sizeof(struct spsc_ring *) * interfaces * workers);
+	tx_rings = malloc(sizeof(struct spsc_ring *) * interfaces * workers);
+	DIE(rx_rings == NULL || tx_rings == NULL, "malloc pipeline rings");
+	for (int k = 0; k < interfaces * workers; k++) {
+		rx_rings[k] = spsc_ring_create(PIPELINE_RING_SIZE);
+		tx_rings[k] = spsc_ring_create(PIPELINE_RING_SIZE);
+	}
+
+	int cpu = 0;
+	for (int w = 0; w < workers; w++)
+		stage_start(worker_main, stage_create(w), &cpu);
+	for (int j = 0; j < interfaces; j++)
+		stage_start(tx_main, stage_create(j), &cpu);
+	for (int i = 0; i < interfaces; i++)
+		stage_start(rx_main, stage_create(i), &cpu);
+
+	/* Nothing left for the main thread but following the interfaces */
+	watch_interfaces();
+}
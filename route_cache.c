@@ -0,0 +1,69 @@
+#include "route_cache.h"
+
+static inline uint32_t route_cache_set(struct route_cache *rc, uint32_t daddr)
+{
+	return (daddr * 2654435761u >> 7) & rc->set_mask;
+}
+
+struct route_cache *route_cache_create(uint32_t sets)
+{
+	struct route_cache *rc = malloc(sizeof(struct route_cache));
+	DIE(rc == NULL, "malloc route cache");
+
+	if (sets > ROUTE_CACHE_MAX_SETS)
+		sets = ROUTE_CACHE_MAX_SETS;
+	uint32_t n = 1;
+	while (n < sets)
+		n <<= 1;
+	rc->entries = calloc(n * ROUTE_CACHE_WAYS, sizeof(struct route_cache_entry));
+	rc->victim = calloc(n, sizeof(uint8_t));
+	DIE(rc->entries == NULL || rc->victim == NULL, "calloc route cache");
+	rc->set_mask = n - 1;
+	/* calloc'd entries have generation 0, so they start out stale */
+	rc->generation = 1;
+	rc->hits = 0;
+	rc->misses = 0;
+	return rc;
+}
+
+struct route_cache_entry *route_cache_lookup(struct route_cache *rc, uint32_t daddr)
+{
+	struct route_cache_entry *set =
+		&rc->entries[route_cache_set(rc, daddr) * ROUTE_CACHE_WAYS];
+
+	for (int i = 0; i < ROUTE_CACHE_WAYS; i++) {
+		if (set[i].daddr == daddr && set[i].generation == rc->generation) {
+			rc->hits++;
+			return &set[i];
+		}
+	}
+	rc->misses++;
+	return NULL;
+}
+
+void route_cache_insert(struct route_cache *rc, uint32_t daddr, int route)
+{
+	uint32_t s = route_cache_set(rc, daddr);
+	struct route_cache_entry *set = &rc->entries[s * ROUTE_CACHE_WAYS];
+	struct route_cache_entry *e = NULL;
+
+	/* Reuse a stale way before evicting a live one */
+	for (int i = 0; i < ROUTE_CACHE_WAYS; i++) {
+		if (set[i].generation != rc->generation || set[i].daddr == daddr) {
+			e = &set[i];
+			break;
+		}
+	}
+	if (e == NULL) {
+		e = &set[rc->victim[s]];
+		rc->victim[s] = (rc->victim[s] + 1) % ROUTE_CACHE_WAYS;
+	}
+	e->daddr = daddr;
+	e->generation = rc->generation;
+	e->route = route;
+}
+
+void route_cache_invalidate(struct route_cache *rc)
+{
+	rc->generation++;
+}
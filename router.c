@@ -1,18 +1,109 @@
-#include <queue.h>
 #include <stdbool.h>
 #include "skel.h"
-#include "list.h"
+#include "fib.h"
+#include "route_cache.h"
+#include "adjacency.h"
+#include "arp_cache.h"
+#include "pending.h"
+#include "pipeline.h"
+#include "packet_pool.h"
+#include "frame_templates.h"
+#include "stats.h"
+#include "latency.h"
+#include "flight.h"
+#include "checksum.h"
+#include <signal.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+//Shared by every worker
+struct arp_cache* arp_table;
+struct packet_pool* packetPool;
+struct pending_table* pendingPackets;
+struct fib* routeFib;
+struct route_table_entry* routeTable;
+struct adjacency_table* adjacencies;
+struct route_cache** workerCaches;
+uint32_t interfaceGeneration = 0;	//Bumped when an interface changes its IP or MAC
+
+//Private to each worker
+__thread struct route_cache* routeCache;
+__thread uint32_t routeCacheGeneration;	//interfaceGeneration the route cache is from
+//Route of the packet being handled, found for its whole burst at once
+__thread int packetRoute = FIB_UNRESOLVED;
 
-list arp_table = NULL;
-queue packageQueue;
-
+/**
+ * @brief Receives and handles packets forever. Worker 0 runs on the main
+ * thread, the others open their own sockets first.
+ * 
+ * @param arg worker id
+ * @return void* never returns
+ */
+void* runWorker(void* arg);
+/**
+ * @brief Sets up the state private to a worker
+ * 
+ * @param id worker id
+ */
+void workerInit(int id);
+/**
+ * @brief Netlink reported a new IP or MAC on an interface: rewrites the
+ * adjacency headers and has every worker drop its route cache.
+ */
+void onInterfaceChange(void);
+/**
+ * @brief Runs before every burst. Drops the route cache after an
+ * interface change.
+ * 
+ * @param id worker id
+ */
+void burstBegin(int id);
+/**
+ * @brief Handles one packet handed over by an RX thread of the pipeline
+ * 
+ * @param m packet
+ */
+void processPipelinePacket(packet* m);
+/**
+ * @brief Handles a received burst: finds the routes of all its IPv4
+ * packets first, the route cache misses with one batched FIB lookup,
+ * then handles the packets one by one.
+ * 
+ * @param burst packets
+ * @param count number of packets
+ * @param routeTable Route table
+ */
+void processBurst(packet** burst, int count, struct route_table_entry* routeTable);
+/**
+ * @brief Finds the routes of the IPv4 packets of a burst through the
+ * route cache and fib_lookup_batch
+ * 
+ * @param burst packets
+ * @param count number of packets
+ * @param routes output, route index, -1 for no route or
+ * FIB_UNRESOLVED for packets that are not IPv4
+ */
+void resolveRoutes(packet** burst, int count, int* routes);
+/**
+ * @brief Handles one received packet and keeps it in the flight recorder
+ * 
+ * @param m packet
+ * @param routeTable Route table
+ */
+void processPacket(packet* m, struct route_table_entry* routeTable);
+/**
+ * @brief Handles one received packet
+ * 
+ * @param m packet
+ * @param routeTable Route table
+ */
+void handlePacket(packet* m, struct route_table_entry* routeTable);
 /**
  * @brief Handles an ARP packet
  * 
  * @param m packet to handle
  * @param routeTable
- * @param routeTableLength
  * @param arp_hdr ARP header of the packet
  * @param ethernet_hdr Ethernet header of the packet
  * @param icmp_hdr ICMP header of the packet
@@ -20,7 +111,7 @@ queue packageQueue;
  * @return true: the handling was succesful
  * @return false: drop the package
  */
-bool handleARP(packet m, struct route_table_entry* routeTable, size_t routeTableLength, struct arp_header* arp_hdr, struct ether_header* ethernet_hdr, struct icmphdr* icmp_hdr, struct iphdr* ip_header);
+bool handleARP(packet* m, struct route_table_entry* routeTable, struct arp_header* arp_hdr, struct ether_header* ethernet_hdr, struct icmphdr* icmp_hdr, struct iphdr* ip_header);
 /**
  * @brief Handles ICMP packet
  * 
@@ -31,12 +122,11 @@ bool handleARP(packet m, struct route_table_entry* routeTable, size_t routeTable
  * @return true: Success
  * @return false: Drop the packet
  */
-bool handleICMP(packet m, struct icmphdr* icmp_hdr, struct iphdr* ip_hdr, struct ether_header* ethernet_hdr);
+bool handleICMP(packet* m, struct icmphdr* icmp_hdr, struct iphdr* ip_hdr, struct ether_header* ethernet_hdr);
 /**
  * @brief Handles ICMP packet
  * 
  * @param routeTable Route table
- * @param routeTableLength Length of the route table
  * @param m Packet
  * @param arp_hdr ARP header of the packet
  * @param ip_hdr IP header of the packet
@@ -45,14 +135,14 @@ bool handleICMP(packet m, struct icmphdr* icmp_hdr, struct iphdr* ip_hdr, struct
  * @return true 
  * @return false 
  */
-bool handleForwarding(struct route_table_entry* routeTable, size_t routeTableLength, packet m, struct arp_header* arp_hdr, struct iphdr* ip_hdr, struct ether_header* ethernet_hdr, struct icmphdr* icmp_hdr);
+bool handleForwarding(struct route_table_entry* routeTable, packet* m, struct arp_header* arp_hdr, struct iphdr* ip_hdr, struct ether_header* ethernet_hdr, struct icmphdr* icmp_hdr);
 /**
- * @brief Finds ipv4 address in arp_table if it exists
+ * @brief Sends every packet waiting for the MAC of a next hop
  * 
- * @param ip ip
- * @return struct arp_entry* the entry if it exists, nullptr otherwise
+ * @param nextHop next hop IP
+ * @param mac MAC of the next hop
  */
-struct arp_entry* checkIfIPv4ExistsInARP(__u32 ip);
+void flushPending(uint32_t nextHop, uint8_t* mac);
 /**
  * @brief Checks if ttl and checksum are valid. If not, sends the required icmp error.
  * 
@@ -63,27 +153,21 @@ struct arp_entry* checkIfIPv4ExistsInARP(__u32 ip);
  * @return true: ttl and checksum check out
  * @return false: ttl expired or checksum is wrong 
  */
-bool checkTTLAndChecksum(packet m, struct iphdr ip_header, struct ether_header ethernet_header, struct icmphdr* icmp_hdr);
-void changeEtherHeader(packet* m,  struct ether_header* eth_hdr);
-void changeIPHeader(packet *m, struct iphdr* ip_hdr);
-void changeARPHeader(packet *m, struct arp_header* arp_hdr);
+bool checkTTLAndChecksum(packet* m, struct iphdr* ip_header, struct ether_header* ethernet_header, struct icmphdr* icmp_hdr);
 /**
- * @brief Recalculates checksum if only ttl was decremented
+ * @brief Get strictest route from table
  * 
- * @param m	Packet
- * @param ip_hdr IP header of the packet
- * @return 
+ * @param daddr Ip to search for
+ * @return int index in the route table or -1 if there is no route
  */
-void ttlDecrementChecksum(packet* m, struct iphdr* ip_hdr);
+int getRoute(uint32_t daddr);
 /**
- * @brief Get strictest route from table
+ * @brief Get strictest route through the route cache of the worker
  * 
- * @param routeTable Route table
- * @param routeTableLength	Length of the route table
- * @param ip_hdr Ip to search for
- * @return int
+ * @param daddr Ip to search for
+ * @return int index in the route table or -1 if there is no route
  */
-int getRoute(struct route_table_entry* routeTable, size_t routeTableLength, struct iphdr ip_hdr);
+int getCachedRoute(uint32_t daddr);
 /**
  * @brief Extracts ARP header of packet
  * 
@@ -99,485 +183,540 @@ struct arp_header* getARPHeader(char *payload);
  */
 struct icmphdr * getICMPHeader(char *payload);
 /**
- * @brief Create a Ethernet Header
+ * @brief Send an icmp packet about a received one: the echo reply to an
+ * echo request, or an error quoting the offending datagram. Built from
+ * the prebuilt frame of the interface the packet came in on.
  * 
- * @param sha source ethernet address
- * @param dha destination ethernet address
- * @param type type
- * @return struct ether_header* 
+ * @param m received packet
+ * @param type Type
+ * @param code Code
  */
-struct ether_header* createEthernetHeader(uint8_t *sha, uint8_t *dha, unsigned short type);
+void sendICMP(packet* m, uint8_t type, uint8_t code);
 /**
- * @brief Create an IP header
+ * @brief Send an ARP packet
  * 
- * @param v 
- * @param ihl 
- * @param tos 
- * @param prot 
- * @param len 
- * @param id 
- * @param frag 
- * @param ttl 
- * @param check 
- * @param daddr 
- * @param saddr 
- * @return struct iphdr* 
+ * @param daddr destination IP address
+ * @param dha destination MAC, unused for a request
+ * @param interface interface
+ * @param arp_op ARP OP: ARPOP_REQUEST or ARPOP_REPLY
  */
-struct iphdr* createIPHeader(unsigned int v, unsigned int ihl, uint8_t tos, uint8_t prot, uint16_t len, uint16_t id, uint16_t frag, uint8_t ttl, uint16_t check, uint32_t daddr, uint32_t saddr);
+void sendARP(uint32_t daddr, uint8_t* dha, int interface, uint16_t arp_op);
 /**
- * @brief Create an ARP header
+ * @brief Creates the packet pool, the ARP, pending and route tables and
+ * the route caches of every worker. Needs the interfaces set up.
  * 
- * @param daddr 
- * @param saddr 
- * @param sha 
- * @param tha 
- * @param htype 
- * @param ptype 
- * @param hlen 
- * @param plen 
- * @param op 
- * @return struct arp_header* 
+ * @param rtablePath route table file
+ * @param numInterfaces number of interfaces
+ * @return int number of routes
  */
-struct arp_header* createARPHeader(uint32_t daddr, u_int32_t saddr, uint8_t* sha, uint8_t* tha, u_int16_t htype, u_int16_t ptype, uint8_t hlen, u_int8_t plen, uint16_t op);
+int setupRouter(const char* rtablePath, int numInterfaces);
 /**
- * @brief Send an icmp packet
+ * @brief Removes the routes out of interfaces the router does not have,
+ * keeping the order of the others. Every array indexed by the egress
+ * interface relies on it.
  * 
- * @param daddr destination IP
- * @param saddr source IP
- * @param sha source MAC
- * @param dha destination MAC
- * @param type Type
- * @param code Code
- * @param interface interface 
- * @param id id
- * @param seq sequence
+ * @param rtable route table
+ * @param length number of routes
+ * @param numInterfaces number of interfaces
+ * @return int number of routes left
  */
-void sendICMP(uint32_t daddr, uint32_t saddr, uint8_t *sha, uint8_t *dha, u_int8_t type, u_int8_t code, int interface, int id, int seq, bool isError);
+int dropForeignRoutes(struct route_table_entry* rtable, int length, int numInterfaces);
 /**
- * @brief Send an ARP packet
+ * @brief Thread that prints the route cache counters and the latency
+ * histograms on every SIGUSR1
  * 
- * @param daddr destination IP address
- * @param saddr source IP address
- * @param eth_hdr ethernet header
- * @param interface interface
- * @param arp_op ARP OP: ARPOP_REQUEST or ARPOP_REPLY
+ * @param arg signal set holding SIGUSR1
+ * @return void* never returns
  */
-void sendARP(uint32_t daddr, uint32_t saddr, struct ether_header *eth_hdr, int interface, uint16_t arp_op);
+void* runStatsDump(void* arg);
+/**
+ * @brief Blocks SIGUSR1 and starts a thread that waits for it and prints the
+ * route cache counters and the latency histograms, so an idle router answers
+ * too. Must run before any other thread is created, they inherit the mask.
+ */
+void startStatsDump(void);
 
-void mergeByPrefix(struct route_table_entry* arr, int l, int m, int r)
-{
-    int i, j, k;
-    int n1 = m - l + 1;
-    int n2 = r - m;
-  
-    struct route_table_entry* L, *R;
-	L = (struct route_table_entry*)malloc(sizeof(struct route_table_entry) * n1);
-	R = (struct route_table_entry*)malloc(sizeof(struct route_table_entry) * n2);
-  
-    for (i = 0; i < n1; i++)
-        L[i] = arr[l + i];
-    for (j = 0; j < n2; j++)
-        R[j] = arr[m + 1 + j];
-  
-    i = 0; // Initial index of first subarray
-    j = 0; // Initial index of second subarray
-    k = l; // Initial index of merged subarray
-    while (i < n1 && j < n2) {
-        if (L->prefix <= R->prefix) {
-            arr[k] = L[i];
-            i++;
-        }
-        else {
-            arr[k] = R[j];
-            j++;
-        }
-        k++;
-    }
-  
-    while (i < n1) {
-        arr[k] = L[i];
-        i++;
-        k++;
-    }
-  
-    while (j < n2) {
-        arr[k] = R[j];
-        j++;
-        k++;
-    }
-}
-  
-void mergeSortByPrefix(struct route_table_entry* arr, int l, int r)
+int main(int argc, char *argv[])
 {
-    if (l < r) {
-        int m = l + (r - l) / 2;
-  
-        mergeSortByPrefix(arr, l, m);
-        mergeSortByPrefix(arr, m + 1, r);
-  
-        mergeByPrefix(arr, l, m, r);
-    }
+	setvbuf(stdout, NULL, _IONBF, 0);
+
+	// Do not modify this line
+	init(argc - 2, argv + 2);
+
+	setupRouter(argv[1], argc - 2);
+	on_interface_change(onInterfaceChange);
+	startStatsDump();
+	char* flightFile = getenv("ROUTER_FLIGHT_FILE");
+	flight_start(flightFile != NULL ? flightFile : "flight.txt", argc - 2);
+	char* statsSocket = getenv("ROUTER_STATS_SOCKET");
+	if(statsSocket != NULL)
+	{
+		stats_serve(statsSocket, argc - 2);
+	}
+
+	char* mode = getenv("ROUTER_MODE");
+	if(mode != NULL && strcmp(mode, "pipeline") == 0)
+	{
+		struct pipeline_ops ops = { workerInit, burstBegin, processPipelinePacket };
+		pipeline_run(argc - 2, num_workers, packetPool, &ops);
+	}
+
+	for(long i=1;i<num_workers;i++)
+	{
+		pthread_t thread;
+		DIE(pthread_create(&thread, NULL, runWorker, (void*)i) != 0, "pthread_create");
+	}
+	runWorker((void*)0);
+	return 0;
 }
 
-void mergeByMask(struct route_table_entry* arr, int l, int m, int r)
+int setupRouter(const char* rtablePath, int numInterfaces)
 {
-    int i, j, k;
-    int n1 = m - l + 1;
-    int n2 = r - m;
-  
-    struct route_table_entry* L, *R;
-	L = (struct route_table_entry*)malloc(sizeof(struct route_table_entry) * n1);
-	R = (struct route_table_entry*)malloc(sizeof(struct route_table_entry) * n2);
-  
-    for (i = 0; i < n1; i++)
-        L[i] = arr[l + i];
-    for (j = 0; j < n2; j++)
-        R[j] = arr[m + 1 + j];
-  
-    i = 0; // Initial index of first subarray
-    j = 0; // Initial index of second subarray
-    k = l; // Initial index of merged subarray
-    while (i < n1 && j < n2) {
-        if (L->mask >= R->mask) {
-            arr[k] = L[i];
-            i++;
-        }
-        else {
-            arr[k] = R[j];
-            j++;
-        }
-        k++;
-    }
-  
-    while (i < n1) {
-        arr[k] = L[i];
-        i++;
-        k++;
-    }
-  
-    while (j < n2) {
-        arr[k] = R[j];
-        j++;
-        k++;
-    }
+	int depth = env_number("ROUTER_PENDING_DEPTH", 64, 1, PENDING_MAX_DEPTH);
+	//The pending queues may hold as many packets as 256 full ones
+	int pendingHeld = 256 * depth;
+	//Enough packets for the pending queues and a burst in flight on every thread
+	uint32_t packets = pendingHeld + (num_workers + 2 * numInterfaces) * 4 * (BURST_SIZE + PACKET_POOL_CACHE);
+	packets = env_number("ROUTER_POOL_SIZE", packets, 1, PACKET_POOL_MAX_SIZE);
+	//Every thread may hold a burst and a full cache at once, the pipeline adds RX and TX threads
+	char* mode = getenv("ROUTER_MODE");
+	int threads = mode != NULL && strcmp(mode, "pipeline") == 0 ? num_workers + 2 * numInterfaces : num_workers;
+	uint32_t least = threads * (BURST_SIZE + PACKET_POOL_CACHE);
+	if(packets < least)
+	{
+		fprintf(stderr, "ROUTER_POOL_SIZE must be at least %u for %d threads\n", least, threads);
+		exit(1);
+	}
+	packetPool = packet_pool_create(packets, getenv("ROUTER_HUGEPAGES") != NULL);
+	arp_table = arp_cache_create(env_number("ROUTER_ARP_CAPACITY", 1024, 1, ARP_CACHE_MAX_CAPACITY));
+	routeTable = malloc(sizeof(struct route_table_entry) * 80000);
+	int routeTableLength = dropForeignRoutes(routeTable, read_rtable(rtablePath, routeTable), numInterfaces);
+	routeFib = fib_create(routeTable, routeTableLength, fib_mode_parse(getenv("ROUTER_FIB")));
+	adjacencies = adjacency_create(routeTable, routeTableLength);
+	//A queue for every next hop, so one can always be had; they are only filled while unresolved
+	pendingPackets = pending_create(adjacencies->count > 0 ? adjacencies->count : 1, depth, pendingHeld, packetPool);
+	uint32_t cacheSets = env_number("ROUTER_ROUTE_CACHE_SETS", 1024, 1, ROUTE_CACHE_MAX_SETS);
+	workerCaches = malloc(sizeof(struct route_cache*) * num_workers);
+	for(int i=0;i<num_workers;i++)
+	{
+		workerCaches[i] = route_cache_create(cacheSets);
+	}
+	return routeTableLength;
 }
 
-void mergeSortByMask(struct route_table_entry* arr, int l, int r)
+int dropForeignRoutes(struct route_table_entry* rtable, int length, int numInterfaces)
 {
-    if (l < r) {
-        int m = l + (r - l) / 2;
-  
-        mergeSortByMask(arr, l, m);
-        mergeSortByMask(arr, m + 1, r);
-  
-        mergeByMask(arr, l, m, r);
-    }
+	int kept = 0;
+	for(int i=0;i<length;i++)
+	{
+		if(rtable[i].interface >= 0 && rtable[i].interface < numInterfaces)
+		{
+			rtable[kept++] = rtable[i];
+		}
+	}
+	if(kept < length)
+	{
+		fprintf(stderr, "Skipped %d routes out of interfaces the router does not have\n", length - kept);
+	}
+	return kept;
 }
 
-int main(int argc, char *argv[])
+void* runWorker(void* arg)
 {
-	setvbuf(stdout, NULL, _IONBF, 0);
-	packet m;
-	int rc;
-
-	// Do not modify this line
-	init(argc - 2, argv + 2);
-
-	packageQueue = queue_create();
-	struct route_table_entry* routeTable = malloc(sizeof(struct route_table_entry) * 80000);
-	int routeTableLength = read_rtable(argv[1], routeTable);
+	long id = (long)arg;
+	packet* burst[BURST_SIZE];
+	int ready = 0;	//burst[0..ready) are allocated
+	int count;
 
-	mergeSortByMask(routeTable, 0, routeTableLength - 1);
-	mergeSortByPrefix(routeTable, 0, routeTableLength - 1);
+	if(id != 0)
+	{
+		init_worker();
+	}
+	workerInit(id);
 
 	while (1) {
-		rc = get_packet(&m);
-		DIE(rc < 0, "get_packet");
-		/* TODO */
-		struct arp_header* arp_hdr = getARPHeader(m.payload);
-		struct ether_header* ethernet_hdr = (struct ether_header*)m.payload;
-		struct icmphdr* icmp_hdr = getICMPHeader(m.payload);
-		struct iphdr* ip_hdr = (struct iphdr*)(m.payload + sizeof(struct ether_header));
-
-		//If ARP package
-		if(arp_hdr != NULL)
+		while(ready < BURST_SIZE && (burst[ready] = packet_alloc(packetPool)) != NULL)
+		{
+			ready++;
+		}
+		if(ready == 0)
+		{
+			//Every buffer is queued or in flight: leave the packets to the kernel meanwhile
+			flush_packet_batches();
+			pending_expire_all(pendingPackets);
+			struct timespec pause = { 0, 100000 };
+			nanosleep(&pause, NULL);
+			continue;
+		}
+		count = get_packets(burst, ready);
+		DIE(count < 0, "get_packets");
+		burstBegin(id);
+		processBurst(burst, count, routeTable);
+		LATENCY_DECLARE(sent);
+		LATENCY_STAMP(sent);
+		flush_packet_batches();	//Send everything the burst produced
+		LATENCY_RECORD(LATENCY_TRANSMIT, sent);
+		for(int i=0;i<count;i++)
 		{
-			bool success = handleARP(m, routeTable, routeTableLength, arp_hdr, ethernet_hdr, icmp_hdr, ip_hdr);
-			if(!success)
+			//Reuse the packet unless a pending queue still holds it
+			if(__atomic_load_n(&burst[i]->refcnt, __ATOMIC_ACQUIRE) != 1)
 			{
-				continue;	//Drop the package
+				packet_put(burst[i]);
+				burst[i] = NULL;
 			}
 		}
-		else if(icmp_hdr != NULL)
+		//Move the packets that can be reused to the front
+		int kept = 0;
+		for(int i=0;i<ready;i++)
 		{
-			bool success = handleICMP(m, icmp_hdr, ip_hdr, ethernet_hdr);
-			if(!success)
+			if(burst[i] != NULL)
 			{
-				continue;	//Drop the package
+				burst[kept++] = burst[i];
 			}
 		}
-		bool succes = handleForwarding(routeTable, routeTableLength, m, arp_hdr, ip_hdr, ethernet_hdr, icmp_hdr);
-		if(!succes)
+		ready = kept;
+	}
+	return NULL;
+}
+
+void workerInit(int id)
+{
+	char name[16];
+	snprintf(name, sizeof(name), "worker-%d", id);
+	stats_register(name);
+	routeCache = workerCaches[id];
+}
+
+void onInterfaceChange(void)
+{
+	adjacency_refresh(adjacencies);
+	__atomic_add_fetch(&interfaceGeneration, 1, __ATOMIC_RELEASE);
+}
+
+void burstBegin(int id)
+{
+	uint32_t generation = __atomic_load_n(&interfaceGeneration, __ATOMIC_ACQUIRE);
+	if(generation != routeCacheGeneration)
+	{
+		routeCacheGeneration = generation;
+		route_cache_invalidate(routeCache);
+	}
+}
+
+void processPipelinePacket(packet* m)
+{
+	processPacket(m, routeTable);
+}
+
+void processBurst(packet** burst, int count, struct route_table_entry* routeTable)
+{
+	int routes[BURST_SIZE];
+	LATENCY_DECLARE(lookup);
+	LATENCY_STAMP(lookup);
+	resolveRoutes(burst, count, routes);
+	LATENCY_RECORD(LATENCY_ROUTE, lookup);
+	for(int i=0;i<count;i++)
+	{
+		packetRoute = routes[i];
+		processPacket(burst[i], routeTable);
+	}
+	packetRoute = FIB_UNRESOLVED;
+}
+
+void resolveRoutes(packet** burst, int count, int* routes)
+{
+	uint32_t missed[BURST_SIZE];
+	int missedAt[BURST_SIZE];
+	int found[BURST_SIZE];
+	int misses = 0;
+	for(int i=0;i<count;i++)
+	{
+		routes[i] = FIB_UNRESOLVED;
+		struct ether_header* eth_hdr = (struct ether_header*)burst[i]->payload;
+		if(burst[i]->len < (int)(sizeof(struct ether_header) + sizeof(struct iphdr)) || ntohs(eth_hdr->ether_type) != ETHERTYPE_IP)
 		{
-			continue;	//Drop the package
+			continue;
+		}
+		uint32_t daddr = ((struct iphdr*)(eth_hdr + 1))->daddr;
+		struct route_cache_entry* cached = route_cache_lookup(routeCache, daddr);
+		if(cached != NULL)
+		{
+			routes[i] = cached->route;
+		}
+		else
+		{
+			missed[misses] = daddr;
+			missedAt[misses++] = i;
+		}
+	}
+	if(misses == 0)
+	{
+		return;
+	}
+	fib_lookup_batch(routeFib, missed, found, misses);
+	for(int i=0;i<misses;i++)
+	{
+		routes[missedAt[i]] = found[i];
+		if(found[i] != -1)
+		{
+			route_cache_insert(routeCache, missed[i], found[i]);
 		}
 	}
 }
 
-bool handleARP(packet m, struct route_table_entry* routeTable, size_t routeTableLength, struct arp_header* arp_hdr, struct ether_header* ethernet_hdr, struct icmphdr* icmp_hdr, struct iphdr* ip_header)
+void processPacket(packet* m, struct route_table_entry* routeTable)
 {
-	in_addr_t address = inet_addr(get_interface_ip(m.interface));
+	flight_begin(m);
+	handlePacket(m, routeTable);
+	flight_end();
+}
+
+void handlePacket(packet* m, struct route_table_entry* routeTable)
+{
+	LATENCY_DECLARE(stage);
+	LATENCY_STAMP(stage);
+	struct arp_header* arp_hdr = getARPHeader(m->payload);
+	struct ether_header* ethernet_hdr = (struct ether_header*)m->payload;
+	struct icmphdr* icmp_hdr = getICMPHeader(m->payload);
+	struct iphdr* ip_hdr = (struct iphdr*)(m->payload + sizeof(struct ether_header));
+	LATENCY_RECORD(LATENCY_PARSE, stage);
+
+	stats_rx(m);
+	//If ARP package
+	if(arp_hdr != NULL)
+	{
+		bool success = handleARP(m, routeTable, arp_hdr, ethernet_hdr, icmp_hdr, ip_hdr);
+		if(!success)
+		{
+			return;	//Drop the package
+		}
+	}
+	else if(icmp_hdr != NULL)
+	{
+		bool success = handleICMP(m, icmp_hdr, ip_hdr, ethernet_hdr);
+		if(!success)
+		{
+			return;	//Drop the package
+		}
+	}
+	handleForwarding(routeTable, m, arp_hdr, ip_hdr, ethernet_hdr, icmp_hdr);
+}
+
+bool handleARP(packet* m, struct route_table_entry* routeTable, struct arp_header* arp_hdr, struct ether_header* ethernet_hdr, struct icmphdr* icmp_hdr, struct iphdr* ip_header)
+{
+	in_addr_t address = interface_table[m->interface].ip;
 	//If request for this router
 	if(ntohs(arp_hdr->op) == 1 && arp_hdr->tpa == address)	// 1 = arp request
 	{
-		uint8_t* mac = (uint8_t*)malloc(sizeof(6));
-		get_interface_mac(m.interface, mac);
-		struct ether_header* e_h = createEthernetHeader(mac, ethernet_hdr->ether_shost, ethernet_hdr->ether_type);
-		sendARP(arp_hdr->spa, arp_hdr->tpa, e_h, m.interface, htons(2));	//2 = arp reply
-		free(e_h);
-		free(mac);
-
+		sendARP(arp_hdr->spa, ethernet_hdr->ether_shost, m->interface, ARPOP_REPLY);
 		return false;
 	}
 	//If reply
 	else if(ntohs(arp_hdr->op) == 2)	// 2 = arp reply
 	{
-		struct arp_entry* arp_e = malloc(sizeof(struct arp_entry));
-		arp_e->ip = arp_hdr->spa;
-		memcpy(arp_e->mac, ethernet_hdr->ether_shost, 6);
-		arp_table = cons(arp_e, arp_table);
-		if(!queue_empty(packageQueue))	//Dequeue queued package if it exists
-		{
-			packet* pack = queue_deq(packageQueue);
-			struct ether_header* p_eth_hdr;
-			struct iphdr* p_ip_hdr;
-
-			p_eth_hdr = (struct ether_header*)pack;
-			p_ip_hdr = (struct iphdr*)(pack->payload + sizeof(struct ether_header));
-
-			if(!checkTTLAndChecksum(m, *p_ip_hdr, *p_eth_hdr, icmp_hdr))
-			{
-				return false;
-			}
-
-			int index = getRoute(routeTable, routeTableLength, *p_ip_hdr);
-			struct route_table_entry route;
-
-			if(index == -1)	//If route not found
-			{
-				sendICMP(p_ip_hdr->saddr, p_ip_hdr->daddr, p_eth_hdr->ether_dhost, p_eth_hdr->ether_shost, 3, 0, m.interface, icmp_hdr->un.echo.id, icmp_hdr->un.echo.sequence, true);
-                free(p_eth_hdr);
-				free(p_ip_hdr);
-				return false;
-			}
-			else
-			{
-				route = routeTable[index];
-				uint8_t* mac = (uint8_t*)malloc(sizeof(6));
-				get_interface_mac(m.interface, mac);
-
-				struct arp_entry* entry = checkIfIPv4ExistsInARP(route.next_hop);
-
-				struct ether_header* header = createEthernetHeader(mac, entry->mac, ethernet_hdr->ether_type);
-
-				changeEtherHeader(&m, ethernet_hdr);
-
-				m.interface = route.interface;
-
-				send_packet(&m);	//Forward
-
-				free(header);
-				free(p_eth_hdr);
-				free(p_ip_hdr);
-				return false;
-			}
-		}
-		else
+		stats_add(STATS(m->interface, arp_replies_received), 1);
+		if(arp_cache_update(arp_table, arp_hdr->spa, ethernet_hdr->ether_shost) != 0)
 		{
-			return false;	//Drop the packet
+			//New or changed neighbor, rewrite the headers of its routes in place
+			adjacency_resolve(adjacencies, arp_hdr->spa, ethernet_hdr->ether_shost);
 		}
+		//Send everything that was waiting for this neighbor
+		flushPending(arp_hdr->spa, ethernet_hdr->ether_shost);
+		return false;
 	}
 	else
 	{
+		stats_drop(m->interface, STATS_DROP_NOT_FOR_US);
 		return false;
 	}
 	return true;
 }
 
-bool handleICMP(packet m, struct icmphdr* icmp_hdr, struct iphdr* ip_hdr, struct ether_header* ethernet_hdr)
+bool handleICMP(packet* m, struct icmphdr* icmp_hdr, struct iphdr* ip_hdr, struct ether_header* ethernet_hdr)
 {
 	if(ip_hdr->ttl <= 1)	//Check ttl
 	{
-		sendICMP(ip_hdr->saddr, ip_hdr->daddr, ethernet_hdr->ether_dhost, ethernet_hdr->ether_shost, 11, 0, icmp_hdr->un.echo.id, icmp_hdr->un.echo.sequence, m.interface, true);
+		stats_drop(m->interface, STATS_DROP_TTL_EXPIRED);
+		sendICMP(m, ICMP_TIME_EXCEEDED, 0);
 		return false;
 	}
 
-	//Check checksum
-	uint16_t check = icmp_hdr->checksum;
-	icmp_hdr->checksum = 0;
-	icmp_hdr->checksum = icmp_checksum((uint16_t*)icmp_hdr, sizeof(icmp_hdr));
-
-	if(check != icmp_hdr->checksum)
+	//Check checksum over the whole message, as long as tot_len says and was received
+	int icmpLen = ntohs(ip_hdr->tot_len) - (int)sizeof(struct iphdr);
+	int received = m->len - (int)(sizeof(struct ether_header) + sizeof(struct iphdr));
+	if(icmpLen < (int)sizeof(struct icmphdr) || icmpLen > received || checksum(icmp_hdr, icmpLen) != 0)
 	{
+		stats_drop(m->interface, STATS_DROP_BAD_CHECKSUM);
 		return false;
 	}
 
-	in_addr_t address = inet_addr(get_interface_ip(m.interface));
+	in_addr_t address = interface_table[m->interface].ip;
 	if(ip_hdr->daddr == address && icmp_hdr->type == 8)	//8 = echo request
 	{
-		sendICMP(ip_hdr->saddr, ip_hdr->daddr, ethernet_hdr->ether_dhost, ethernet_hdr->ether_shost, 0, 0, m.interface, icmp_hdr->un.echo.id, icmp_hdr->un.echo.sequence, false);
+		sendICMP(m, ICMP_ECHOREPLY, 0);
 		return false;
 	}
 	else if(ip_hdr->daddr == address)
 	{
+		stats_drop(m->interface, STATS_DROP_NOT_FOR_US);
 		return false;	//Drop the package
 	}
 	return true;
 }
 
-bool handleForwarding(struct route_table_entry* routeTable, size_t routeTableLength, packet m, struct arp_header* arp_hdr, struct iphdr* ip_hdr, struct ether_header* ethernet_hdr, struct icmphdr* icmp_hdr){
-	if(!checkTTLAndChecksum(m, *ip_hdr, *ethernet_hdr, icmp_hdr))
+bool handleForwarding(struct route_table_entry* routeTable, packet* m, struct arp_header* arp_hdr, struct iphdr* ip_hdr, struct ether_header* ethernet_hdr, struct icmphdr* icmp_hdr){
+	LATENCY_DECLARE(stage);
+	LATENCY_STAMP(stage);
+	if(!checkTTLAndChecksum(m, ip_hdr, ethernet_hdr, icmp_hdr))
 	{
 		return false;
 	}
 
-	ip_hdr->ttl--;
-	ttlDecrementChecksum(&m, ip_hdr);
+	//Decrement the ttl and patch the checksum instead of recomputing it
+	checksum_replace8(&ip_hdr->check, ip_hdr, &ip_hdr->ttl, ip_hdr->ttl - 1);
+	LATENCY_RECORD(LATENCY_VALIDATE, stage);
 
-	int index = getRoute(routeTable, routeTableLength, *ip_hdr);
-	struct route_table_entry* route;
+	int index = packetRoute;
+	if(index == FIB_UNRESOLVED)	//Not part of a burst, processBurst times its lookups
+	{
+		index = getCachedRoute(ip_hdr->daddr);
+		LATENCY_RECORD(LATENCY_ROUTE, stage);
+	}
 	if(index == -1)	//If route does not exist
 	{
-		sendICMP(ip_hdr->saddr, ip_hdr->daddr, ethernet_hdr->ether_dhost, ethernet_hdr->ether_shost, 3, 0, m.interface, icmp_hdr->un.echo.id, icmp_hdr->un.echo.sequence, true);
+		stats_drop(m->interface, STATS_DROP_NO_ROUTE);
+		sendICMP(m, ICMP_DEST_UNREACH, ICMP_NET_UNREACH);
 		return false;	//Drop packet
 	}
-	route = &routeTable[index];
 
-	struct arp_entry* entry = checkIfIPv4ExistsInARP(route->next_hop);
-	uint8_t* macSource = (uint8_t*)malloc(sizeof(6));
-	get_interface_mac(m.interface, macSource);
-	if(entry == NULL)	//If there is no entry in arp_table
+	struct adjacency* adj = adjacency_of_route(adjacencies, index);
+	int inInterface = m->interface;
+	m->interface = adj->interface;
+	flight_route(index, adj->interface);
+	if(!adjacency_write_header(adj, m->payload))	//Next hop not resolved yet
 	{
-		queue_enq(packageQueue, &m);
-		uint8_t* macDest = (uint8_t*)malloc(sizeof(6));
-		hwaddr_aton("FF:FF:FF:FF:FF:FF", macDest);
-		struct ether_header* eth_hdr = createEthernetHeader(macSource, macDest, htons(0x806));
-
-		sendARP(route->next_hop, inet_addr(get_interface_ip(route->interface)), eth_hdr, route->interface, htons(1));	// 1 = arp request
-
-		free(macSource);
-		free(macDest);
-		free(eth_hdr);
+		bool queued = pending_enqueue(pendingPackets, adj->next_hop, m, inInterface);
+		LATENCY_RECORD(LATENCY_ARP, stage);
+		if(queued && adjacency_write_header(adj, m->payload))
+		{
+			//Another worker got the reply meanwhile and may have flushed already
+			flushPending(adj->next_hop, ethernet_hdr->ether_dhost);
+			flight_verdict(FLIGHT_FORWARDED);
+			return true;
+		}
+		if(queued)
+		{
+			flight_verdict(FLIGHT_QUEUED);
+		}
+		else
+		{
+			stats_drop(inInterface, STATS_DROP_ARP_PENDING);
+		}
+		//Asked again even for a dropped packet, a full queue only drains on a reply
+		if(pending_arp_due(pendingPackets, adj->next_hop))
+		{
+			sendARP(adj->next_hop, NULL, adj->interface, ARPOP_REQUEST);
+		}
 		return false;
 	}
-	else
-	{
-		struct ether_header* eth_hdr = createEthernetHeader(macSource, entry->mac, ethernet_hdr->ether_type);
-		changeEtherHeader(&m, eth_hdr);
-		(&m)->interface = route->interface;
 
-		send_packet(&m);	//Forward
-		free(eth_hdr);
-	}
+	LATENCY_RECORD(LATENCY_ARP, stage);
+
+	flight_verdict(FLIGHT_FORWARDED);
+	send_packet_batch(m);	//Forward
 	return true;
 }
 
-struct arp_entry* checkIfIPv4ExistsInARP(uint32_t ip)
+void flushPending(uint32_t nextHop, uint8_t* mac)
 {
-	list currentElement = arp_table;
-	while(currentElement != NULL)
+	packet* pack;
+	while((pack = pending_dequeue(pendingPackets, nextHop)) != NULL)
 	{
-		if(((struct arp_entry*)currentElement->element)->ip == ip)
-		{
-			return (struct arp_entry*)currentElement->element;
-		}
-		currentElement = currentElement->next;
+		struct ether_header* p_eth_hdr = (struct ether_header*)pack->payload;
+		memcpy(p_eth_hdr->ether_shost, interface_table[pack->interface].mac, ETH_ALEN);
+		memcpy(p_eth_hdr->ether_dhost, mac, ETH_ALEN);
+		send_packet_batch(pack);	//Forward
+		packet_put(pack);
 	}
-	return NULL;
 }
 
-bool checkTTLAndChecksum(packet m, struct iphdr ip_header, struct ether_header ethernet_header, struct icmphdr* icmp_hdr)
+bool checkTTLAndChecksum(packet* m, struct iphdr* ip_header, struct ether_header* ethernet_header, struct icmphdr* icmp_hdr)
 {
-	if(ip_header.ttl <= 1)
+	if(ip_header->ttl <= 1)
 	{
 		//Send ttl error
-		sendICMP(ip_header.saddr, ip_header.daddr, ethernet_header.ether_dhost, ethernet_header.ether_shost, 11, 0, icmp_hdr->un.echo.id, icmp_hdr->un.echo.sequence, m.interface, true);
+		stats_drop(m->interface, STATS_DROP_TTL_EXPIRED);
+		sendICMP(m, ICMP_TIME_EXCEEDED, 0);
 		return false;	//Drop the packet
 	}
-	__u16 check = ip_header.check;
-	ip_header.check = 0;
-	ip_header.check = ip_checksum((uint8_t*)&ip_header, sizeof(struct iphdr));
-
-	if(check != ip_header.check)
+	//The sum over a valid header, checksum included, is 0; the packet is not touched
+	if(checksum(ip_header, sizeof(struct iphdr)) != 0)
 	{
+		stats_drop(m->interface, STATS_DROP_BAD_CHECKSUM);
 		return false;	//Drop the packet
 	}
 	return true;
 }
 
-void ttlDecrementChecksum(packet* m, struct iphdr* ip_hdr)
+void* runStatsDump(void* arg)
 {
-	//ip_hdr->check = 0;
-	//ip_hdr->check = ip_checksum((uint8_t*)ip_hdr, sizeof(struct iphdr));
-	uint16_t oldCheck = ip_hdr->check;
-	uint8_t currTTL = ip_hdr->ttl;
-	uint8_t oldTTL = currTTL + 1;
-	uint16_t newCheck = ~(~oldCheck + (-oldTTL) + currTTL);
-	ip_hdr->check = newCheck;
-	changeIPHeader(m, ip_hdr);
-}
-
-void changeEtherHeader(packet* m,  struct ether_header* eth_hdr)
-{
-	memcpy(m->payload, eth_hdr, sizeof(struct ether_header));
+	sigset_t* set = arg;
+	int sig;
+	while(1)
+	{
+		if(sigwait(set, &sig) != 0)
+		{
+			continue;
+		}
+		//Racy reads of the workers' counters, good enough for a dump
+		uint64_t hits = 0, misses = 0;
+		for(int i=0;i<num_workers;i++)
+		{
+			hits += __atomic_load_n(&workerCaches[i]->hits, __ATOMIC_RELAXED);
+			misses += __atomic_load_n(&workerCaches[i]->misses, __ATOMIC_RELAXED);
+		}
+		printf("route cache: %lu hits %lu misses\n", (unsigned long)hits, (unsigned long)misses);
+		LATENCY_DUMP(stdout);
+	}
+	return NULL;
 }
 
-void changeIPHeader(packet *m, struct iphdr* ip_hdr)
+void startStatsDump(void)
 {
-	memcpy(m->payload + sizeof(struct ether_header), ip_hdr, sizeof(struct iphdr));
+	static sigset_t set;
+	sigset_t all, old;
+	pthread_t thread;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	DIE(pthread_sigmask(SIG_BLOCK, &set, NULL) != 0, "pthread_sigmask");
+	//The thread takes no other signal, SIGUSR2 is for the flight recorder
+	sigfillset(&all);
+	DIE(pthread_sigmask(SIG_BLOCK, &all, &old) != 0, "pthread_sigmask");
+	DIE(pthread_create(&thread, NULL, runStatsDump, &set) != 0, "pthread_create");
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_detach(thread);
 }
 
-void changeARPHeader(packet *m, struct arp_header* arp_hdr)
+int getRoute(uint32_t daddr)
 {
-	memcpy(m->payload + sizeof(struct ethhdr), arp_hdr, sizeof(struct arp_header));
+	return fib_lookup(routeFib, daddr);
 }
 
-int getRoute(struct route_table_entry* routeTable, size_t routeTableLength, struct iphdr ip_hdr)
+int getCachedRoute(uint32_t daddr)
 {
-	/*int l = 0;
-	int r = routeTableLength - 1;
-	while(l <= r)
+	struct route_cache_entry* cached = route_cache_lookup(routeCache, daddr);
+	if(cached != NULL)
 	{
-		int mid = l + (r - l) / 2;
-		if(routeTable[mid].prefix == (ip_hdr.daddr & routeTable[mid].mask))
-		{
-			return mid;
-		}
-		else if(ip_hdr.daddr > routeTable[mid].prefix)
-		{
-			l = mid + 1;
-		}
-		else
-		{
-			r = mid - 1;
-		}
+		return cached->route;
 	}
-	return -1;*/
-	int index = -1;
-	uint32_t biggestMask = 0;
-	for(int i=0;i<routeTableLength;i++)
+	int index = getRoute(daddr);
+	if(index != -1)
 	{
-		if((ip_hdr.daddr & routeTable[i].mask) == routeTable[i].prefix)
-		{
-			if(routeTable[i].mask > biggestMask)
-			{
-				index = i;
-				biggestMask = routeTable[i].mask;
-			}
-		}
+		route_cache_insert(routeCache, daddr, index);
 	}
 	return index;
-} 
+}
 
 struct arp_header* getARPHeader(char *payload)
 {
@@ -611,93 +750,49 @@ struct icmphdr * getICMPHeader(char *payload)
 	return NULL;
 }
 
-struct ether_header* createEthernetHeader(uint8_t *sha, uint8_t *dha, unsigned short type)
+void sendICMP(packet* m, uint8_t type, uint8_t code)
 {
-	struct ether_header* eth_hdr = (struct ether_header*)malloc(sizeof(struct ether_header));
-	memcpy(eth_hdr->ether_shost, sha, 6);
-	memcpy(eth_hdr->ether_dhost, dha, 6);
-	eth_hdr->ether_type = type;
-	return eth_hdr;
-}
-
-struct iphdr* createIPHeader(unsigned int v, unsigned int ihl, uint8_t tos, uint8_t prot, uint16_t len, uint16_t id, uint16_t frag, uint8_t ttl, uint16_t check, uint32_t daddr, uint32_t saddr)
-{
-	struct iphdr* ip_hdr = (struct iphdr*)malloc(sizeof(struct iphdr));
-	ip_hdr->version = v;
-	ip_hdr->ihl = ihl;
-	ip_hdr->tos = tos;
-	ip_hdr->protocol = prot;
-	ip_hdr->tot_len = len;
-	ip_hdr->id = id;
-	ip_hdr->frag_off = frag;
-	ip_hdr->ttl = ttl;
-	ip_hdr->check = check;
-	ip_hdr->daddr = daddr;
-	ip_hdr->saddr = saddr;
-
-	return ip_hdr;
-}
-
-struct arp_header* createARPHeader(uint32_t daddr, u_int32_t saddr, uint8_t* sha, uint8_t* tha, u_int16_t htype, u_int16_t ptype, uint8_t hlen, u_int8_t plen, uint16_t op)
-{
-	struct arp_header* arp_hdr = (struct arp_header*)malloc(sizeof(struct arp_header));
-	arp_hdr->tpa = daddr;
-	arp_hdr->spa = saddr;
-	memcpy(arp_hdr->sha, sha, 6);
-	memcpy(arp_hdr->tha, tha, 6);
-	arp_hdr->htype = htype;
-	arp_hdr->ptype = ptype;
-	arp_hdr->op = op;
-	arp_hdr->hlen = hlen;
-	arp_hdr->plen = plen;
-
-	return arp_hdr;
-}
-
-void sendICMP(uint32_t daddr, uint32_t saddr, uint8_t *sha, uint8_t *dha, u_int8_t type, u_int8_t code, int interface, int id, int seq, bool isError)
-{
-
-	struct ether_header* eth_hdr;
-	struct iphdr* ip_hdr;
-	struct icmphdr icmp_hdr;
-	icmp_hdr.type = type;
-	icmp_hdr.code = code;
-	icmp_hdr.checksum = 0;
-	if(!isError)
+	packet* out = packet_alloc(packetPool);
+	if(out == NULL)
 	{
-		icmp_hdr.un.echo.id = id;
-		icmp_hdr.un.echo.sequence = seq;
+		//No buffer left for the reply; the request is counted by the caller
+		stats_add(STATS(m->interface, drops[STATS_DROP_NO_BUFFER]), 1);
+		return;
 	}
-	icmp_hdr.checksum = icmp_checksum((uint16_t *)&icmp_hdr, sizeof(struct icmphdr));
-
-	packet packet;
-
-	eth_hdr = createEthernetHeader(sha, dha, htons(0x0800));
-
-	ip_hdr = createIPHeader(4, 5, 0, IPPROTO_ICMP, htons(sizeof(struct iphdr) + sizeof(struct icmphdr)), htons(1), 0, 64, 0, daddr, saddr);
-	ip_hdr->check = ip_checksum((uint8_t*)ip_hdr, sizeof(struct iphdr));
-	
-	packet.interface = interface;	
-	changeEtherHeader(&packet, eth_hdr);
-	changeIPHeader(&packet, ip_hdr);
-	memcpy(packet.payload  + sizeof(struct ether_header) + sizeof(struct iphdr), &icmp_hdr, sizeof(struct icmphdr));
-	packet.len = sizeof(struct ether_header) + sizeof(struct iphdr) + sizeof(struct icmphdr);
-
-	send_packet(&packet);
-	free(eth_hdr);
+	if(type == ICMP_ECHOREPLY)
+	{
+		out->len = frame_icmp_echo_reply(out->payload, m->interface, m->payload, m->len);
+		stats_add(STATS(m->interface, icmp_echo_replies), 1);
+	}
+	else
+	{
+		out->len = frame_icmp_error(out->payload, m->interface, type, code, m->payload, m->len);
+		stats_add(type == ICMP_TIME_EXCEEDED ? STATS(m->interface, icmp_time_exceeded) : STATS(m->interface, icmp_unreachable), 1);
+	}
+	out->interface = m->interface;
+	send_packet_batch(out);
+	packet_put(out);
 }
 
-void sendARP(uint32_t daddr, uint32_t saddr, struct ether_header *eth_hdr, int interface, uint16_t arp_op)
+void sendARP(uint32_t daddr, uint8_t* dha, int interface, uint16_t arp_op)
 {
-	struct arp_header* arp_hdr;
-	packet packet;
-
-	arp_hdr = createARPHeader(daddr, saddr, eth_hdr->ether_shost, eth_hdr->ether_dhost, htons(1), htons(0x0800), 6, 4, arp_op);
-	packet.interface = interface;
-	memset(packet.payload, 0, 1600);
-	changeEtherHeader(&packet, eth_hdr);
-	changeARPHeader(&packet, arp_hdr);
-	packet.len = sizeof(struct arp_header) + sizeof(struct ethhdr);
-
-	send_packet(&packet);
+	packet* out = packet_alloc(packetPool);
+	if(out == NULL)
+	{
+		stats_add(STATS(interface, drops[STATS_DROP_NO_BUFFER]), 1);
+		return;
+	}
+	if(arp_op == ARPOP_REQUEST)
+	{
+		out->len = frame_arp_request(out->payload, interface, daddr);
+		stats_add(STATS(interface, arp_requests_sent), 1);
+	}
+	else
+	{
+		out->len = frame_arp_reply(out->payload, interface, dha, daddr);
+		stats_add(STATS(interface, arp_replies_sent), 1);
+	}
+	out->interface = interface;
+	send_packet_batch(out);
+	packet_put(out);
 }
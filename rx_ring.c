@@ -0,0 +1,81 @@
+#include "rx_ring.h"
+#include <sys/mman.h>
+
+static inline struct tpacket_block_desc *rx_ring_block(struct rx_ring *r, int i)
+{
+	return (struct tpacket_block_desc *)(r->map + (size_t)i * RX_RING_BLOCK_SIZE);
+}
+
+struct rx_ring *rx_ring_create(int sockfd)
+{
+	struct rx_ring *r = calloc(1, sizeof(struct rx_ring));
+	DIE(r == NULL, "calloc rx ring");
+
+	int version = TPACKET_V3;
+	DIE(setsockopt(sockfd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1,
+	    "setsockopt PACKET_VERSION");
+
+	struct tpacket_req3 req;
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = RX_RING_BLOCK_SIZE;
+	req.tp_block_nr = RX_RING_BLOCK_NR;
+	req.tp_frame_size = RX_RING_FRAME_SIZE;
+	req.tp_frame_nr = RX_RING_BLOCK_SIZE / RX_RING_FRAME_SIZE * RX_RING_BLOCK_NR;
+	req.tp_retire_blk_tov = RX_RING_BLOCK_TIMEOUT;
+	DIE(setsockopt(sockfd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1,
+	    "setsockopt PACKET_RX_RING");
+
+	r->map_len = (size_t)RX_RING_BLOCK_SIZE * RX_RING_BLOCK_NR;
+	r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_LOCKED | MAP_POPULATE, sockfd, 0);
+	if (r->map == MAP_FAILED)
+		r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, sockfd, 0);
+	DIE(r->map == MAP_FAILED, "mmap rx ring");
+	return r;
+}
+
+int rx_ring_receive(struct rx_ring *r, packet **m, int max)
+{
+	int count = 0;
+
+	while (count < max) {
+		if (r->pkts_left == 0) {
+			/* Wrapped around, cur is read but not released yet */
+			if (r->done_count == RX_RING_BLOCK_NR)
+				break;
+			struct tpacket_block_desc *block = rx_ring_block(r, r->cur);
+			/* A block is ours once the kernel sets TP_STATUS_USER */
+			if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+			      TP_STATUS_USER))
+				break;
+			r->pkts_left = block->hdr.bh1.num_pkts;
+			r->next_pkt = (struct tpacket3_hdr *)((uint8_t *)block +
+							      block->hdr.bh1.offset_to_first_pkt);
+			if (r->pkts_left == 0) {
+				r->done[r->done_count++] = r->cur;
+				r->cur = (r->cur + 1) % RX_RING_BLOCK_NR;
+				continue;
+			}
+		}
+
+		struct tpacket3_hdr *hdr = r->next_pkt;
+		m[count]->payload = (char *)hdr + hdr->tp_mac;
+		m[count]->len = hdr->tp_snaplen;
+		count++;
+
+		r->next_pkt = (struct tpacket3_hdr *)((uint8_t *)hdr + hdr->tp_next_offset);
+		if (--r->pkts_left == 0) {
+			r->done[r->done_count++] = r->cur;
+			r->cur = (r->cur + 1) % RX_RING_BLOCK_NR;
+		}
+	}
+	return count;
+}
+
+void rx_ring_release(struct rx_ring *r)
+{
+	for (int i = 0; i < r->done_count; i++)
+		__atomic_store_n(&rx_ring_block(r, r->done[i])->hdr.bh1.block_status,
+				 TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+	r->done_count = 0;
+}
@@ -1,6 +1,59 @@
+#define _GNU_SOURCE
 #include "skel.h"
+#include "rx_ring.h"
+#include "tx_ring.h"
+#include "xsk.h"
+#include "packet_pool.h"
+#include "io_backend.h"
+#include "stats.h"
+#include "latency.h"
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/epoll.h>
+#include <poll.h>
 
 int interfaces[ROUTER_NUM_INTERFACES];
+struct interface_info interface_table[ROUTER_NUM_INTERFACES];
+int num_workers = 1;
+static int num_interfaces;
+/* Route netlink socket notified of address and link changes */
+static int netlink_sock = -1;
+
+/* epoll tag of the netlink socket, interfaces are tagged with their index */
+#define EPOLL_NETLINK_TAG ROUTER_NUM_INTERFACES
+/* Kernels before 4.20 lack it in their headers */
+#ifndef PACKET_FANOUT_FLAG_IGNORE_OUTGOING
+#define PACKET_FANOUT_FLAG_IGNORE_OUTGOING 0x4000
+#endif
+
+/*
+ * Everything below is per worker thread. The first worker uses the
+ * sockets in interfaces[], the others open their own in init_worker.
+ */
+static __thread int socks[ROUTER_NUM_INTERFACES];
+static __thread int epoll_fd = -1;
+/* Packets each ready interface may still deliver in this round */
+static __thread int rx_budget[ROUTER_NUM_INTERFACES];
+/* Interface get_packet serves next */
+static __thread int rx_next;
+/* TPACKET_V3 rings, only set up with ROUTER_RX=ring */
+static __thread struct rx_ring *rx_rings[ROUTER_NUM_INTERFACES];
+/* PACKET_TX_RING sockets, only set up with ROUTER_TX=ring */
+static __thread struct tx_ring *tx_rings[ROUTER_NUM_INTERFACES];
+/* Set by redirect_packet_output */
+static __thread void (*output_send)(packet *m);
+static __thread void (*output_flush)(void);
+
+/* Set by on_interface_change */
+static void (*interface_changed)(void);
+
+/* Picked by init() from ROUTER_IO */
+static const struct io_backend *backend;
+
+static int use_rx_ring;
+static int use_tx_ring;
+/* AF_XDP sockets carry all traffic, only with ROUTER_RX=xdp */
+static int use_xsk;
 
 int get_sock(const char *if_name) {
 	int res;
@@ -22,77 +75,332 @@ int get_sock(const char *if_name) {
 	return s;
 }
 
-packet* socket_receive_message(int sockfd, packet *m)
+/*
+ * Receives up to max packets from a socket without blocking.
+ * Returns the number of packets received, 0 when the socket is drained.
+ */
+static int socket_receive_messages(int sockfd, packet **m, int max)
 {
-	/*
-	 * Note that "buffer" should be at least the MTU size of the
-	 * interface, eg 1500 bytes
-	 * */
-	m->len = read(sockfd, m->payload, MAX_LEN);
-	DIE(m->len == -1, "read");
-	return m;
+	struct mmsghdr msgs[RX_BUDGET];
+	struct iovec iov[RX_BUDGET];
+
+	if (max > RX_BUDGET)
+		max = RX_BUDGET;
+	memset(msgs, 0, sizeof(struct mmsghdr) * max);
+	for (int i = 0; i < max; i++) {
+		/*
+		 * Note that "buffer" should be at least the MTU size of the
+		 * interface, eg 1500 bytes
+		 * */
+		m[i]->payload = m[i]->buf;
+		iov[i].iov_base = m[i]->payload;
+		iov[i].iov_len = MAX_LEN;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int n = recvmmsg(sockfd, msgs, max, MSG_DONTWAIT, NULL);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	DIE(n == -1, "recvmmsg");
+	for (int i = 0; i < n; i++)
+		m[i]->len = msgs[i].msg_len;
+	return n;
 }
 
 int send_packet(packet *m)
 {
-	/*
-	 * Note that "buffer" should be at least the MTU size of the
-	 * interface, eg 1500 bytes
-	 * */
-	int ret;
-	ret = write(interfaces[m->interface], m->payload, m->len);
-	DIE(ret == -1, "write");
-	return ret;
+	stats_tx(m);
+	backend->send(m);
+	backend->flush();
+	return m->len;
 }
 
-int get_packet(packet *m)
+/*
+ * Frames waiting to be sent with one sendmmsg per interface. Pool packets
+ * are sent from their own buffer and held until then, anything else is
+ * copied into buf.
+ */
+static __thread struct {
+	int count;
+	struct mmsghdr msgs[TX_BATCH];
+	struct iovec iov[TX_BATCH];
+	packet *held[TX_BATCH];
+	char buf[TX_BATCH][MAX_LEN];
+} tx_batch[ROUTER_NUM_INTERFACES];
+
+static void flush_tx_batch(int interface)
 {
-	int res;
-	fd_set set;
+	int sent = 0;
+
+	while (sent < tx_batch[interface].count) {
+		int ret = sendmmsg(socks[interface], tx_batch[interface].msgs + sent,
+				   tx_batch[interface].count - sent, 0);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		DIE(ret == -1, "sendmmsg");
+		sent += ret;
+	}
+	for (int i = 0; i < tx_batch[interface].count; i++) {
+		if (tx_batch[interface].held[i] != NULL)
+			packet_put(tx_batch[interface].held[i]);
+	}
+	tx_batch[interface].count = 0;
+}
+
+static void socket_send(packet *m)
+{
+	if (use_xsk) {
+		xsk_send(m);
+		return;
+	}
+	if (tx_rings[m->interface] != NULL) {
+		if (!tx_ring_queue(tx_rings[m->interface], m->payload, m->len))
+			stats_add(STATS(m->interface, tx_dropped), 1);
+		return;
+	}
+
+	int i = tx_batch[m->interface].count;
+
+	memset(&tx_batch[m->interface].msgs[i], 0, sizeof(struct mmsghdr));
+	if (m->pool != NULL) {
+		packet_get(m);
+		tx_batch[m->interface].held[i] = m;
+		tx_batch[m->interface].iov[i].iov_base = m->payload;
+	} else {
+		memcpy(tx_batch[m->interface].buf[i], m->payload, m->len);
+		tx_batch[m->interface].held[i] = NULL;
+		tx_batch[m->interface].iov[i].iov_base = tx_batch[m->interface].buf[i];
+	}
+	tx_batch[m->interface].iov[i].iov_len = m->len;
+	tx_batch[m->interface].msgs[i].msg_hdr.msg_iov = &tx_batch[m->interface].iov[i];
+	tx_batch[m->interface].msgs[i].msg_hdr.msg_iovlen = 1;
+	if (++tx_batch[m->interface].count == TX_BATCH)
+		flush_tx_batch(m->interface);
+}
+
+static void socket_flush(void)
+{
+	if (use_xsk) {
+		xsk_flush();
+		return;
+	}
+	for (int i = 0; i < num_interfaces; i++) {
+		if (tx_rings[i] != NULL)
+			tx_ring_kick(tx_rings[i]);	/* what it gives up on goes with the next kick */
+		else if (tx_batch[i].count)
+			flush_tx_batch(i);
+	}
+}
+
+void send_packet_batch(packet *m)
+{
+	if (output_send != NULL) {
+		output_send(m);
+	} else {
+		stats_tx(m);
+		backend->send(m);
+	}
+}
+
+void flush_packet_batches(void)
+{
+	if (output_flush != NULL)
+		output_flush();
+	else
+		backend->flush();
+}
+
+void redirect_packet_output(void (*send)(packet *m), void (*flush)(void))
+{
+	output_send = send;
+	output_flush = flush;
+}
+
+static int open_netlink(void)
+{
+	int s = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK, NETLINK_ROUTE);
+	DIE(s == -1, "socket netlink");
+
+	struct sockaddr_nl addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+	DIE(bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1, "bind netlink");
+	return s;
+}
+
+static void handle_netlink(void)
+{
+	char buf[8192];
+	int changed = 0;
 
-	FD_ZERO(&set);
 	while (1) {
-		for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
-			FD_SET(interfaces[i], &set);
+		ssize_t len = recv(netlink_sock, buf, sizeof(buf), 0);
+		if (len <= 0)
+			break;
+		for (struct nlmsghdr *nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len);
+		     nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_type == RTM_NEWADDR || nh->nlmsg_type == RTM_DELADDR ||
+			    nh->nlmsg_type == RTM_NEWLINK)
+				changed = 1;
 		}
+	}
+	if (changed && refresh_interface_table() && interface_changed != NULL)
+		interface_changed();
+}
 
-		res = select(interfaces[ROUTER_NUM_INTERFACES - 1] + 1, &set,
-				NULL, NULL, NULL);
-		DIE(res == -1, "select");
+void on_interface_change(void (*handler)(void))
+{
+	interface_changed = handler;
+}
+
+static void epoll_add(int fd, uint32_t tag)
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u32 = tag;
+	DIE(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1, "epoll_ctl");
+}
+
+static int socket_receive(packet **m, int max)
+{
+	struct epoll_event events[ROUTER_NUM_INTERFACES + 1];
+	int count = 0;
+	LATENCY_DECLARE(start);
+
+	LATENCY_STAMP(start);
+	/* The previous burst is done with its ring frames */
+	for (int i = 0; i < num_interfaces; i++) {
+		if (rx_rings[i] != NULL)
+			rx_ring_release(rx_rings[i]);
+	}
+	if (use_xsk)
+		xsk_release();
 
-		for (int i = 0; i < ROUTER_NUM_INTERFACES; i++) {
-			if (FD_ISSET(interfaces[i], &set)) {
-				socket_receive_message(interfaces[i], m);
-				m->interface = i;
-				return 0;
+	while (1) {
+		/*
+		 * Serve ready interfaces round-robin, each for at most
+		 * RX_BUDGET packets, so a flooded port cannot starve the rest.
+		 */
+		for (int k = 0; k < num_interfaces && count < max; k++) {
+			int i = rx_next;
+			if (rx_budget[i] > 0) {
+				int want = max - count < rx_budget[i] ? max - count : rx_budget[i];
+				int n;
+				if (use_xsk)
+					n = xsk_receive(i, m + count, want);
+				else if (rx_rings[i] != NULL)
+					n = rx_ring_receive(rx_rings[i], m + count, want);
+				else
+					n = socket_receive_messages(socks[i], m + count, want);
+				for (int j = 0; j < n; j++)
+					m[count + j]->interface = i;
+				count += n;
+				rx_budget[i] = n == want ? rx_budget[i] - n : 0;
+				if (rx_budget[i] > 0)
+					break;	/* max reached, keep serving i next call */
 			}
+			rx_next = (i + 1) % num_interfaces;
+		}
+		if (count > 0) {
+			LATENCY_RECORD(LATENCY_RECEIVE, start);
+			return count;
+		}
+
+		/* Every interface is drained or out of budget, start a new round */
+		int res = epoll_wait(epoll_fd, events, ROUTER_NUM_INTERFACES + 1, -1);
+		if (res == -1 && errno == EINTR)
+			continue;
+		DIE(res == -1, "epoll_wait");
+		LATENCY_STAMP(start);	/* the wait is not receive time */
+
+		for (int e = 0; e < res; e++) {
+			if (events[e].data.u32 == EPOLL_NETLINK_TAG)
+				handle_netlink();
+			else
+				rx_budget[events[e].data.u32] = RX_BUDGET;
 		}
 	}
 	return -1;
 }
 
-char *get_interface_ip(int interface)
+int get_packets(packet **m, int max)
 {
-	struct ifreq ifr;
-	if (interface == 0)
-		sprintf(ifr.ifr_name, "rr-0-1");
-	else {
-		sprintf(ifr.ifr_name, "r-%u", interface - 1);
+	return backend->receive(m, max);
+}
+
+int receive_packets(int interface, packet **m, int max)
+{
+	struct mmsghdr msgs[RX_BUDGET];
+	struct iovec iov[RX_BUDGET];
+
+	if (max > RX_BUDGET)
+		max = RX_BUDGET;
+	memset(msgs, 0, sizeof(struct mmsghdr) * max);
+	for (int i = 0; i < max; i++) {
+		m[i]->payload = m[i]->buf;
+		iov[i].iov_base = m[i]->payload;
+		iov[i].iov_len = MAX_LEN;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
 	}
-	ioctl(interfaces[interface], SIOCGIFADDR, &ifr);
-	return inet_ntoa(((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr);
+
+	int n;
+	do {
+		/* Blocks for the first packet only */
+		n = recvmmsg(interfaces[interface], msgs, max, MSG_WAITFORONE, NULL);
+	} while (n == -1 && errno == EINTR);
+	DIE(n == -1, "recvmmsg");
+	for (int i = 0; i < n; i++) {
+		m[i]->len = msgs[i].msg_len;
+		m[i]->interface = interface;
+	}
+	return n;
+}
+
+int get_packet(packet *m)
+{
+	return get_packets(&m, 1) == 1 ? 0 : -1;
+}
+
+char *get_interface_ip(int interface)
+{
+	struct in_addr addr = { .s_addr = interface_table[interface].ip };
+	return inet_ntoa(addr);
 }
 
 void get_interface_mac(int interface, uint8_t *mac)
 {
-	struct ifreq ifr;
-	if (interface == 0)
-		sprintf(ifr.ifr_name, "rr-0-1");
-	else {
-		sprintf(ifr.ifr_name, "r-%u", interface - 1);
+	memcpy(mac, interface_table[interface].mac, ETH_ALEN);
+}
+
+int refresh_interface_table(void)
+{
+	int changed = 0;
+
+	for (int i = 0; i < num_interfaces; i++) {
+		struct interface_info *info = &interface_table[i];
+		struct interface_info old = *info;
+		struct ifreq ifr;
+
+		memset(&ifr, 0, sizeof(ifr));
+		strncpy(ifr.ifr_name, info->name, IFNAMSIZ - 1);
+		/* An interface without an address keeps 0.0.0.0 */
+		if (ioctl(interfaces[i], SIOCGIFADDR, &ifr) == 0)
+			info->ip = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr.s_addr;
+		else
+			info->ip = 0;
+		if (ioctl(interfaces[i], SIOCGIFHWADDR, &ifr) == 0)
+			memcpy(info->mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+		if (ioctl(interfaces[i], SIOCGIFINDEX, &ifr) == 0)
+			info->ifindex = ifr.ifr_ifindex;
+		if (ioctl(interfaces[i], SIOCGIFMTU, &ifr) == 0)
+			info->mtu = ifr.ifr_mtu;
+		if (info->ip != old.ip || memcmp(info->mac, old.mac, ETH_ALEN) != 0)
+			changed = 1;
 	}
-	ioctl(interfaces[interface], SIOCGIFHWADDR, &ifr);
-	memcpy(mac, ifr.ifr_addr.sa_data, 6);
+	return changed;
 }
 
 static int hex2num(char c)
@@ -135,15 +443,148 @@ int hwaddr_aton(const char *txt, uint8_t *addr)
 	return 0;
 }
 
+unsigned long env_number(const char *name, unsigned long fallback, unsigned long min, unsigned long max)
+{
+	char *value = getenv(name);
+	char *end;
+	char message[128];
+
+	if (value == NULL)
+		return fallback;
+	/* strtoul takes "-1" as ULONG_MAX, so a sign is refused up front */
+	while (*value == ' ' || *value == '\t')
+		value++;
+	errno = 0;
+	unsigned long n = strtoul(value, &end, 10);
+	if (*value == '-' || end == value || *end != '\0' || errno == ERANGE || n < min || n > max) {
+		snprintf(message, sizeof(message), "%s must be a number from %lu to %lu", name, min, max);
+		DIE(1, message);
+	}
+	return n;
+}
+
+/*
+ * Sets up the rings, fanout membership and epoll set of the calling
+ * worker around the packet sockets in socks[].
+ */
+static void setup_worker(void)
+{
+	for (int i = 0; i < num_interfaces; i++) {
+		if (use_rx_ring)
+			rx_rings[i] = rx_ring_create(socks[i]);
+		if (num_workers > 1) {
+			/*
+			 * One fanout group per interface, hashing on the flow
+			 * keeps every flow on one worker and in order.
+			 */
+			int fanout = ((getpid() * ROUTER_NUM_INTERFACES + i) & 0xffff) |
+				     (PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG |
+				      PACKET_FANOUT_FLAG_IGNORE_OUTGOING) << 16;
+			DIE(setsockopt(socks[i], SOL_PACKET, PACKET_FANOUT,
+				       &fanout, sizeof(fanout)) == -1, "setsockopt PACKET_FANOUT");
+		}
+		if (use_tx_ring) {
+			tx_rings[i] = tx_ring_create(interface_table[i].ifindex);
+			/* Frames from the ring socket must not come back in */
+			int one = 1;
+			DIE(setsockopt(socks[i], SOL_PACKET, PACKET_IGNORE_OUTGOING,
+				       &one, sizeof(one)) == -1, "setsockopt PACKET_IGNORE_OUTGOING");
+		}
+	}
+
+	epoll_fd = epoll_create1(0);
+	DIE(epoll_fd == -1, "epoll_create1");
+	for (int i = 0; i < num_interfaces; i++)
+		epoll_add(use_xsk ? xsk_fd(i) : socks[i], i);
+}
+
+void init_sender(int interface)
+{
+	socks[interface] = interfaces[interface];
+	if (use_tx_ring)
+		tx_rings[interface] = tx_ring_create(interface_table[interface].ifindex);
+}
+
+void watch_interfaces(void)
+{
+	struct pollfd pfd = { .fd = netlink_sock, .events = POLLIN };
+
+	while (1) {
+		int res = poll(&pfd, 1, -1);
+		if (res == -1 && errno == EINTR)
+			continue;
+		DIE(res == -1, "poll netlink");
+		handle_netlink();
+	}
+}
+
+static void socket_thread_init(void)
+{
+	for (int i = 0; i < num_interfaces; i++)
+		socks[i] = get_sock(interface_table[i].name);
+	setup_worker();
+}
+
+static void socket_setup(int count)
+{
+	for (int i = 0; i < count; ++i)
+		interfaces[i] = get_sock(interface_table[i].name);
+	refresh_interface_table();
+
+	char *rx = getenv("ROUTER_RX");
+	use_rx_ring = rx != NULL && strcmp(rx, "ring") == 0;
+	char *tx = getenv("ROUTER_TX");
+	use_tx_ring = tx != NULL && strcmp(tx, "ring") == 0;
+	if (rx != NULL && strcmp(rx, "xdp") == 0) {
+		/* Every interface has a single AF_XDP socket on queue 0 */
+		DIE(num_workers > 1, "ROUTER_RX=xdp runs a single worker");
+		int ifindex[ROUTER_NUM_INTERFACES];
+		for (int i = 0; i < count; i++)
+			ifindex[i] = interface_table[i].ifindex;
+		xsk_setup(ifindex, count);
+		use_xsk = 1;
+	}
+
+	/* The calling thread is the first worker and also follows netlink */
+	memcpy(socks, interfaces, sizeof(interfaces));
+	setup_worker();
+	netlink_sock = open_netlink();
+	epoll_add(netlink_sock, EPOLL_NETLINK_TAG);
+}
+
+const struct io_backend socket_backend = {
+	.setup = socket_setup,
+	.thread_init = socket_thread_init,
+	.receive = socket_receive,
+	.send = socket_send,
+	.flush = socket_flush,
+};
+
+void init_worker(void)
+{
+	backend->thread_init();
+}
+
 void init(int argc, char *argv[])
 {
+	DIE(argc > ROUTER_NUM_INTERFACES, "too many interfaces, raise ROUTER_NUM_INTERFACES");
 	for (int i = 0; i < argc; ++i) {
 		printf("Setting up interface: %s\n", argv[i]);
-		interfaces[i] = get_sock(argv[i]);
+		strncpy(interface_table[i].name, argv[i], IFNAMSIZ - 1);
 	}
+	num_interfaces = argc;
+
+	num_workers = env_number("ROUTER_WORKERS", 1, 1, ROUTER_MAX_WORKERS);
+	char *io = getenv("ROUTER_IO");
+	if (io == NULL || strcmp(io, "socket") == 0)
+		backend = &socket_backend;
+	else if (strcmp(io, "pcap") == 0)
+		backend = &pcap_backend;
+	else
+		DIE(1, "unknown ROUTER_IO, use socket or pcap");
+	backend->setup(num_interfaces);
 }
 
-
 uint16_t icmp_checksum(uint16_t *data, size_t size)
 {
 	unsigned long cksum = 0;
@@ -0,0 +1,53 @@
+#include "spsc_ring.h"
+
+struct spsc_ring *spsc_ring_create(uint32_t size)
+{
+	struct spsc_ring *r = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct spsc_ring));
+	DIE(r == NULL, "aligned_alloc spsc ring");
+	memset(r, 0, sizeof(struct spsc_ring));
+
+	uint32_t n = 2;
+	while (n < size)
+		n <<= 1;
+	r->objs = aligned_alloc(CACHE_LINE_SIZE, n * sizeof(void *) < CACHE_LINE_SIZE ?
+				CACHE_LINE_SIZE : n * sizeof(void *));
+	DIE(r->objs == NULL, "aligned_alloc spsc ring slots");
+	r->mask = n - 1;
+	return r;
+}
+
+int spsc_ring_enqueue_burst(struct spsc_ring *r, void * const *objs, int n)
+{
+	uint32_t head = r->head;
+	uint32_t space = r->mask + 1 - (head - r->tail_cache);
+
+	if (space < (uint32_t)n) {
+		r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		space = r->mask + 1 - (head - r->tail_cache);
+		if (space < (uint32_t)n)
+			n = space;
+	}
+	for (int i = 0; i < n; i++)
+		r->objs[(head + i) & r->mask] = objs[i];
+	/* The slots are written before the consumer can see the new head */
+	__atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+int spsc_ring_dequeue_burst(struct spsc_ring *r, void **objs, int n)
+{
+	uint32_t tail = r->tail;
+	uint32_t ready = r->head_cache - tail;
+
+	if (ready < (uint32_t)n) {
+		r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		ready = r->head_cache - tail;
+		if (ready < (uint32_t)n)
+			n = ready;
+	}
+	for (int i = 0; i < n; i++)
+		objs[i] = r->objs[(tail + i) & r->mask];
+	/* The slots are read before the producer can reuse them */
+	__atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+	return n;
+}
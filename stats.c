@@ -0,0 +1,154 @@
+#include "stats.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/un.h>
+
+static struct thread_registry threads;
+/* Threads that did not register, or found the registry full, share this one */
+static struct stats_thread unregistered = { .name = "other", .shared = 1 };
+__thread struct stats_thread *stats_self = &unregistered;
+
+static int served_interfaces;
+
+static const struct {
+	const char *name;
+	size_t offset;
+} fields[] = {
+#define FIELD(f) { #f, offsetof(struct stats_interface, f) }
+	FIELD(rx_packets),
+	FIELD(rx_bytes),
+	FIELD(tx_packets),
+	FIELD(tx_bytes),
+	FIELD(tx_dropped),
+	{ "drop_bad_checksum", offsetof(struct stats_interface, drops[STATS_DROP_BAD_CHECKSUM]) },
+	{ "drop_ttl_expired", offsetof(struct stats_interface, drops[STATS_DROP_TTL_EXPIRED]) },
+	{ "drop_no_route", offsetof(struct stats_interface, drops[STATS_DROP_NO_ROUTE]) },
+	{ "drop_arp_pending", offsetof(struct stats_interface, drops[STATS_DROP_ARP_PENDING]) },
+	{ "drop_queue_full", offsetof(struct stats_interface, drops[STATS_DROP_QUEUE_FULL]) },
+	{ "drop_not_for_us", offsetof(struct stats_interface, drops[STATS_DROP_NOT_FOR_US]) },
+	{ "drop_no_buffer", offsetof(struct stats_interface, drops[STATS_DROP_NO_BUFFER]) },
+	FIELD(arp_requests_sent),
+	FIELD(arp_replies_sent),
+	FIELD(arp_replies_received),
+	FIELD(icmp_echo_replies),
+	FIELD(icmp_time_exceeded),
+	FIELD(icmp_unreachable),
+#undef FIELD
+};
+
+#define FIELD_COUNT (int)(sizeof(fields) / sizeof(fields[0]))
+
+void stats_register(const char *name)
+{
+	if (stats_self != &unregistered)
+		return;
+	struct stats_thread *st = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct stats_thread));
+	DIE(st == NULL, "aligned_alloc stats");
+	memset(st, 0, sizeof(struct stats_thread));
+	strncpy(st->name, name, sizeof(st->name) - 1);
+	if (thread_registry_add(&threads, st) == -1) {
+		free(st);
+		return;
+	}
+	stats_self = st;
+}
+
+static inline uint64_t read_field(struct stats_thread *t, int interface, int field)
+{
+	return __atomic_load_n((uint64_t *)((char *)&t->ifs[interface] + fields[field].offset),
+			       __ATOMIC_RELAXED);
+}
+
+static void dump(FILE *f)
+{
+	int count = thread_registry_count(&threads);
+
+	fprintf(f, "# thread interface counter value\n");
+	for (int t = -1; t < count; t++) {
+		struct stats_thread *st = t < 0 ? &unregistered : thread_registry_get(&threads, t);
+		if (st == NULL)
+			continue;
+		for (int i = 0; i < served_interfaces; i++) {
+			for (int k = 0; k < FIELD_COUNT; k++) {
+				uint64_t v = read_field(st, i, k);
+				if (v != 0)
+					fprintf(f, "%s %s %s %lu\n", st->name, interface_table[i].name,
+						fields[k].name, (unsigned long)v);
+			}
+		}
+	}
+	for (int i = 0; i < served_interfaces; i++) {
+		for (int k = 0; k < FIELD_COUNT; k++) {
+			uint64_t v = read_field(&unregistered, i, k);
+			for (int t = 0; t < count; t++) {
+				struct stats_thread *st = thread_registry_get(&threads, t);
+				if (st != NULL)
+					v += read_field(st, i, k);
+			}
+			fprintf(f, "total %s %s %lu\n", interface_table[i].name, fields[k].name,
+				(unsigned long)v);
+		}
+	}
+}
+
+/*
+ * The dump is built in memory and sent with MSG_NOSIGNAL: a client that
+ * hung up only loses its connection (EPIPE), it must not SIGPIPE the router.
+ */
+static void send_dump(int c)
+{
+	char *buf = NULL;
+	size_t len = 0;
+
+	FILE *f = open_memstream(&buf, &len);
+	if (f == NULL)
+		return;
+	dump(f);
+	if (fclose(f) != 0) {
+		free(buf);
+		return;
+	}
+	for (size_t off = 0; off < len;) {
+		ssize_t n = send(c, buf + off, len - off, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		off += n;
+	}
+	free(buf);
+}
+
+static void *serve_main(void *arg)
+{
+	int s = (int)(long)arg;
+
+	while (1) {
+		int c = accept(s, NULL, NULL);
+		if (c == -1)
+			continue;
+		send_dump(c);
+		close(c);
+	}
+	return NULL;
+}
+
+void stats_serve(const char *path, int num_interfaces)
+{
+	struct sockaddr_un addr;
+	pthread_t thread;
+
+	served_interfaces = num_interfaces;
+	int s = socket(AF_UNIX, SOCK_STREAM, 0);
+	DIE(s == -1, "socket stats");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	DIE(strlen(path) >= sizeof(addr.sun_path), "stats socket path too long");
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	DIE(bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1, "bind stats");
+	DIE(listen(s, 4) == -1, "listen stats");
+	DIE(pthread_create(&thread, NULL, serve_main, (void *)(long)s) != 0, "pthread_create");
+	pthread_detach(thread);
+}
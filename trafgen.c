@@ -0,0 +1,390 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <linux/net_tstamp.h>
+#include <netinet/udp.h>
+#include "skel.h"
+#include "tx_ring.h"
+#include "rng.h"
+
+/*
+ * Traffic generator and sink of the load test, see loadtest.py.
+ *
+ *	trafgen send -i IF -g GW_MAC -d IP[,IP...] [-s SIZE] [-r PPS]
+ *		[-t SECONDS] [-f FLOWS] [-z S] [-m mmsg|ring] [-n ID] [-p PORT]
+ *	trafgen recv [-p PORT] [-t SECONDS] [-w IDLE_SECONDS]
+ *
+ * The sender builds whole UDP frames for the gateway MAC and sends them
+ * on a packet socket with sendmmsg, or through a PACKET_TX_RING with
+ * -m ring. Flow k goes to destination k % (number of IPs) from source
+ * port TRAFGEN_SPORT + k; flows are picked uniformly, or Zipf distributed
+ * with exponent S when -z is given. Every payload carries the sender,
+ * a sequence number and the send time. The receiver takes the receive
+ * time from SO_TIMESTAMPNS, so both ends read the same clock when they
+ * run on one machine.
+ *
+ * Both print one JSON line at the end: the sender its packets per
+ * destination, the receiver what arrived, the pps and the one-way
+ * latency percentiles.
+ */
+
+#define TRAFGEN_PORT 9000
+#define TRAFGEN_SPORT 10000
+#define TRAFGEN_MAGIC 0x7467656e	/* "tgen" */
+#define TRAFGEN_BATCH 32
+#define TRAFGEN_MAX_DESTS 16
+#define TRAFGEN_MAX_SENDERS 64
+
+struct trafgen_payload {
+	uint32_t magic;
+	uint32_t sender;
+	uint64_t seq;
+	uint64_t tx_ns;	/* CLOCK_REALTIME */
+} __attribute__((packed));
+
+#define TRAFGEN_MIN_SIZE (int)(sizeof(struct ether_header) + sizeof(struct iphdr) + \
+			       sizeof(struct udphdr) + sizeof(struct trafgen_payload))
+
+static inline uint64_t realtime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint16_t checksum(const void *data, int len)
+{
+	const uint8_t *p = data;
+	uint32_t sum = 0;
+
+	for (; len > 1; len -= 2, p += 2)
+		sum += p[0] << 8 | p[1];
+	if (len)
+		sum += p[0] << 8;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return htons(~sum);
+}
+
+static void interface_addresses(int s, const char *name, int *ifindex, uint8_t *mac, uint32_t *ip)
+{
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+	DIE(ioctl(s, SIOCGIFINDEX, &ifr) == -1, "SIOCGIFINDEX");
+	*ifindex = ifr.ifr_ifindex;
+	DIE(ioctl(s, SIOCGIFHWADDR, &ifr) == -1, "SIOCGIFHWADDR");
+	memcpy(mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+	DIE(ioctl(s, SIOCGIFADDR, &ifr) == -1, "SIOCGIFADDR");
+	*ip = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr.s_addr;
+}
+
+static int parse_mac(const char *txt, uint8_t *mac)
+{
+	unsigned int b[ETH_ALEN];
+
+	if (sscanf(txt, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != ETH_ALEN)
+		return -1;
+	for (int i = 0; i < ETH_ALEN; i++)
+		mac[i] = b[i];
+	return 0;
+}
+
+static int run_send(int argc, char *argv[])
+{
+	char *ifname = NULL, *gateway = NULL, *dests = NULL, *mode = "mmsg";
+	int size = 64, flows = 1, sender = 0, port = TRAFGEN_PORT;
+	double rate = 0, seconds = 10, zipf = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:g:d:s:r:t:f:z:m:n:p:")) != -1) {
+		switch (opt) {
+		case 'i': ifname = optarg; break;
+		case 'g': gateway = optarg; break;
+		case 'd': dests = optarg; break;
+		case 's': size = atoi(optarg); break;
+		case 'r': rate = atof(optarg); break;
+		case 't': seconds = atof(optarg); break;
+		case 'f': flows = atoi(optarg); break;
+		case 'z': zipf = atof(optarg); break;
+		case 'm': mode = optarg; break;
+		case 'n': sender = atoi(optarg); break;
+		case 'p': port = atoi(optarg); break;
+		default: return 2;
+		}
+	}
+	DIE(ifname == NULL || gateway == NULL || dests == NULL, "send needs -i, -g and -d");
+	if (size < TRAFGEN_MIN_SIZE)
+		size = TRAFGEN_MIN_SIZE;
+	DIE(size > MAX_LEN, "frame size over MAX_LEN");
+	DIE(flows < 1 || flows > 65535 - TRAFGEN_SPORT, "bad flow count");
+
+	uint32_t dst[TRAFGEN_MAX_DESTS];
+	int ndst = 0;
+	for (char *tok = strtok(dests, ","); tok != NULL && ndst < TRAFGEN_MAX_DESTS; tok = strtok(NULL, ","))
+		DIE(inet_pton(AF_INET, tok, &dst[ndst++]) != 1, "bad destination");
+	if (flows < ndst)
+		flows = ndst;
+
+	int s = socket(AF_PACKET, SOCK_RAW, 0);
+	DIE(s == -1, "socket");
+	int ifindex;
+	uint8_t src_mac[ETH_ALEN], gw_mac[ETH_ALEN];
+	uint32_t src_ip;
+	interface_addresses(s, ifname, &ifindex, src_mac, &src_ip);
+	DIE(parse_mac(gateway, gw_mac) != 0, "bad gateway MAC");
+	struct tx_ring *ring = strcmp(mode, "ring") == 0 ? tx_ring_create(ifindex) : NULL;
+
+	/* Cumulative Zipf weights, flows[k] has weight 1 / (k + 1)^zipf */
+	double *cdf = malloc(sizeof(double) * flows);
+	DIE(cdf == NULL, "malloc");
+	double sum = 0;
+	for (int k = 0; k < flows; k++) {
+		sum += zipf > 0 ? 1.0 / pow(k + 1, zipf) : 1.0;
+		cdf[k] = sum;
+	}
+
+	struct sockaddr_ll addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_ifindex = ifindex;
+	addr.sll_halen = ETH_ALEN;
+	memcpy(addr.sll_addr, gw_mac, ETH_ALEN);
+
+	static char frames[TRAFGEN_BATCH][MAX_LEN];
+	struct mmsghdr msgs[TRAFGEN_BATCH];
+	struct iovec iov[TRAFGEN_BATCH];
+	uint64_t sent[TRAFGEN_MAX_DESTS] = { 0 };
+	uint64_t seq = 0;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (int i = 0; i < TRAFGEN_BATCH; i++) {
+		char *f = frames[i];
+		struct ether_header *eth = (struct ether_header *)f;
+		struct iphdr *ip = (struct iphdr *)(eth + 1);
+		struct udphdr *udp = (struct udphdr *)(ip + 1);
+
+		memset(f, 0, size);
+		memcpy(eth->ether_dhost, gw_mac, ETH_ALEN);
+		memcpy(eth->ether_shost, src_mac, ETH_ALEN);
+		eth->ether_type = htons(ETHERTYPE_IP);
+		ip->version = 4;
+		ip->ihl = 5;
+		ip->tot_len = htons(size - sizeof(struct ether_header));
+		ip->ttl = 64;
+		ip->protocol = IPPROTO_UDP;
+		ip->saddr = src_ip;
+		udp->dest = htons(port);
+		udp->len = htons(size - sizeof(struct ether_header) - sizeof(struct iphdr));
+		/* UDP checksum 0: not computed */
+		iov[i].iov_base = f;
+		iov[i].iov_len = size;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &addr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(addr);
+	}
+
+	uint64_t start = realtime_ns();
+	uint64_t end = start + (uint64_t)(seconds * 1e9);
+	uint64_t now = start;
+	while (now < end) {
+		if (rate > 0) {
+			/* Wait for the time the next batch is due */
+			uint64_t due = start + (uint64_t)(seq * 1e9 / rate);
+			if (due > now) {
+				if (due - now > 200000) {
+					struct timespec ts = { 0, (due - now) / 2 };
+					nanosleep(&ts, NULL);
+				}
+				now = realtime_ns();
+				continue;
+			}
+		}
+		for (int i = 0; i < TRAFGEN_BATCH; i++) {
+			struct iphdr *ip = (struct iphdr *)(frames[i] + sizeof(struct ether_header));
+			struct udphdr *udp = (struct udphdr *)(ip + 1);
+			struct trafgen_payload *p = (struct trafgen_payload *)(udp + 1);
+			int flow = 0;
+
+			if (flows > 1) {
+				double u = (rng() >> 11) * (1.0 / 9007199254740992.0) * sum;
+				int lo = 0, hi = flows - 1;
+				while (lo < hi) {
+					int mid = (lo + hi) / 2;
+					if (cdf[mid] < u)
+						lo = mid + 1;
+					else
+						hi = mid;
+				}
+				flow = lo;
+			}
+			ip->daddr = dst[flow % ndst];
+			ip->id = htons(seq);
+			ip->check = 0;
+			ip->check = checksum(ip, sizeof(struct iphdr));
+			udp->source = htons(TRAFGEN_SPORT + flow);
+			p->magic = htonl(TRAFGEN_MAGIC);
+			p->sender = sender;
+			p->seq = seq++;
+			p->tx_ns = realtime_ns();
+			sent[flow % ndst]++;
+			/* A frame the full ring dropped never left */
+			if (ring != NULL && !tx_ring_queue(ring, frames[i], size))
+				sent[flow % ndst]--;
+		}
+		if (ring != NULL) {
+			tx_ring_kick(ring);
+		} else {
+			int done = 0;
+			while (done < TRAFGEN_BATCH) {
+				int n = sendmmsg(s, msgs + done, TRAFGEN_BATCH - done, 0);
+				if (n == -1 && (errno == EINTR || errno == ENOBUFS))
+					continue;
+				DIE(n == -1, "sendmmsg");
+				done += n;
+			}
+		}
+		now = realtime_ns();
+	}
+
+	double elapsed = (now - start) / 1e9;
+	printf("{\"role\": \"send\", \"sender\": %d, \"packets\": %lu, \"seconds\": %.3f, \"pps\": %.0f, \"size\": %d, \"sent\": {",
+	       sender, (unsigned long)seq, elapsed, seq / elapsed, size);
+	for (int i = 0; i < ndst; i++) {
+		struct in_addr a = { .s_addr = dst[i] };
+		printf("%s\"%s\": %lu", i ? ", " : "", inet_ntoa(a), (unsigned long)sent[i]);
+	}
+	printf("}}\n");
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int run_recv(int argc, char *argv[])
+{
+	int port = TRAFGEN_PORT;
+	double seconds = 0, idle = 2;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:t:w:")) != -1) {
+		switch (opt) {
+		case 'p': port = atoi(optarg); break;
+		case 't': seconds = atof(optarg); break;
+		case 'w': idle = atof(optarg); break;
+		default: return 2;
+		}
+	}
+
+	int s = socket(AF_INET, SOCK_DGRAM, 0);
+	DIE(s == -1, "socket");
+	int bufsize = 1 << 25, one = 1;
+	setsockopt(s, SOL_SOCKET, SO_RCVBUFFORCE, &bufsize, sizeof(bufsize));
+	setsockopt(s, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+	DIE(setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) == -1, "SO_TIMESTAMPNS");
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+	DIE(bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1, "bind");
+	struct timeval tv = { 0, 100000 };
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	static char bufs[TRAFGEN_BATCH][MAX_LEN];
+	static char ctrl[TRAFGEN_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+	struct mmsghdr msgs[TRAFGEN_BATCH];
+	struct iovec iov[TRAFGEN_BATCH];
+	size_t cap = 1 << 20, count = 0;
+	uint64_t *lat = malloc(sizeof(uint64_t) * cap);
+	uint64_t bytes = 0, reordered = 0;
+	int64_t last_seq[TRAFGEN_MAX_SENDERS];
+	DIE(lat == NULL, "malloc");
+	memset(last_seq, -1, sizeof(last_seq));
+
+	/* first and last are receive timestamps, seen is the time of the last batch */
+	uint64_t start = realtime_ns(), first = 0, last = 0, seen = 0;
+	while (1) {
+		uint64_t now = realtime_ns();
+		if (seconds > 0 && now - start > seconds * 1e9)
+			break;
+		if (count > 0 && now - seen > idle * 1e9)
+			break;
+
+		memset(msgs, 0, sizeof(msgs));
+		for (int i = 0; i < TRAFGEN_BATCH; i++) {
+			iov[i].iov_base = bufs[i];
+			iov[i].iov_len = MAX_LEN;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_control = ctrl[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+		}
+		int n = recvmmsg(s, msgs, TRAFGEN_BATCH, MSG_WAITFORONE, NULL);
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			continue;
+		DIE(n == -1, "recvmmsg");
+
+		for (int i = 0; i < n; i++) {
+			struct trafgen_payload *p = (struct trafgen_payload *)bufs[i];
+			if (msgs[i].msg_len < sizeof(*p) || p->magic != htonl(TRAFGEN_MAGIC))
+				continue;
+			uint64_t rx_ns = realtime_ns();
+			for (struct cmsghdr *c = CMSG_FIRSTHDR(&msgs[i].msg_hdr); c != NULL;
+			     c = CMSG_NXTHDR(&msgs[i].msg_hdr, c)) {
+				if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+					struct timespec *ts = (struct timespec *)CMSG_DATA(c);
+					rx_ns = ts->tv_sec * 1000000000ull + ts->tv_nsec;
+				}
+			}
+			if (count == cap) {
+				cap *= 2;
+				lat = realloc(lat, sizeof(uint64_t) * cap);
+				DIE(lat == NULL, "realloc");
+			}
+			lat[count++] = rx_ns > p->tx_ns ? rx_ns - p->tx_ns : 0;
+			bytes += msgs[i].msg_len;
+			if (p->sender < TRAFGEN_MAX_SENDERS) {
+				if ((int64_t)p->seq < last_seq[p->sender])
+					reordered++;
+				else
+					last_seq[p->sender] = p->seq;
+			}
+			if (first == 0)
+				first = rx_ns;
+			last = rx_ns;
+		}
+		seen = realtime_ns();
+	}
+
+	double elapsed = count > 1 ? (last - first) / 1e9 : 0;
+	uint64_t p50 = 0, p99 = 0, p999 = 0, max = 0;
+	if (count > 0) {
+		qsort(lat, count, sizeof(uint64_t), cmp_u64);
+		p50 = lat[count / 2];
+		p99 = lat[count * 99 / 100];
+		p999 = lat[count * 999 / 1000];
+		max = lat[count - 1];
+	}
+	printf("{\"role\": \"recv\", \"packets\": %lu, \"bytes\": %lu, \"reordered\": %lu, \"seconds\": %.3f, "
+	       "\"pps\": %.0f, \"lat_p50_ns\": %lu, \"lat_p99_ns\": %lu, \"lat_p999_ns\": %lu, \"lat_max_ns\": %lu}\n",
+	       (unsigned long)count, (unsigned long)bytes, (unsigned long)reordered, elapsed,
+	       elapsed > 0 ? count / elapsed : 0, (unsigned long)p50, (unsigned long)p99,
+	       (unsigned long)p999, (unsigned long)max);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	if (argc >= 2 && strcmp(argv[1], "send") == 0)
+		return run_send(argc - 1, argv + 1);
+	if (argc >= 2 && strcmp(argv[1], "recv") == 0)
+		return run_recv(argc - 1, argv + 1);
+	fprintf(stderr, "usage: %s send|recv [options], see trafgen.c\n", argv[0]);
+	return 2;
+}
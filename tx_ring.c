@@ -0,0 +1,101 @@
+#include "tx_ring.h"
+#include <poll.h>
+#include <sys/mman.h>
+
+/* Frame data starts right after the aligned tpacket2 header */
+#define TX_RING_DATA_OFFSET (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+
+static inline struct tpacket2_hdr *tx_ring_slot(struct tx_ring *r, int i)
+{
+	return (struct tpacket2_hdr *)(r->map + (size_t)i * TX_RING_FRAME_SIZE);
+}
+
+struct tx_ring *tx_ring_create(int ifindex)
+{
+	struct tx_ring *r = calloc(1, sizeof(struct tx_ring));
+	DIE(r == NULL, "calloc tx ring");
+
+	r->sockfd = socket(AF_PACKET, SOCK_RAW, 0);
+	DIE(r->sockfd == -1, "socket tx ring");
+
+	int version = TPACKET_V2;
+	DIE(setsockopt(r->sockfd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1,
+	    "setsockopt PACKET_VERSION");
+	int one = 1;
+	setsockopt(r->sockfd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+
+	struct tpacket_req req;
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = TX_RING_BLOCK_SIZE;
+	req.tp_frame_size = TX_RING_FRAME_SIZE;
+	req.tp_frame_nr = TX_RING_FRAME_NR;
+	req.tp_block_nr = TX_RING_FRAME_NR * TX_RING_FRAME_SIZE / TX_RING_BLOCK_SIZE;
+	DIE(setsockopt(r->sockfd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) == -1,
+	    "setsockopt PACKET_TX_RING");
+
+	struct sockaddr_ll addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_ifindex = ifindex;
+	DIE(bind(r->sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1, "bind tx ring");
+
+	r->map_len = (size_t)TX_RING_FRAME_NR * TX_RING_FRAME_SIZE;
+	r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, r->sockfd, 0);
+	DIE(r->map == MAP_FAILED, "mmap tx ring");
+	return r;
+}
+
+/* Waits up to a millisecond for the socket to take frames again */
+static void tx_ring_wait(struct tx_ring *r)
+{
+	struct pollfd pfd = { .fd = r->sockfd, .events = POLLOUT };
+
+	poll(&pfd, 1, 1);
+}
+
+bool tx_ring_queue(struct tx_ring *r, const char *frame, int len)
+{
+	struct tpacket2_hdr *slot = tx_ring_slot(r, r->cur);
+
+	/* Ring full, push what is queued and wait a while for the slot to free up */
+	for (int waited = 0; __atomic_load_n(&slot->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE;
+	     waited++) {
+		if (slot->tp_status == TP_STATUS_WRONG_FORMAT) {
+			__atomic_store_n(&slot->tp_status, TP_STATUS_AVAILABLE, __ATOMIC_RELEASE);
+			break;
+		}
+		if (waited == TX_RING_WAIT_MS)
+			return false;
+		tx_ring_kick(r);
+		tx_ring_wait(r);
+	}
+
+	if (len > TX_RING_FRAME_SIZE - (int)TX_RING_DATA_OFFSET)
+		len = TX_RING_FRAME_SIZE - TX_RING_DATA_OFFSET;
+	memcpy((uint8_t *)slot + TX_RING_DATA_OFFSET, frame, len);
+	slot->tp_len = len;
+	__atomic_store_n(&slot->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+	r->cur = (r->cur + 1) % TX_RING_FRAME_NR;
+	r->queued++;
+	return true;
+}
+
+bool tx_ring_kick(struct tx_ring *r)
+{
+	if (r->queued == 0)
+		return true;
+	for (int waited = 0;; waited++) {
+		if (send(r->sockfd, NULL, 0, 0) != -1)
+			break;
+		if (errno == EINTR)
+			continue;
+		DIE(errno != ENOBUFS && errno != EAGAIN, "send tx ring");
+		/* The device queue is full, wait for room instead of spinning */
+		if (waited == TX_RING_WAIT_MS)
+			return false;
+		tx_ring_wait(r);
+	}
+	r->queued = 0;
+	return true;
+}
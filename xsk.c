@@ -0,0 +1,379 @@
+#include "xsk.h"
+#include "stats.h"
+#include <stddef.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+/* Producer/consumer view of one mmap'ed AF_XDP ring */
+struct xsk_ring {
+	uint32_t *producer;
+	uint32_t *consumer;
+	void *descs;
+	uint32_t mask;
+	uint32_t cached;	/* local producer or consumer index */
+};
+
+struct xsk_socket {
+	int fd;
+	int ifindex;
+	struct xsk_ring fill;
+	struct xsk_ring comp;
+	struct xsk_ring rx;
+	struct xsk_ring tx;
+	int tx_queued;	/* descriptors written since the last wakeup */
+};
+
+static struct xsk_socket xsks[ROUTER_NUM_INTERFACES];
+static int num_xsks;
+static uint8_t *umem;
+
+/* Stack of free frame addresses */
+static uint64_t free_frames[XSK_NUM_FRAMES];
+static int free_count;
+
+/* Frames handed out by xsk_receive since the last xsk_release */
+static uint64_t held[XSK_NUM_FRAMES];
+static int held_count;
+/* Set when a held frame went out on a TX ring */
+static uint8_t frame_sent[XSK_NUM_FRAMES];
+
+static void free_frame(uint64_t addr)
+{
+	free_frames[free_count++] = addr - addr % XSK_FRAME_SIZE;
+}
+
+static inline uint32_t ring_free(struct xsk_ring *r)
+{
+	return XSK_RING_SIZE - (r->cached - __atomic_load_n(r->consumer, __ATOMIC_ACQUIRE));
+}
+
+static inline uint32_t ring_avail(struct xsk_ring *r)
+{
+	return __atomic_load_n(r->producer, __ATOMIC_ACQUIRE) - r->cached;
+}
+
+static void map_ring(int fd, struct xsk_ring *r, struct xdp_ring_offset *off,
+		     uint64_t pgoff, size_t desc_size, int is_producer)
+{
+	size_t len = off->desc + XSK_RING_SIZE * desc_size;
+	uint8_t *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			    fd, pgoff);
+	DIE(map == MAP_FAILED, "mmap xsk ring");
+
+	r->producer = (uint32_t *)(map + off->producer);
+	r->consumer = (uint32_t *)(map + off->consumer);
+	r->descs = map + off->desc;
+	r->mask = XSK_RING_SIZE - 1;
+	r->cached = is_producer ? *r->producer : *r->consumer;
+}
+
+static void fill_ring_refill(struct xsk_socket *x)
+{
+	uint32_t n = ring_free(&x->fill);
+
+	if (n > (uint32_t)free_count)
+		n = free_count;
+	for (uint32_t i = 0; i < n; i++)
+		((uint64_t *)x->fill.descs)[(x->fill.cached + i) & x->fill.mask] =
+			free_frames[--free_count];
+	x->fill.cached += n;
+	__atomic_store_n(x->fill.producer, x->fill.cached, __ATOMIC_RELEASE);
+}
+
+static void comp_ring_drain(struct xsk_socket *x)
+{
+	uint32_t n = ring_avail(&x->comp);
+
+	for (uint32_t i = 0; i < n; i++)
+		free_frame(((uint64_t *)x->comp.descs)[(x->comp.cached + i) & x->comp.mask]);
+	x->comp.cached += n;
+	__atomic_store_n(x->comp.consumer, x->comp.cached, __ATOMIC_RELEASE);
+}
+
+static void xsk_open(struct xsk_socket *x, int ifindex, int shared_fd)
+{
+	int size = XSK_RING_SIZE;
+
+	x->fd = socket(AF_XDP, SOCK_RAW, 0);
+	DIE(x->fd == -1, "socket AF_XDP");
+	x->ifindex = ifindex;
+
+	if (shared_fd == -1) {
+		struct xdp_umem_reg reg;
+		memset(&reg, 0, sizeof(reg));
+		reg.addr = (uintptr_t)umem;
+		reg.len = (uint64_t)XSK_NUM_FRAMES * XSK_FRAME_SIZE;
+		reg.chunk_size = XSK_FRAME_SIZE;
+		DIE(setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) == -1,
+		    "setsockopt XDP_UMEM_REG");
+	}
+	/* Sockets sharing the UMEM across devices still need their own FQ/CQ */
+	DIE(setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) == -1,
+	    "setsockopt XDP_UMEM_FILL_RING");
+	DIE(setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) == -1,
+	    "setsockopt XDP_UMEM_COMPLETION_RING");
+	DIE(setsockopt(x->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) == -1,
+	    "setsockopt XDP_RX_RING");
+	DIE(setsockopt(x->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) == -1,
+	    "setsockopt XDP_TX_RING");
+
+	struct xdp_mmap_offsets off;
+	socklen_t optlen = sizeof(off);
+	DIE(getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) == -1,
+	    "getsockopt XDP_MMAP_OFFSETS");
+	map_ring(x->fd, &x->fill, &off.fr, XDP_UMEM_PGOFF_FILL_RING, sizeof(uint64_t), 1);
+	map_ring(x->fd, &x->comp, &off.cr, XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(uint64_t), 0);
+	map_ring(x->fd, &x->rx, &off.rx, XDP_PGOFF_RX_RING, sizeof(struct xdp_desc), 0);
+	map_ring(x->fd, &x->tx, &off.tx, XDP_PGOFF_TX_RING, sizeof(struct xdp_desc), 1);
+
+	struct sockaddr_xdp addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sxdp_family = AF_XDP;
+	addr.sxdp_ifindex = ifindex;
+	addr.sxdp_queue_id = 0;
+	if (shared_fd == -1) {
+		addr.sxdp_flags = XDP_COPY;
+	} else {
+		addr.sxdp_flags = XDP_SHARED_UMEM;
+		addr.sxdp_shared_umem_fd = shared_fd;
+	}
+	DIE(bind(x->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1, "bind AF_XDP");
+}
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*
+ * Redirects every frame to the AF_XDP socket of its RX queue:
+ *	return bpf_redirect_map(&xsks_map, ctx->rx_queue_index, XDP_PASS);
+ * Frames go up the stack when no socket is bound to the queue.
+ */
+static int load_redirect_prog(int map_fd)
+{
+	struct bpf_insn insns[] = {
+		{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1,
+		  .off = offsetof(struct xdp_md, rx_queue_index) },
+		{ .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1,
+		  .src_reg = BPF_PSEUDO_MAP_FD, .imm = map_fd },
+		{ 0 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = XDP_PASS },
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	static char log[4096];
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uintptr_t)insns;
+	attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+	attr.license = (uintptr_t)"GPL";
+	attr.log_buf = (uintptr_t)log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+	int fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (fd == -1)
+		fprintf(stderr, "%s\n", log);
+	DIE(fd == -1, "BPF_PROG_LOAD");
+	return fd;
+}
+
+/* Attaches prog_fd in generic mode, -1 detaches */
+static void attach_prog(int ifindex, int prog_fd)
+{
+	struct {
+		struct nlmsghdr nh;
+		struct ifinfomsg ifi;
+		char attrs[64];
+	} req;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+	req.nh.nlmsg_type = RTM_SETLINK;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	req.ifi.ifi_family = AF_UNSPEC;
+	req.ifi.ifi_index = ifindex;
+
+	struct rtattr *xdp = (struct rtattr *)((char *)&req + NLMSG_ALIGN(req.nh.nlmsg_len));
+	xdp->rta_type = IFLA_XDP | NLA_F_NESTED;
+	xdp->rta_len = RTA_LENGTH(0);
+
+	struct rtattr *fd = (struct rtattr *)((char *)xdp + xdp->rta_len);
+	fd->rta_type = IFLA_XDP_FD;
+	fd->rta_len = RTA_LENGTH(sizeof(int));
+	memcpy(RTA_DATA(fd), &prog_fd, sizeof(int));
+	xdp->rta_len += RTA_ALIGN(fd->rta_len);
+
+	struct rtattr *flags = (struct rtattr *)((char *)xdp + xdp->rta_len);
+	uint32_t mode = XDP_FLAGS_SKB_MODE;
+	flags->rta_type = IFLA_XDP_FLAGS;
+	flags->rta_len = RTA_LENGTH(sizeof(uint32_t));
+	memcpy(RTA_DATA(flags), &mode, sizeof(uint32_t));
+	xdp->rta_len += RTA_ALIGN(flags->rta_len);
+
+	req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + xdp->rta_len;
+
+	int s = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	DIE(s == -1, "socket netlink");
+	DIE(send(s, &req, req.nh.nlmsg_len, 0) == -1, "send RTM_SETLINK");
+
+	char buf[4096];
+	int len = recv(s, buf, sizeof(buf), 0);
+	DIE(len == -1, "recv RTM_SETLINK");
+	struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+	if (nh->nlmsg_type == NLMSG_ERROR) {
+		struct nlmsgerr *err = NLMSG_DATA(nh);
+		errno = -err->error;
+		DIE(err->error != 0 && prog_fd != -1, "attach XDP program");
+	}
+	close(s);
+}
+
+static void xsk_detach(void)
+{
+	for (int i = 0; i < num_xsks; i++)
+		attach_prog(xsks[i].ifindex, -1);
+}
+
+void xsk_setup(const int *ifindex, int n)
+{
+	/* Kernels before 5.11 charge maps and programs to RLIMIT_MEMLOCK */
+	struct rlimit rl = { RLIM_INFINITY, RLIM_INFINITY };
+	setrlimit(RLIMIT_MEMLOCK, &rl);
+
+	umem = mmap(NULL, (size_t)XSK_NUM_FRAMES * XSK_FRAME_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	DIE(umem == MAP_FAILED, "mmap umem");
+	for (int i = XSK_NUM_FRAMES - 1; i >= 0; i--)
+		free_frame((uint64_t)i * XSK_FRAME_SIZE);
+
+	num_xsks = n;
+	for (int i = 0; i < n; i++) {
+		xsk_open(&xsks[i], ifindex[i], i == 0 ? -1 : xsks[0].fd);
+		fill_ring_refill(&xsks[i]);
+	}
+
+	/* Every device redirects queue 0, so each gets its own map and program */
+	for (int i = 0; i < n; i++) {
+		union bpf_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.map_type = BPF_MAP_TYPE_XSKMAP;
+		attr.key_size = sizeof(int);
+		attr.value_size = sizeof(int);
+		attr.max_entries = 1;
+		int map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+		DIE(map_fd == -1, "BPF_MAP_CREATE xskmap");
+
+		int key = 0;
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = map_fd;
+		attr.key = (uintptr_t)&key;
+		attr.value = (uintptr_t)&xsks[i].fd;
+		DIE(sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1, "BPF_MAP_UPDATE_ELEM");
+		attach_prog(ifindex[i], load_redirect_prog(map_fd));
+	}
+	atexit(xsk_detach);
+}
+
+int xsk_fd(int interface)
+{
+	return xsks[interface].fd;
+}
+
+int xsk_receive(int interface, packet **m, int max)
+{
+	struct xsk_socket *x = &xsks[interface];
+	uint32_t n = ring_avail(&x->rx);
+
+	if (n > (uint32_t)max)
+		n = max;
+	for (uint32_t i = 0; i < n; i++) {
+		struct xdp_desc *d = &((struct xdp_desc *)x->rx.descs)[(x->rx.cached + i) & x->rx.mask];
+		m[i]->payload = (char *)umem + d->addr;
+		m[i]->len = d->len;
+		held[held_count++] = d->addr;
+	}
+	x->rx.cached += n;
+	__atomic_store_n(x->rx.consumer, x->rx.cached, __ATOMIC_RELEASE);
+	return n;
+}
+
+void xsk_release(void)
+{
+	for (int i = 0; i < held_count; i++) {
+		uint64_t frame = held[i] / XSK_FRAME_SIZE;
+		if (frame_sent[frame])
+			frame_sent[frame] = 0;	/* the completion ring frees it */
+		else
+			free_frame(held[i]);
+	}
+	held_count = 0;
+	for (int i = 0; i < num_xsks; i++) {
+		comp_ring_drain(&xsks[i]);
+		fill_ring_refill(&xsks[i]);
+	}
+}
+
+void xsk_send(packet *m)
+{
+	struct xsk_socket *x = &xsks[m->interface];
+	uint64_t addr;
+
+	if (ring_free(&x->tx) == 0)
+		xsk_flush();
+	if (ring_free(&x->tx) == 0) {
+		/* TX ring full, drop; send_packet_batch counted it as sent */
+		stats_add(STATS(m->interface, tx_dropped), 1);
+		return;
+	}
+
+	if ((uint8_t *)m->payload >= umem &&
+	    (uint8_t *)m->payload < umem + (size_t)XSK_NUM_FRAMES * XSK_FRAME_SIZE) {
+		/* Already in the UMEM, pass the frame on without copying it */
+		addr = (uint8_t *)m->payload - umem;
+		frame_sent[addr / XSK_FRAME_SIZE] = 1;
+	} else {
+		if (free_count == 0)
+			comp_ring_drain(x);
+		if (free_count == 0) {
+			/* No free frame to copy into, drop */
+			stats_add(STATS(m->interface, drops[STATS_DROP_NO_BUFFER]), 1);
+			return;
+		}
+		addr = free_frames[--free_count];
+		memcpy(umem + addr, m->payload, m->len);
+	}
+
+	struct xdp_desc *d = &((struct xdp_desc *)x->tx.descs)[x->tx.cached & x->tx.mask];
+	d->addr = addr;
+	d->len = m->len;
+	d->options = 0;
+	x->tx.cached++;
+	__atomic_store_n(x->tx.producer, x->tx.cached, __ATOMIC_RELEASE);
+	x->tx_queued++;
+}
+
+void xsk_flush(void)
+{
+	for (int i = 0; i < num_xsks; i++) {
+		struct xsk_socket *x = &xsks[i];
+		if (x->tx_queued) {
+			/* Copy mode only transmits on a wakeup */
+			sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+			x->tx_queued = 0;
+		}
+		comp_ring_drain(x);
+	}
+}